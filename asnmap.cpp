@@ -0,0 +1,148 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+
+#include "asnmap.h"
+#include "util.h"
+
+using namespace std;
+
+typedef unsigned __int128 uint128;
+
+static uint128 ToInt(const CNetAddr &addr) {
+  struct in6_addr addr6;
+  addr.GetIn6Addr(&addr6);
+  uint128 n = 0;
+  for (int i = 0; i < 16; i++)
+    n = (n << 8) | addr6.s6_addr[i];
+  return n;
+}
+
+static CNetAddr FromInt(uint128 n) {
+  struct in6_addr addr6;
+  for (int i = 15; i >= 0; i--) {
+    addr6.s6_addr[i] = n & 0xFF;
+    n >>= 8;
+  }
+  return CNetAddr(addr6);
+}
+
+// cover first..last with the fewest aligned prefixes
+void CAsnMap::InsertRange(const CNetAddr &first, const CNetAddr &last, const CAsnEntry &entry) {
+  uint128 a = ToInt(first), b = ToInt(last);
+  while (a <= b) {
+    int k = 0; // the prefix covers 2^k addresses
+    while (k < 127 && ((a >> k) & 1) == 0 && a + (((uint128)2 << k) - 1) <= b)
+      k++;
+    trie.Insert(FromInt(a), 128 - k, entry);
+    uint128 end = a + (((uint128)1 << k) - 1);
+    if (end >= b)
+      break;
+    a = end + 1;
+  }
+}
+
+// numeric address, without the IsValid checks of CNetAddr (the tables
+// include reserved ranges)
+static bool ParseAddr(const char *str, CNetAddr &addr, bool &fIPv4) {
+  struct in_addr addr4;
+  struct in6_addr addr6;
+  if (inet_pton(AF_INET, str, &addr4) == 1) {
+    addr = CNetAddr(addr4);
+    fIPv4 = true;
+    return true;
+  }
+  if (inet_pton(AF_INET6, str, &addr6) == 1) {
+    addr = CNetAddr(addr6);
+    fIPv4 = false;
+    return true;
+  }
+  return false;
+}
+
+static bool ParsePrefix(char *str, CNetAddr &addr, int &nBits) {
+  char *slash = strchr(str, '/');
+  *slash = 0;
+  bool fIPv4;
+  if (!ParseAddr(str, addr, fIPv4))
+    return false;
+  char *end;
+  long n = strtol(slash + 1, &end, 10);
+  if (*end || end == slash + 1 || n < 0 || n > (fIPv4 ? 32 : 128))
+    return false;
+  nBits = fIPv4 ? n + 96 : n;
+  return true;
+}
+
+static bool ParseAsn(const char *str, uint32_t &asn) {
+  if (strncasecmp(str, "AS", 2) == 0)
+    str += 2;
+  char *end;
+  unsigned long n = strtoul(str, &end, 10);
+  if (*end || end == str || n > 0xFFFFFFFFUL)
+    return false;
+  asn = n;
+  return true;
+}
+
+static uint16_t ParseCountry(const char *str) {
+  if (!str || strlen(str) != 2 || strcmp(str, "--") == 0 || strcasecmp(str, "None") == 0)
+    return 0;
+  char cc[2] = {(char)toupper(str[0]), (char)toupper(str[1])};
+  return MakeCountry(cc);
+}
+
+bool CAsnMap::Load(const char *path, string &strError) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    strError = strprintf("cannot open %s", path);
+    return false;
+  }
+  trie.clear();
+  nLines = 0;
+  char line[4096];
+  int nLine = 0;
+  bool fOk = true;
+  while (fgets(line, sizeof(line), file)) {
+    nLine++;
+    char *save = NULL;
+    char *field[4] = {};
+    int nFields = 0;
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok && nFields < 4; tok = strtok_r(NULL, " \t\r\n", &save))
+      field[nFields++] = tok;
+    if (nFields == 0 || field[0][0] == '#')
+      continue;
+    CAsnEntry entry;
+    if (strchr(field[0], '/')) {
+      CNetAddr network;
+      int nBits;
+      if (nFields < 2 || !ParsePrefix(field[0], network, nBits) || !ParseAsn(field[1], entry.asn)) {
+        fOk = false;
+        break;
+      }
+      entry.country = ParseCountry(field[2]);
+      if (entry.asn)
+        trie.Insert(network, nBits, entry);
+    } else {
+      CNetAddr first, last;
+      bool fFirstIPv4, fLastIPv4;
+      if (nFields < 3 || !ParseAddr(field[0], first, fFirstIPv4) || !ParseAddr(field[1], last, fLastIPv4) || fFirstIPv4 != fLastIPv4 || !ParseAsn(field[2], entry.asn)) {
+        fOk = false;
+        break;
+      }
+      entry.country = ParseCountry(field[3]);
+      if (entry.asn && !(last < first))
+        InsertRange(first, last, entry);
+    }
+    nLines++;
+  }
+  fclose(file);
+  if (!fOk) {
+    strError = strprintf("%s:%i: malformed line", path, nLine);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,46 @@
+#ifndef _ASNMAP_H_
+#define _ASNMAP_H_ 1
+
+#include <stdint.h>
+
+#include <string>
+
+#include "netbase.h"
+#include "prefixtrie.h"
+
+struct CAsnEntry {
+  uint32_t asn;     // 0 if unknown
+  uint16_t country; // two ASCII letters, first in the high byte; 0 if unknown
+};
+
+static inline uint16_t MakeCountry(const char *cc) {
+  return ((unsigned char)cc[0] << 8) | (unsigned char)cc[1];
+}
+
+// Origin AS and country of address prefixes, from a local file (see Load),
+// for answers that cap nodes per AS and prefer the client's country.
+class CAsnMap {
+private:
+  CPrefixTrie<CAsnEntry> trie;
+  int nLines;
+
+  void InsertRange(const CNetAddr &first, const CNetAddr &last, const CAsnEntry &entry);
+
+public:
+  CAsnMap() : nLines(0) {}
+
+  // Read a whitespace-separated file with one of these line formats:
+  //   <prefix>/<bits> <asn> [<country>]
+  //   <first ip> <last ip> <asn> <country> [<description>]  (iptoasn.com TSV)
+  // where asn may carry an "AS" prefix. Lines with asn 0 ("not routed"),
+  // empty lines and lines starting with # are skipped. Returns false (and
+  // sets strError) if the file can't be read or has a malformed line.
+  bool Load(const char *path, std::string &strError);
+
+  // pnBits: as in CPrefixTrie::Lookup
+  const CAsnEntry *Lookup(const CNetAddr &addr, int *pnBits = NULL) const { return trie.Lookup(addr, pnBits); }
+  int GetPrefixCount() const { return trie.size(); }
+  int GetLineCount() const { return nLines; }
+};
+
+#endif
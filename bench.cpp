@@ -0,0 +1,285 @@
+// Microbenchmarks for the DNS hot path. Everything runs in-process against
+// a synthetic node database (no sockets, no crawling), with a fixed random
+// seed, so numbers are comparable between builds on the same machine.
+//
+// Usage: bench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+#include <string>
+#include <vector>
+
+#include "dnsthread.h"
+
+using namespace std;
+
+bool fTestNet = false;
+
+CAddrDb db;
+
+// count heap allocations, to report allocations per operation
+static uint64_t nAllocs = 0;
+
+void* operator new(size_t size) {
+  nAllocs++;
+  void *p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+static volatile uint64_t nSink = 0; // keeps results alive
+
+class CBenchmark {
+public:
+  const char *name;
+  int64 nStart;
+  uint64_t nAllocStart;
+
+  explicit CBenchmark(const char *nameIn) : name(nameIn), nStart(GetTimeNanos()), nAllocStart(nAllocs) {}
+
+  void Report(int nOps) {
+    int64 nTime = GetTimeNanos() - nStart;
+    uint64_t nAlloc = nAllocs - nAllocStart;
+    printf("%-36s %10.1f %10.2f\n", name, (double)nTime / nOps, (double)nAlloc / nOps);
+  }
+};
+
+// build a query packet with a single question
+static string MakeQuery(const char *name, int typ) {
+  unsigned char buf[512];
+  int len = write_query(buf, sizeof(buf), 0x1234, name, typ, CLASS_IN);
+  return string((const char*)buf, len > 0 ? len : 0);
+}
+
+struct CQuery {
+  const char *name;
+  string packet;
+};
+
+static void MakeCorpus(vector<CQuery> &corpus, const char *host) {
+  string h(host);
+  corpus.push_back(CQuery{"A", MakeQuery(host, TYPE_A)});
+  corpus.push_back(CQuery{"AAAA", MakeQuery(host, TYPE_AAAA)});
+  corpus.push_back(CQuery{"ANY", MakeQuery(host, QTYPE_ANY)});
+  corpus.push_back(CQuery{"NS", MakeQuery(host, TYPE_NS)});
+  corpus.push_back(CQuery{"SOA", MakeQuery(host, TYPE_SOA)});
+  corpus.push_back(CQuery{"A x9 subdomain", MakeQuery(("x9." + h).c_str(), TYPE_A)});
+  corpus.push_back(CQuery{"A unlisted flags", MakeQuery(("x3." + h).c_str(), TYPE_A)});
+  corpus.push_back(CQuery{"A other zone", MakeQuery("seed.example.org", TYPE_A)});
+
+  string q;
+  // OPT record with a client subnet option for 192.0.2.0/24
+  const unsigned char ecs[] = {0, 0, 41, 0x04, 0xd0, 0, 0, 0, 0, 0, 11, 0, 8, 0, 7, 0, 1, 24, 0, 192, 0, 2};
+  q = MakeQuery(host, TYPE_A); q[11] = 1;
+  q.append((const char*)ecs, sizeof(ecs));
+  corpus.push_back(CQuery{"A with client subnet", q});
+
+  corpus.push_back(CQuery{"malformed: short", MakeQuery(host, TYPE_A).substr(0, 7)});
+  q = MakeQuery(host, TYPE_A); q[2] |= 0x80;
+  corpus.push_back(CQuery{"malformed: response", q});
+  q = MakeQuery(host, TYPE_A); q[5] = 2;
+  corpus.push_back(CQuery{"malformed: 2 questions", q});
+  q = MakeQuery(host, TYPE_A); q[12] = 64;
+  corpus.push_back(CQuery{"malformed: long label", q});
+  q = MakeQuery(host, TYPE_A); q[12] = 0xC0; q[13] = 0x20;
+  corpus.push_back(CQuery{"malformed: forward pointer", q});
+  q = MakeQuery(host, TYPE_A); q.resize(q.size() - 3);
+  corpus.push_back(CQuery{"malformed: truncated", q});
+}
+
+// fill db with good nodes, a quarter of them IPv6, with varying services;
+// NODE_BLOOM (x5) only on IPv4 nodes, so that x5 answers are from an
+// IPv4-only database
+static void MakeDb(int nNodes) {
+  for (int i = 0; i < nNodes; i++) {
+    CNetAddr ip;
+    if (i % 4 == 3) {
+      struct in6_addr a6;
+      memset(&a6, 0, sizeof(a6));
+      a6.s6_addr[0] = 0x2a; a6.s6_addr[1] = 0x01;
+      a6.s6_addr[4] = i >> 16; a6.s6_addr[5] = i >> 8; a6.s6_addr[6] = i;
+      a6.s6_addr[15] = 1;
+      ip = CNetAddr(a6);
+    } else {
+      struct in_addr a4;
+      uint32_t n = 0x14000000 + i * 7919; // 20.0.0.0/8
+      a4.s_addr = htonl(n);
+      ip = CNetAddr(a4);
+    }
+    db.Add(CAddress(CService(ip, GetDefaultPort())), true);
+  }
+  // one good result is enough for a new node to be good
+  CAddrDbStats stats;
+  db.GetStats(stats);
+  while (stats.nNew > 0) {
+    vector<CServiceResult> ips;
+    int wait;
+    db.GetMany(ips, 1000, wait);
+    for (size_t i = 0; i < ips.size(); i++) {
+      CServiceResult &res = ips[i];
+      res.fGood = true;
+      res.nBanTime = 0;
+      res.nClientV = REQUIRE_VERSION;
+      res.nClientSV = subVersionTable.Intern("/Satoshi:0.21.2/");
+      res.nHeight = GetRequireHeight();
+      res.services = NODE_NETWORK | (i % 3 || !res.service.IsIPv4() ? NODE_WITNESS : NODE_BLOOM);
+    }
+    db.ResultMany(ips);
+    db.GetStats(stats);
+  }
+}
+
+int main(int argc, char **argv) {
+  int nIter = argc > 1 ? atoi(argv[1]) : 200000;
+  if (nIter <= 0) nIter = 200000;
+  srand(42);
+
+  const char *host = "seed.example.com";
+  set<uint64_t> whitelist;
+  whitelist.insert(NODE_NETWORK);
+  whitelist.insert(NODE_NETWORK | NODE_WITNESS);
+  whitelist.insert(NODE_NETWORK | NODE_BLOOM);
+  MakeDb(10000);
+  CAddrDbStats stats;
+  db.GetStats(stats);
+  CDnsThread thread(host, "ns.example.com", "hostmaster.example.com", "::", 53, whitelist, 0);
+
+  printf("%i good nodes in synthetic database, %i iterations\n\n", stats.nGood, nIter);
+  printf("%-36s %10s %10s\n", "benchmark", "ns/op", "allocs/op");
+
+  // parse_name
+  {
+    string q = MakeQuery("x9.seed.example.com", TYPE_A);
+    const unsigned char *inbuf = (const unsigned char*)q.data();
+    char name[256];
+    CBenchmark b("parse_name");
+    for (int i = 0; i < nIter; i++) {
+      const unsigned char *inpos = inbuf + 12;
+      nSink += parse_name(&inpos, inbuf + q.size(), inbuf, name, sizeof(name));
+    }
+    b.Report(nIter);
+  }
+  {
+    string q = MakeQuery("x9.Seed.Example.com", TYPE_A);
+    const unsigned char *inbuf = (const unsigned char*)q.data();
+    const unsigned char *label;
+    int labellen;
+    CBenchmark b("match_zone");
+    for (int i = 0; i < nIter; i++) {
+      const unsigned char *inpos = inbuf + 12;
+      nSink += match_zone(&thread.dns_opt, &inpos, inbuf + q.size(), &label, &labellen) + labellen;
+    }
+    b.Report(nIter);
+  }
+  {
+    // name at 12, then a name that is a label and a pointer to it
+    string q = MakeQuery("seed.example.com", TYPE_A);
+    size_t pos = q.size();
+    q += (char)3; q += "www"; q += (char)0xC0; q += (char)12;
+    const unsigned char *inbuf = (const unsigned char*)q.data();
+    char name[256];
+    CBenchmark b("parse_name compressed");
+    for (int i = 0; i < nIter; i++) {
+      const unsigned char *inpos = inbuf + pos;
+      nSink += parse_name(&inpos, inbuf + q.size(), inbuf, name, sizeof(name));
+    }
+    b.Report(nIter);
+  }
+
+  // write_record_*
+  {
+    unsigned char outbuf[512];
+    addr_t a4, a6;
+    a4.v = 4; memset(a4.data.v4, 1, 4);
+    a6.v = 6; memset(a6.data.v6, 2, 16);
+    CBenchmark b("write_record_a x16");
+    for (int i = 0; i < nIter; i++) {
+      unsigned char *outpos = outbuf + 40;
+      for (int j = 0; j < 16; j++)
+        write_record_a(&outpos, outbuf + sizeof(outbuf), "", 12, CLASS_IN, 3600, &a4);
+      nSink += outpos - outbuf;
+    }
+    b.Report(nIter);
+    CBenchmark b6("write_record_aaaa x16");
+    for (int i = 0; i < nIter; i++) {
+      unsigned char *outpos = outbuf + 40;
+      for (int j = 0; j < 16; j++)
+        write_record_aaaa(&outpos, outbuf + sizeof(outbuf), "", 12, CLASS_IN, 3600, &a6);
+      nSink += outpos - outbuf;
+    }
+    b6.Report(nIter);
+    CBenchmark bn("write_record_ns");
+    for (int i = 0; i < nIter; i++) {
+      unsigned char *outpos = outbuf + 40;
+      write_record_ns(&outpos, outbuf + sizeof(outbuf), "", 12, CLASS_IN, 40000, "ns.example.com");
+      nSink += outpos - outbuf;
+    }
+    bn.Report(nIter);
+    CBenchmark bs("write_record_soa");
+    for (int i = 0; i < nIter; i++) {
+      unsigned char *outpos = outbuf + 40;
+      write_record_soa(&outpos, outbuf + sizeof(outbuf), "", 12, CLASS_IN, 40000, "ns.example.com", "hostmaster.example.com", i, 604800, 86400, 2592000, 604800);
+      nSink += outpos - outbuf;
+    }
+    bs.Report(nIter);
+  }
+
+  // GetIPList, including the answer cache refreshes it triggers
+  {
+    struct {
+      const char *name;
+      const char *label;
+      int ipv4, ipv6;
+    } cases[] = {
+      {"GetIPList A", NULL, 1, 0},
+      {"GetIPList AAAA", NULL, 0, 1},
+      {"GetIPList ANY", NULL, 1, 1},
+      {"GetIPList A x9", "x9", 1, 0},
+      {"GetIPList A unlisted flags", "x3", 1, 0},
+      {"GetIPList AAAA x5, no IPv6 nodes", "x5", 0, 1},
+      {"GetIPList ANY x5, no IPv6 nodes", "x5", 1, 1},
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+      const unsigned char *label = (const unsigned char*)cases[c].label;
+      int labellen = label ? strlen(cases[c].label) : 0;
+      addr_t addr[32];
+      thread.cacheHit(0, CDnsThread::RING_ANY, true);
+      CBenchmark b(cases[c].name);
+      for (int i = 0; i < nIter; i++)
+        nSink += GetIPList(&thread, label, labellen, addr, 32, cases[c].ipv4, cases[c].ipv6);
+      b.Report(nIter);
+    }
+  }
+
+  // dnshandle, per query kind and over the whole corpus
+  {
+    vector<CQuery> corpus;
+    MakeCorpus(corpus, host);
+    unsigned char outbuf[512];
+    for (size_t c = 0; c < corpus.size(); c++) {
+      string name = string("dnshandle ") + corpus[c].name;
+      const unsigned char *inbuf = (const unsigned char*)corpus[c].packet.data();
+      size_t insize = corpus[c].packet.size();
+      CBenchmark b(name.c_str());
+      for (int i = 0; i < nIter; i++)
+        nSink += dnshandle(&thread.dns_opt, inbuf, insize, outbuf);
+      b.Report(nIter);
+    }
+    CBenchmark b("dnshandle mixed corpus");
+    for (int i = 0; i < nIter; i++) {
+      const string &q = corpus[i % corpus.size()].packet;
+      nSink += dnshandle(&thread.dns_opt, (const unsigned char*)q.data(), q.size(), outbuf);
+    }
+    b.Report(nIter);
+  }
+
+  return 0;
+}
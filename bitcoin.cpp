@@ -1,5 +1,6 @@
 #include <algorithm>
 
+#include "bitcoin.h"
 #include "db.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -23,6 +24,10 @@ class CNode {
   int ban;
   int64 doneAfter;
   CAddress you;
+  int64 nTimeStart;
+  int64 nTimeConnected;
+  int64 nTimeVersion;
+  int64 nTimeAddr;
 
   int GetTimeout() {
       if (you.IsTor())
@@ -88,6 +93,7 @@ class CNode {
  
   void GotVersion() {
     // printf("\n%s: version %i\n", ToString(you).c_str(), nVersion);
+    nTimeVersion = GetTimeNanos();
     if (vAddr) {
       BeginMessage("getaddr");
       EndMessage();
@@ -139,6 +145,7 @@ class CNode {
       vector<CAddress>::iterator it = vAddrNew.begin();
       if (vAddrNew.size() > 1) {
         if (doneAfter == 0 || doneAfter > now + 1) doneAfter = now + 1;
+        if (!nTimeAddr) nTimeAddr = GetTimeNanos();
       }
       while (it != vAddrNew.end()) {
         CAddress &addr = *it;
@@ -203,7 +210,7 @@ class CNode {
   }
   
 public:
-  CNode(const CService& ip, vector<CAddress>* vAddrIn) : you(ip), nHeaderStart(-1), nMessageStart(-1), vAddr(vAddrIn), ban(0), doneAfter(0), nVersion(0) {
+  CNode(const CService& ip, vector<CAddress>* vAddrIn) : you(ip), nHeaderStart(-1), nMessageStart(-1), vAddr(vAddrIn), ban(0), doneAfter(0), nVersion(0), nTimeStart(0), nTimeConnected(0), nTimeVersion(0), nTimeAddr(0) {
     vSend.SetType(SER_NETWORK);
     vSend.SetVersion(0);
     vRecv.SetType(SER_NETWORK);
@@ -215,7 +222,9 @@ public:
   }
   bool Run() {
     bool res = true;
+    nTimeStart = GetTimeNanos();
     if (!ConnectSocket(you, sock)) return false;
+    nTimeConnected = GetTimeNanos();
     PushVersion();
     Send();
     int64 now;
@@ -281,9 +290,15 @@ public:
   uint64_t GetServices() {
     return you.nServices;
   }
+
+  void GetTiming(CProbeTiming &timing) {
+    timing.nConnect = nTimeConnected ? nTimeConnected - nTimeStart : 0;
+    timing.nVersion = nTimeVersion ? nTimeVersion - nTimeConnected : 0;
+    timing.nGetAddr = nTimeAddr && nTimeVersion ? nTimeAddr - nTimeVersion : 0;
+  }
 };
 
-bool TestNode(const CService &cip, int &ban, int &clientV, std::string &clientSV, int &blocks, vector<CAddress>* vAddr, uint64_t& services) {
+bool TestNode(const CService &cip, int &ban, int &clientV, std::string &clientSV, int &blocks, vector<CAddress>* vAddr, uint64_t& services, CProbeTiming *timing) {
   try {
     CNode node(cip, vAddr);
     bool ret = node.Run();
@@ -296,10 +311,12 @@ bool TestNode(const CService &cip, int &ban, int &clientV, std::string &clientSV
     clientSV = node.GetClientSubVersion();
     blocks = node.GetStartingHeight();
     services = node.GetServices();
+    if (timing) node.GetTiming(*timing);
 //  printf("%s: %s!!!\n", cip.ToString().c_str(), ret ? "GOOD" : "BAD");
     return ret;
   } catch(std::ios_base::failure& e) {
     ban = 0;
+    if (timing) timing->nConnect = timing->nVersion = timing->nGetAddr = 0;
     return false;
   }
 }
@@ -3,6 +3,13 @@
 
 #include "protocol.h"
 
-bool TestNode(const CService &cip, int &ban, int &client, std::string &clientSV, int &blocks, std::vector<CAddress>* vAddr, uint64_t& services);
+// durations of the phases of a probe in nanoseconds, 0 if not completed
+struct CProbeTiming {
+  int64 nConnect; // TCP connect (including proxy handshake)
+  int64 nVersion; // from connected until version/verack exchanged
+  int64 nGetAddr; // from getaddr sent until addresses received
+};
+
+bool TestNode(const CService &cip, int &ban, int &client, std::string &clientSV, int &blocks, std::vector<CAddress>* vAddr, uint64_t& services, CProbeTiming *timing = NULL);
 
 #endif
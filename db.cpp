@@ -1,12 +1,57 @@
 #include "db.h"
 #include <stdlib.h>
 
+#include <algorithm>
+
 using namespace std;
 
 int nMinimumHeight = 0;
+bool fAllowUnroutable = false;
+CStringTable subVersionTable;
+
+// Decay factors exp(-age/tau) of all windows. The age is split into three
+// 7-bit digits, so that the factor is the product of one table entry per
+// digit; ages outside [0, 2^21) fall back to exp().
+static const double statTau[STAT_MAX] = {3600*2, 3600*8, 3600*24, 3600*24*7, 3600*24*30};
+
+class CStatDecayTable {
+public:
+  enum { DIGITS = 3, BITS = 7 };
+  double f[DIGITS][1 << BITS][STAT_MAX];
+
+  CStatDecayTable() {
+    for (int d = 0; d < DIGITS; d++)
+      for (int v = 0; v < (1 << BITS); v++)
+        for (int w = 0; w < STAT_MAX; w++)
+          f[d][v][w] = exp(-(double)((int64)v << (d * BITS)) / statTau[w]);
+  }
+
+  void Get(int64 age, double *decay) const {
+    if (age < 0 || age >= ((int64)1 << (DIGITS * BITS))) {
+      for (int w = 0; w < STAT_MAX; w++)
+        decay[w] = exp(-age/statTau[w]);
+      return;
+    }
+    const double *f0 = f[0][age & 127], *f1 = f[1][(age >> 7) & 127], *f2 = f[2][age >> 14];
+    for (int w = 0; w < STAT_MAX; w++)
+      decay[w] = f0[w] * f1[w] * f2[w];
+  }
+};
+
+static const CStatDecayTable statDecay;
+
+void CAddrStats::Update(bool good, int64 age) {
+  double f[STAT_MAX];
+  statDecay.Get(age, f);
+  double g = good ? 1.0 : 0.0;
+  for (int w = 0; w < STAT_MAX; w++) {
+    reliability[w] = reliability[w] * f[w] + g * (1.0-f[w]);
+    count[w] = count[w] * f[w] + 1;
+    weight[w] = weight[w] * f[w] + (1.0-f[w]);
+  }
+}
 
-void CAddrInfo::Update(bool good) {
-  uint32_t now = time(NULL);
+bool CAddrInfo::Update(bool good, int64 now) {
   if (ourLastTry == 0)
     ourLastTry = now - MIN_RETRY;
   int age = now - ourLastTry;
@@ -18,18 +63,72 @@ void CAddrInfo::Update(bool good) {
     success++;
     ourLastSuccess = now;
   }
-  stat2H.Update(good, age, 3600*2);
-  stat8H.Update(good, age, 3600*8);
-  stat1D.Update(good, age, 3600*24);
-  stat1W.Update(good, age, 3600*24*7);
-  stat1M.Update(good, age, 3600*24*30);
-  int ign = GetIgnoreTime();
+  stats.Update(good, age);
+  bool fGood = IsGood();
+  int ign = GetIgnoreTime(fGood);
   if (ign && (ignoreTill==0 || ignoreTill < ign+now)) ignoreTill = ign+now;
 //  printf("%s: got %s result: success=%i/%i; 2H:%.2f%%-%.2f%%(%.2f) 8H:%.2f%%-%.2f%%(%.2f) 1D:%.2f%%-%.2f%%(%.2f) 1W:%.2f%%-%.2f%%(%.2f) \n", ToString(ip).c_str(), good ? "good" : "bad", success, total, 
-//  100.0 * stat2H.reliability, 100.0 * (stat2H.reliability + 1.0 - stat2H.weight), stat2H.count,
-//  100.0 * stat8H.reliability, 100.0 * (stat8H.reliability + 1.0 - stat8H.weight), stat8H.count,
-//  100.0 * stat1D.reliability, 100.0 * (stat1D.reliability + 1.0 - stat1D.weight), stat1D.count,
-//  100.0 * stat1W.reliability, 100.0 * (stat1W.reliability + 1.0 - stat1W.weight), stat1W.count);
+//  100.0 * stats.reliability[STAT_2H], 100.0 * (stats.reliability[STAT_2H] + 1.0 - stats.weight[STAT_2H]), stats.count[STAT_2H],
+//  100.0 * stats.reliability[STAT_8H], 100.0 * (stats.reliability[STAT_8H] + 1.0 - stats.weight[STAT_8H]), stats.count[STAT_8H],
+//  100.0 * stats.reliability[STAT_1D], 100.0 * (stats.reliability[STAT_1D] + 1.0 - stats.weight[STAT_1D]), stats.count[STAT_1D],
+//  100.0 * stats.reliability[STAT_1W], 100.0 * (stats.reliability[STAT_1W] + 1.0 - stats.weight[STAT_1W]), stats.count[STAT_1W]);
+  return fGood;
+}
+
+int CAddrDb::Alloc_(const CAddrInfo &info) {
+  int id;
+  if (vFreeId.empty()) {
+    id = vInfo.size();
+    vInfo.push_back(info);
+    vHot.push_back(CAddrHot());
+  } else {
+    id = vFreeId.back();
+    vFreeId.pop_back();
+    vInfo[id] = info;
+  }
+  SyncHot_(id);
+  vHot[id].group = GetGroupHash(info.ip);
+  return id;
+}
+
+void CAddrDb::Free_(int id) {
+  bool fQueued = vHot[id].fQueued;
+  SetGood_(id, false);
+  vInfo[id] = CAddrInfo();
+  vHot[id] = CAddrHot();
+  if (fQueued) {
+    // still in ourId; Get_ releases the slot when it comes up
+    vHot[id].fQueued = true;
+    nOurDead++;
+  } else {
+    vFreeId.push_back(id);
+  }
+}
+
+void CAddrDb::Queue_(int id) {
+  ourId.push_back(id);
+  vHot[id].fQueued = true;
+}
+
+void CAddrDb::SyncHot_(int id) {
+  const CAddrInfo &info = vInfo[id];
+  CAddrHot &hot = vHot[id];
+  hot.services = info.services;
+  hot.ourLastTry = info.ourLastTry;
+  hot.ignoreTill = info.ignoreTill;
+  hot.net = info.ip.GetNetwork();
+  hot.fInUse = true;
+  hot.fSuccess = info.success > 0;
+}
+
+void CAddrDb::SetGood_(int id, bool fGood) {
+  if (fGood) {
+    if (goodId.insert(id).second)
+      goodGroups.Insert(id, vHot[id].group);
+  } else {
+    if (goodId.erase(id))
+      goodGroups.Erase(id);
+  }
 }
 
 bool CAddrDb::Get_(CServiceResult &ip, int &wait) {
@@ -48,16 +147,38 @@ bool CAddrDb::Get_(CServiceResult &ip, int &wait) {
       ret = *it;
       unkId.erase(it);
     } else {
+      if (ourId.empty()) return false;
       ret = ourId.front();
-      if (time(NULL) - idToInfo[ret].ourLastTry < MIN_RETRY) return false;
+      if (vHot[ret].fInUse && now - vHot[ret].ourLastTry < MIN_RETRY) return false;
       ourId.pop_front();
     }
-    if (idToInfo[ret].ignoreTill && idToInfo[ret].ignoreTill < now) {
-      ourId.push_back(ret);
-      idToInfo[ret].ourLastTry = now;
+    CAddrHot &hot = vHot[ret];
+    if (hot.fQueued) {
+      hot.fQueued = false;
+      if (!hot.fInUse) {
+        vFreeId.push_back(ret);
+        nOurDead--;
+      }
+    }
+    if (!hot.fInUse)
+      continue;
+    if (!IsOurs_(vInfo[ret].ip)) {
+      if (hot.nRemoteMiss < REMOTE_MAX_MISS) {
+        // another seeder probes it; only reschedule, keeping ourLastTry for the statistics
+        hot.nRemoteMiss++;
+        Queue_(ret);
+        hot.ourLastTry = now;
+        continue;
+      }
+      // the seeder owning it went quiet; probe it ourselves until it is back
+    }
+    if (hot.ignoreTill && hot.ignoreTill < now) {
+      Queue_(ret);
+      vInfo[ret].ourLastTry = now;
+      hot.ourLastTry = now;
     } else {
-      ip.service = idToInfo[ret].ip;
-      ip.ourLastSuccess = idToInfo[ret].ourLastSuccess;
+      ip.service = vInfo[ret].ip;
+      ip.ourLastSuccess = vInfo[ret].ourLastSuccess;
       break;
     }
   } while(1);
@@ -66,55 +187,56 @@ bool CAddrDb::Get_(CServiceResult &ip, int &wait) {
 }
 
 int CAddrDb::Lookup_(const CService &ip) {
-  if (ipToId.count(ip))
-    return ipToId[ip];
+  std::map<CService, int>::const_iterator it = ipToId.find(ip);
+  if (it != ipToId.end())
+    return it->second;
   return -1;
 }
 
-void CAddrDb::Good_(const CService &addr, int clientV, std::string clientSV, int blocks, uint64_t services) {
+void CAddrDb::Good_(const CService &addr, int clientV, int clientSV, int blocks, uint64_t services, int64 now) {
   int id = Lookup_(addr);
   if (id == -1) return;
   unkId.erase(id);
-  banned.erase(addr);
-  CAddrInfo &info = idToInfo[id];
+  banned.Unban(addr);
+  CAddrInfo &info = vInfo[id];
   info.clientVersion = clientV;
-  info.clientSubVersion = clientSV;
+  info.clientSubVersionId = clientSV;
   info.blocks = blocks;
   info.services = services;
-  info.Update(true);
-  if (info.IsGood() && goodId.count(id)==0) {
-    goodId.insert(id);
+  bool fGood = info.Update(true, now);
+  SyncHot_(id);
+  if (fGood && goodId.count(id)==0) {
+    SetGood_(id, true);
 //    printf("%s: good; %i good nodes now\n", ToString(addr).c_str(), (int)goodId.size());
   }
   nDirty++;
-  ourId.push_back(id);
+  Queue_(id);
 }
 
-void CAddrDb::Bad_(const CService &addr, int ban)
+void CAddrDb::Bad_(const CService &addr, int ban, int64 now)
 {
   int id = Lookup_(addr);
   if (id == -1) return;
   unkId.erase(id);
-  CAddrInfo &info = idToInfo[id];
-  info.Update(false);
-  uint32_t now = time(NULL);
-  int ter = info.GetBanTime();
+  CAddrInfo &info = vInfo[id];
+  bool fGood = info.Update(false, now);
+  int ter = info.GetBanTime(fGood);
   if (ter) {
 //    printf("%s: terrible\n", ToString(addr).c_str());
     if (ban < ter) ban = ter;
   }
   if (ban > 0) {
 //    printf("%s: ban for %i seconds\n", ToString(addr).c_str(), ban);
-    banned[info.ip] = ban + now;
+    banned.Ban(info.ip, ban + now);
     ipToId.erase(info.ip);
-    goodId.erase(id);
-    idToInfo.erase(id);
+    Free_(id);
   } else {
+    SyncHot_(id);
     if (/*!info.IsGood() && */ goodId.count(id)==1) {
-      goodId.erase(id);
+      SetGood_(id, false);
 //      printf("%s: not good; %i good nodes left\n", ToString(addr).c_str(), (int)goodId.size());
     }
-    ourId.push_back(id);
+    Queue_(id);
   }
   nDirty++;
 }
@@ -124,31 +246,75 @@ void CAddrDb::Skipped_(const CService &addr)
   int id = Lookup_(addr);
   if (id == -1) return;
   unkId.erase(id);
-  ourId.push_back(id);
+  Queue_(id);
 //  printf("%s: skipped\n", ToString(addr).c_str());
   nDirty++;
 }
 
+void CAddrDb::Remote_(const CServiceResult &res, int64 now) {
+  if (IsOurs_(res.service)) return;
+  int id = Lookup_(res.service);
+  if (id == -1) {
+    Add_(CAddress(res.service, res.services), false);
+    id = Lookup_(res.service);
+    if (id == -1) return;
+  }
+  // the id is in unkId, (once) in ourId, or handed out by Get_ because the
+  // owner went quiet; in the last case our own result queues it again
+  bool fNew = unkId.erase(id) > 0;
+  CAddrInfo &info = vInfo[id];
+  bool fGood;
+  if (res.fGood) {
+    banned.Unban(res.service);
+    info.clientVersion = res.nClientV;
+    info.clientSubVersionId = res.nClientSV;
+    info.blocks = res.nHeight;
+    info.services = res.services;
+    fGood = info.Update(true, now);
+  } else {
+    fGood = info.Update(false, now);
+    int ban = max(res.nBanTime, info.GetBanTime(fGood));
+    if (ban > 0) {
+      banned.Ban(info.ip, ban + now);
+      ipToId.erase(info.ip);
+      Free_(id);
+      nDirty++;
+      return;
+    }
+  }
+  SyncHot_(id);
+  vHot[id].nRemoteMiss = 0;
+  SetGood_(id, fGood);
+  if (fNew)
+    Queue_(id);
+  nDirty++;
+}
 
-void CAddrDb::Add_(const CAddress &addr, bool force) {
-  if (!force && !addr.IsRoutable())
-    return;
+bool CAddrDb::Add_(const CAddress &addr, bool force) {
+  if (!force && !fAllowUnroutable && !addr.IsRoutable())
+    return false;
   CService ipp(addr);
-  if (banned.count(ipp)) {
-    time_t bantime = banned[ipp];
-    if (force || (bantime < time(NULL) && addr.nTime > bantime))
-      banned.erase(ipp);
+  if (banned.IsRangeBanned(ipp))
+    return false;
+  time_t now = time(NULL);
+  banned.Expire(now - BAN_EXPIRY_GRACE);
+  time_t bantime;
+  if (banned.Get(ipp, bantime)) {
+    if (force || (bantime < now && addr.nTime > bantime))
+      banned.Unban(ipp);
     else
-      return;
+      return false;
   }
-  if (ipToId.count(ipp)) {
-    CAddrInfo &ai = idToInfo[ipToId[ipp]];
+  int idExisting = Lookup_(ipp);
+  if (idExisting != -1) {
+    CAddrInfo &ai = vInfo[idExisting];
     if (addr.nTime > ai.lastTry) ai.lastTry = addr.nTime;
     // Do not update ai.nServices (data from VERSION from the peer itself is better than random ADDR rumours).
     if (force) {
       ai.ignoreTill = 0;
+      vHot[idExisting].ignoreTill = 0;
     }
-    return;
+    return false;
   }
   CAddrInfo ai;
   ai.ip = ipp;
@@ -157,12 +323,12 @@ void CAddrDb::Add_(const CAddress &addr, bool force) {
   ai.ourLastTry = 0;
   ai.total = 0;
   ai.success = 0;
-  int id = nId++;
-  idToInfo[id] = ai;
+  int id = Alloc_(ai);
   ipToId[ipp] = id;
 //  printf("%s: added\n", ToString(ipp).c_str(), ipToId[ipp]);
   unkId.insert(id);
   nDirty++;
+  return true;
 }
 
 void CAddrDb::GetIPs_(set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool* nets) {
@@ -174,14 +340,22 @@ void CAddrDb::GetIPs_(set<CNetAddr>& ips, uint64_t requestedFlags, int max, cons
     } else {
       id = *ourId.begin();
     }
-    if (id >= 0 && (idToInfo[id].services & requestedFlags) == requestedFlags) {
-      ips.insert(idToInfo[id].ip);
+    if (id >= 0 && vHot[id].fInUse && (vHot[id].services & requestedFlags) == requestedFlags) {
+      ips.insert(vInfo[id].ip);
     }
     return;
   }
+  if (nSelect == SELECT_NETGROUP) {
+    set<int> ids;
+    GetGroupIPs_(ids, requestedFlags, max, nets);
+    for (set<int>::const_iterator it = ids.begin(); it != ids.end(); it++)
+      ips.insert(vInfo[*it].ip);
+    return;
+  }
   std::vector<int> goodIdFiltered;
+  goodIdFiltered.reserve(goodId.size());
   for (std::set<int>::const_iterator it = goodId.begin(); it != goodId.end(); it++) {
-    if ((idToInfo[*it].services & requestedFlags) == requestedFlags)
+    if ((vHot[*it].services & requestedFlags) == requestedFlags && nets[vHot[*it].net])
       goodIdFiltered.push_back(*it);
   }
 
@@ -197,9 +371,91 @@ void CAddrDb::GetIPs_(set<CNetAddr>& ips, uint64_t requestedFlags, int max, cons
   while (ids.size() < max) {
     ids.insert(goodIdFiltered[rand() % goodIdFiltered.size()]);
   }
-  for (set<int>::const_iterator it = ids.begin(); it != ids.end(); it++) {
-    CService &ip = idToInfo[*it].ip;
-    if (nets[ip.GetNetwork()])
-      ips.insert(ip);
+  for (set<int>::const_iterator it = ids.begin(); it != ids.end(); it++)
+    ips.insert(vInfo[*it].ip);
+}
+
+// Take one random node from each netgroup, in random group order, then a
+// second from each group that has more, and so on, until max nodes are
+// taken. A group with many good nodes thus gets no bigger share of the
+// sample than any other. Only nodes matching the filter are drawn, without
+// replacement, so the sample falls short of max only if the matches do.
+void CAddrDb::GetGroupIPs_(set<int>& ids, uint64_t requestedFlags, int max, const bool* nets) {
+  // matching nodes, grouped: group g holds cand[first[g]..first[g+1])
+  vector<int> cand, first;
+  cand.reserve(goodId.size());
+  first.reserve(goodGroups.size() + 1);
+  for (int i = 0; i < goodGroups.size(); i++) {
+    const vector<int> &bucket = goodGroups.Bucket(i);
+    // a netgroup is of one network, so whole buckets are of other ones
+    if (!nets[vHot[bucket[0]].net])
+      continue;
+    int nBefore = cand.size();
+    for (int j = 0; j < bucket.size(); j++)
+      if ((vHot[bucket[j]].services & requestedFlags) == requestedFlags)
+        cand.push_back(bucket[j]);
+    if (cand.size() > nBefore)
+      first.push_back(nBefore);
+  }
+  int nGroups = first.size();
+  first.push_back(cand.size());
+  if (max > cand.size() / 2)
+    max = cand.size() / 2;
+  if (max < 1)
+    max = 1;
+  vector<int> order(nGroups);
+  for (int i = 0; i < nGroups; i++)
+    order[i] = i;
+  for (int i = nGroups - 1; i > 0; i--)
+    swap(order[i], order[rand() % (i + 1)]);
+  for (int round = 0; ids.size() < max; round++) {
+    bool fTaken = false;
+    for (int i = 0; i < nGroups && ids.size() < max; i++) {
+      int g = order[i], pos = first[g] + round, n = first[g + 1] - pos;
+      if (n <= 0)
+        continue;
+      // partial shuffle: the first round+1 entries of the group are drawn
+      swap(cand[pos], cand[pos + rand() % n]);
+      ids.insert(cand[pos]);
+      fTaken = true;
+    }
+    if (!fTaken)
+      break;
+  }
+}
+
+// The reference height and version for the weights are the medians over the
+// sample, which a few nodes reporting bogus values cannot move much.
+void CAddrDb::GetWeightedIPs_(vector<pair<CNetAddr, float> >& ips, uint64_t requestedFlags, int max, const bool* nets) {
+  vector<int> ids;
+  ids.reserve(goodId.size());
+  for (set<int>::const_iterator it = goodId.begin(); it != goodId.end(); it++) {
+    if ((vHot[*it].services & requestedFlags) == requestedFlags && nets[vHot[*it].net])
+      ids.push_back(*it);
+  }
+  if (ids.empty()) {
+    set<CNetAddr> fallback;
+    GetIPs_(fallback, requestedFlags, max, nets);
+    for (set<CNetAddr>::const_iterator it = fallback.begin(); it != fallback.end(); it++)
+      ips.push_back(make_pair(*it, 1.0f));
+    return;
+  }
+  if (ids.size() > max) {
+    for (int i = 0; i < max; i++)
+      swap(ids[i], ids[i + rand() % (ids.size() - i)]);
+    ids.resize(max);
+  }
+  vector<int> heights, versions;
+  heights.reserve(ids.size());
+  versions.reserve(ids.size());
+  for (int i = 0; i < ids.size(); i++) {
+    heights.push_back(vInfo[ids[i]].blocks);
+    versions.push_back(vInfo[ids[i]].clientVersion);
   }
+  nth_element(heights.begin(), heights.begin() + heights.size() / 2, heights.end());
+  nth_element(versions.begin(), versions.begin() + versions.size() / 2, versions.end());
+  int nHeight = heights[heights.size() / 2], nVersion = versions[versions.size() / 2];
+  ips.reserve(ids.size());
+  for (int i = 0; i < ids.size(); i++)
+    ips.push_back(make_pair((CNetAddr)vInfo[ids[i]].ip, vInfo[ids[i]].GetSelectWeight(nHeight, nVersion)));
 }
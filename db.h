@@ -1,3 +1,6 @@
+#ifndef _DB_H_
+#define _DB_H_ 1
+
 #include <stdint.h>
 #include <math.h>
 
@@ -5,16 +8,27 @@
 #include <map>
 #include <vector>
 #include <deque>
+#include <queue>
 
 #include "netbase.h"
+#include "prefixtrie.h"
 #include "protocol.h"
 #include "util.h"
 
 #define MIN_RETRY 1000
 
+// passes through ourId (each at least MIN_RETRY apart) without a result from
+// the seeder owning a node, after which we probe the node ourselves
+#define REMOTE_MAX_MISS 3
+
+// how long an expired ban is kept to reject stale rumours about the address
+#define BAN_EXPIRY_GRACE (86400*7)
+
 #define REQUIRE_VERSION 70002
 
 extern int nMinimumHeight;
+extern bool fAllowUnroutable; // accept loopback/private addresses (benchmarks against peersim)
+extern CStringTable subVersionTable; // interned client subversions
 static inline int GetRequireHeight(const bool testnet = fTestNet)
 {
     return nMinimumHeight ? nMinimumHeight : (testnet ? 3220000 : 2660000);
@@ -26,26 +40,41 @@ std::string static inline ToString(const CService &ip) {
   return str;
 }
 
-class CAddrStat {
+// statistics windows
+enum {
+  STAT_2H,
+  STAT_8H,
+  STAT_1D,
+  STAT_1W,
+  STAT_1M,
+
+  STAT_MAX,
+};
+
+// Exponentially decaying success statistics for all windows at once. Each
+// field is an array indexed by STAT_*, so an update is a single loop over
+// the windows that the compiler can vectorize.
+class CAddrStats {
 private:
-  float weight;
-  float count;
-  float reliability;
+  float weight[STAT_MAX];
+  float count[STAT_MAX];
+  float reliability[STAT_MAX];
 public:
-  CAddrStat() : weight(0), count(0), reliability(0) {}
+  CAddrStats() {
+    for (int w = 0; w < STAT_MAX; w++) {
+      weight[w] = 0;
+      count[w] = 0;
+      reliability[w] = 0;
+    }
+  }
+
+  void Update(bool good, int64 age);
 
-  void Update(bool good, int64 age, double tau) {
-    double f =  exp(-age/tau);
-    reliability = reliability * f + (good ? (1.0-f) : 0);
-    count = count * f + 1;
-    weight = weight * f + (1.0-f);
+  void CopyWindow(int to, int from) {
+    weight[to] = weight[from];
+    count[to] = count[from];
+    reliability[to] = reliability[from];
   }
-  
-  IMPLEMENT_SERIALIZE (
-    READWRITE(weight);
-    READWRITE(count);
-    READWRITE(reliability);
-  )
 
   friend class CAddrInfo;
 };
@@ -56,12 +85,25 @@ public:
   int clientVersion;
   int blocks;
   double uptime[5];
-  std::string clientSubVersion;
+  int clientSubVersionId;
   int64_t lastSuccess;
   bool fGood;
   uint64_t services;
 };
 
+// compact sort key of a node in dnsseed.dump: by 30 day, then 7 day
+// reliability, then client version, all descending
+struct CDumpKey {
+  float uptime[2]; // STAT_1M, STAT_1W
+  int clientVersion;
+  int id;
+  CService ip; // to tell if id was reused by the time the report is read
+  bool operator<(const CDumpKey &b) const {
+    if (uptime[0] != b.uptime[0]) return uptime[0] > b.uptime[0];
+    if (uptime[1] != b.uptime[1]) return uptime[1] > b.uptime[1];
+    return clientVersion > b.clientVersion;
+  }
+};
 
 class CAddrInfo {
 private:
@@ -71,71 +113,88 @@ private:
   int64 ourLastTry;
   int64 ourLastSuccess;
   int64 ignoreTill;
-  CAddrStat stat2H;
-  CAddrStat stat8H;
-  CAddrStat stat1D;
-  CAddrStat stat1W;
-  CAddrStat stat1M;
+  CAddrStats stats;
   int clientVersion;
   int blocks;
   int total;
   int success;
-  std::string clientSubVersion;
+  int clientSubVersionId;
 public:
-  CAddrInfo() : services(0), lastTry(0), ourLastTry(0), ourLastSuccess(0), ignoreTill(0), clientVersion(0), blocks(0), total(0), success(0) {}
+  CAddrInfo() : services(0), lastTry(0), ourLastTry(0), ourLastSuccess(0), ignoreTill(0), clientVersion(0), blocks(0), total(0), success(0), clientSubVersionId(0) {}
   
   CAddrReport GetReport() const {
     CAddrReport ret;
     ret.ip = ip;
     ret.clientVersion = clientVersion;
-    ret.clientSubVersion = clientSubVersion;
+    ret.clientSubVersionId = clientSubVersionId;
     ret.blocks = blocks;
-    ret.uptime[0] = stat2H.reliability;
-    ret.uptime[1] = stat8H.reliability;
-    ret.uptime[2] = stat1D.reliability;
-    ret.uptime[3] = stat1W.reliability;
-    ret.uptime[4] = stat1M.reliability;
+    for (int w = 0; w < STAT_MAX; w++)
+      ret.uptime[w] = stats.reliability[w];
     ret.lastSuccess = ourLastSuccess;
     ret.fGood = IsGood();
     ret.services = services;
     return ret;
   }
   
+  CDumpKey GetDumpKey(int id) const {
+    CDumpKey key = {{stats.reliability[STAT_1M], stats.reliability[STAT_1W]}, clientVersion, id, ip};
+    return key;
+  }
+
+  // weight in SELECT_WEIGHTED answers: the square of the mean of the 1 day,
+  // 1 week and 1 month reliabilities, halved if more than 6 blocks behind
+  // nHeight or older than nVersion; never quite 0, so new nodes get a turn
+  float GetSelectWeight(int nHeight, int nVersion) const {
+    const float *rel = stats.reliability;
+    float uptime = (rel[STAT_1D] + rel[STAT_1W] + rel[STAT_1M]) / 3;
+    float weight = uptime * uptime;
+    if (blocks && blocks < nHeight - 6) weight *= 0.5;
+    if (clientVersion && clientVersion < nVersion) weight *= 0.5;
+    return weight + 0.001;
+  }
+
   bool IsGood() const {
     if (ip.GetPort() != GetDefaultPort()) return false;
     if (!(services & NODE_NETWORK)) return false;
-    if (!ip.IsRoutable()) return false;
+    if (!fAllowUnroutable && !ip.IsRoutable()) return false;
     if (clientVersion && clientVersion < REQUIRE_VERSION) return false;
     if (blocks && blocks < GetRequireHeight()) return false;
 
     if (total <= 3 && success * 2 >= total) return true;
 
-    if (stat2H.reliability > 0.85 && stat2H.count > 2) return true;
-    if (stat8H.reliability > 0.70 && stat8H.count > 4) return true;
-    if (stat1D.reliability > 0.55 && stat1D.count > 8) return true;
-    if (stat1W.reliability > 0.45 && stat1W.count > 16) return true;
-    if (stat1M.reliability > 0.35 && stat1M.count > 32) return true;
+    const float *rel = stats.reliability, *cnt = stats.count;
+    if (rel[STAT_2H] > 0.85 && cnt[STAT_2H] > 2) return true;
+    if (rel[STAT_8H] > 0.70 && cnt[STAT_8H] > 4) return true;
+    if (rel[STAT_1D] > 0.55 && cnt[STAT_1D] > 8) return true;
+    if (rel[STAT_1W] > 0.45 && cnt[STAT_1W] > 16) return true;
+    if (rel[STAT_1M] > 0.35 && cnt[STAT_1M] > 32) return true;
     
     return false;
   }
-  int GetBanTime() const {
-    if (IsGood()) return 0;
+  // fGood must be the current value of IsGood()
+  int GetBanTime(bool fGood) const {
+    if (fGood) return 0;
+    const float *rel = stats.reliability, *cnt = stats.count, *wgt = stats.weight;
     if (clientVersion && clientVersion < 50000) { return 604800; }
-    if (stat1M.reliability - stat1M.weight + 1.0 < 0.15 && stat1M.count > 32) { return 30*86400; }
-    if (stat1W.reliability - stat1W.weight + 1.0 < 0.10 && stat1W.count > 16) { return 7*86400; }
-    if (stat1D.reliability - stat1D.weight + 1.0 < 0.05 && stat1D.count > 8) { return 1*86400; }
+    if (rel[STAT_1M] - wgt[STAT_1M] + 1.0 < 0.15 && cnt[STAT_1M] > 32) { return 30*86400; }
+    if (rel[STAT_1W] - wgt[STAT_1W] + 1.0 < 0.10 && cnt[STAT_1W] > 16) { return 7*86400; }
+    if (rel[STAT_1D] - wgt[STAT_1D] + 1.0 < 0.05 && cnt[STAT_1D] > 8) { return 1*86400; }
     return 0;
   }
-  int GetIgnoreTime() const {
-    if (IsGood()) return 0;
-    if (stat1M.reliability - stat1M.weight + 1.0 < 0.20 && stat1M.count > 2) { return 10*86400; }
-    if (stat1W.reliability - stat1W.weight + 1.0 < 0.16 && stat1W.count > 2)  { return 3*86400; }
-    if (stat1D.reliability - stat1D.weight + 1.0 < 0.12 && stat1D.count > 2)  { return 8*3600; }
-    if (stat8H.reliability - stat8H.weight + 1.0 < 0.08 && stat8H.count > 2)  { return 2*3600; }
+  int GetBanTime() const { return GetBanTime(IsGood()); }
+  int GetIgnoreTime(bool fGood) const {
+    if (fGood) return 0;
+    const float *rel = stats.reliability, *cnt = stats.count, *wgt = stats.weight;
+    if (rel[STAT_1M] - wgt[STAT_1M] + 1.0 < 0.20 && cnt[STAT_1M] > 2) { return 10*86400; }
+    if (rel[STAT_1W] - wgt[STAT_1W] + 1.0 < 0.16 && cnt[STAT_1W] > 2)  { return 3*86400; }
+    if (rel[STAT_1D] - wgt[STAT_1D] + 1.0 < 0.12 && cnt[STAT_1D] > 2)  { return 8*3600; }
+    if (rel[STAT_8H] - wgt[STAT_8H] + 1.0 < 0.08 && cnt[STAT_8H] > 2)  { return 2*3600; }
     return 0;
   }
+  int GetIgnoreTime() const { return GetIgnoreTime(IsGood()); }
   
-  void Update(bool good);
+  // record a probe result at time now; returns IsGood() afterwards
+  bool Update(bool good, int64 now);
   
   friend class CAddrDb;
   
@@ -150,20 +209,24 @@ public:
     if (tried) {
       READWRITE(ourLastTry);
       READWRITE(ignoreTill);
-      READWRITE(stat2H);
-      READWRITE(stat8H);
-      READWRITE(stat1D);
-      READWRITE(stat1W);
-      if (version >= 1)
-          READWRITE(stat1M);
-      else
-          if (!fWrite)
-              *((CAddrStat*)(&stat1M)) = stat1W;
+      // on disk, each window is stored as (weight, count, reliability)
+      int nWindows = version >= 1 ? STAT_MAX : STAT_1M;
+      for (int w = 0; w < nWindows; w++) {
+          READWRITE(stats.weight[w]);
+          READWRITE(stats.count[w]);
+          READWRITE(stats.reliability[w]);
+      }
+      if (version < 1 && fRead)
+          const_cast<CAddrStats*>(&stats)->CopyWindow(STAT_1M, STAT_1W);
       READWRITE(total);
       READWRITE(success);
       READWRITE(clientVersion);
-      if (version >= 2)
+      if (version >= 2) {
+          std::string clientSubVersion = subVersionTable.Get(clientSubVersionId);
           READWRITE(clientSubVersion);
+          if (fRead)
+              const_cast<CAddrInfo*>(this)->clientSubVersionId = subVersionTable.Intern(clientSubVersion);
+      }
       if (version >= 3)
           READWRITE(blocks);
       if (version >= 4)
@@ -172,6 +235,21 @@ public:
   )
 };
 
+// Scheduling and selection fields of a CAddrInfo, mirrored into a densely
+// packed array by CAddrDb so that scans only touch a few bytes per node.
+struct CAddrHot {
+  uint64_t services;
+  int64 ourLastTry;
+  int64 ignoreTill;
+  uint32_t group;     // GetGroupHash of the address
+  unsigned char net;  // enum Network of the address
+  bool fInUse;        // slot holds a live record
+  bool fSuccess;      // at least one successful connection
+  bool fQueued;       // id is in ourId
+  unsigned char nRemoteMiss; // passes without a result from another seeder, see REMOTE_MAX_MISS
+  CAddrHot() : services(0), ourLastTry(0), ignoreTill(0), group(0), net(NET_UNROUTABLE), fInUse(false), fSuccess(false), fQueued(false), nRemoteMiss(0) {}
+};
+
 class CAddrDbStats {
 public:
   int nBanned;
@@ -189,10 +267,165 @@ struct CServiceResult {
     int nBanTime;
     int nHeight;
     int nClientV;
-    std::string strClientV;
+    int nClientSV; // id in subVersionTable
     int64 ourLastSuccess;
 };
 
+// Banned nodes: exact IP:port bans with an unban time, plus permanent bans
+// of whole address ranges. Expired exact bans are dropped through a min-heap
+// on unban time, so the list stays bounded by the ban rate.
+class CBanList {
+private:
+  typedef std::pair<time_t, CService> CBanExpiry;
+  std::map<CService, time_t> mapBanned; // exact bans, with their unban time
+  std::priority_queue<CBanExpiry, std::vector<CBanExpiry>, std::greater<CBanExpiry> > queueExpiry; // may hold stale entries
+  CPrefixTrie<CSubNet> trieRanges; // range bans
+
+  void RebuildQueue() {
+    queueExpiry = std::priority_queue<CBanExpiry, std::vector<CBanExpiry>, std::greater<CBanExpiry> >();
+    for (std::map<CService, time_t>::const_iterator it = mapBanned.begin(); it != mapBanned.end(); it++)
+      queueExpiry.push(std::make_pair(it->second, it->first));
+  }
+
+public:
+  void Ban(const CService &ip, time_t until) {
+    mapBanned[ip] = until;
+    queueExpiry.push(std::make_pair(until, ip));
+    if (queueExpiry.size() > 2 * mapBanned.size() + 1024)
+      RebuildQueue();
+  }
+  void Unban(const CService &ip) {
+    mapBanned.erase(ip);
+  }
+  // look up an exact ban; returns false if ip is not banned
+  bool Get(const CService &ip, time_t &until) const {
+    std::map<CService, time_t>::const_iterator it = mapBanned.find(ip);
+    if (it == mapBanned.end())
+      return false;
+    until = it->second;
+    return true;
+  }
+  void BanRange(const CSubNet &subnet) {
+    trieRanges.Insert(subnet.GetNetwork(), subnet.GetBits(), subnet);
+  }
+  bool IsRangeBanned(const CNetAddr &ip) const {
+    return trieRanges.Lookup(ip) != NULL;
+  }
+  // drop exact bans that ended before cutoff
+  void Expire(time_t cutoff) {
+    while (!queueExpiry.empty() && queueExpiry.top().first < cutoff) {
+      std::map<CService, time_t>::iterator it = mapBanned.find(queueExpiry.top().second);
+      if (it != mapBanned.end() && it->second == queueExpiry.top().first)
+        mapBanned.erase(it);
+      queueExpiry.pop();
+    }
+  }
+  int size() const { return mapBanned.size(); }
+  int GetRangeCount() const { return trieRanges.size(); }
+  // clears the exact bans; range bans come from the command line and stay
+  void clear() {
+    mapBanned.clear();
+    RebuildQueue();
+  }
+
+  IMPLEMENT_SERIALIZE (
+    READWRITE(mapBanned);
+    if (fRead)
+      const_cast<CBanList*>(this)->RebuildQueue();
+  )
+};
+
+// shard of an address among nShards, by FNV-1a of its IP and port
+static inline int GetAddrShard(const CService &ip, int nShards) {
+  uint32_t h = 2166136261u;
+  for (int i = 15; i >= 0; i--)
+    h = (h ^ ip.GetByte(i)) * 16777619u;
+  unsigned short port = ip.GetPort();
+  h = (h ^ (port >> 8)) * 16777619u;
+  h = (h ^ (port & 0xFF)) * 16777619u;
+  return h % nShards;
+}
+
+// FNV-1a of CNetAddr::GetGroup (the /16 for IPv4, /32 for IPv6)
+static inline uint32_t GetGroupHash(const CNetAddr &ip) {
+  std::vector<unsigned char> vchGroup = ip.GetGroup();
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < vchGroup.size(); i++)
+    h = (h ^ vchGroup[i]) * 16777619u;
+  return h;
+}
+
+// Ids bucketed by netgroup, with O(1) insert and erase: each bucket is a
+// vector, and removal swaps the last element (or bucket) into the hole.
+class CGroupIndex {
+private:
+  std::vector<std::vector<int> > vBucket;
+  std::vector<uint32_t> vBucketGroup; // group hash of each bucket
+  std::map<uint32_t, int> mapBucket;  // group hash -> bucket
+  std::vector<int> vBucketOf;         // per id: its bucket, or -1
+  std::vector<int> vPos;              // per id: its position in the bucket
+
+public:
+  void Insert(int id, uint32_t group) {
+    if (id >= (int)vBucketOf.size()) {
+      vBucketOf.resize(id + 1, -1);
+      vPos.resize(id + 1, 0);
+    }
+    if (vBucketOf[id] != -1)
+      return;
+    std::map<uint32_t, int>::iterator it = mapBucket.find(group);
+    if (it == mapBucket.end()) {
+      it = mapBucket.insert(std::make_pair(group, (int)vBucket.size())).first;
+      vBucket.push_back(std::vector<int>());
+      vBucketGroup.push_back(group);
+    }
+    std::vector<int> &bucket = vBucket[it->second];
+    vBucketOf[id] = it->second;
+    vPos[id] = bucket.size();
+    bucket.push_back(id);
+  }
+  void Erase(int id) {
+    if (id >= (int)vBucketOf.size() || vBucketOf[id] == -1)
+      return;
+    int b = vBucketOf[id];
+    std::vector<int> &bucket = vBucket[b];
+    int idLast = bucket.back();
+    bucket[vPos[id]] = idLast;
+    vPos[idLast] = vPos[id];
+    bucket.pop_back();
+    vBucketOf[id] = -1;
+    if (bucket.empty()) {
+      int bLast = vBucket.size() - 1;
+      mapBucket.erase(vBucketGroup[b]);
+      if (b != bLast) {
+        vBucket[b].swap(vBucket[bLast]);
+        vBucketGroup[b] = vBucketGroup[bLast];
+        mapBucket[vBucketGroup[b]] = b;
+        for (size_t i = 0; i < vBucket[b].size(); i++)
+          vBucketOf[vBucket[b][i]] = b;
+      }
+      vBucket.pop_back();
+      vBucketGroup.pop_back();
+    }
+  }
+  void clear() {
+    vBucket.clear();
+    vBucketGroup.clear();
+    mapBucket.clear();
+    vBucketOf.clear();
+    vPos.clear();
+  }
+  int size() const { return vBucket.size(); }
+  const std::vector<int> &Bucket(int b) const { return vBucket[b]; }
+};
+
+// how GetIPs picks good nodes to answer with
+enum {
+  SELECT_RANDOM = 0,   // uniformly
+  SELECT_NETGROUP = 1, // one per netgroup per round, see GetGroupIPs_
+  SELECT_WEIGHTED = 2, // by CAddrInfo::GetSelectWeight, see GetWeightedIPs
+};
+
 //             seen nodes
 //            /          \
 // (a) banned nodes       available nodes--------------
@@ -204,56 +437,103 @@ struct CServiceResult {
 class CAddrDb {
 private:
   mutable CCriticalSection cs;
-  int nId; // number of address id's
-  std::map<int, CAddrInfo> idToInfo; // map address id to address info (b,c,d,e)
+  std::vector<CAddrInfo> vInfo; // address info, indexed by id (b,c,d,e)
+  std::vector<CAddrHot> vHot; // hot fields of vInfo, indexed by id
+  std::vector<int> vFreeId; // ids of released slots, reused before growing vInfo
   std::map<CService, int> ipToId; // map ip to id (b,c,d,e)
   std::deque<int> ourId; // sequence of tried nodes, in order we have tried connecting to them (c,d)
+  int nOurDead; // freed slots still queued in ourId, released once Get_ pops them
   std::set<int> unkId; // set of nodes not yet tried (b)
   std::set<int> goodId; // set of good nodes  (d, good e)
+  CGroupIndex goodGroups; // goodId by netgroup
   int nDirty;
+  int nShard, nShards; // the part of the address space we probe, see SetShard
+  int nSelect; // SELECT_*
   
 protected:
   // internal routines that assume proper locks are acquired
-  void Add_(const CAddress &addr, bool force);   // add an address
+  int Alloc_(const CAddrInfo &info);             // store a new record, and return its id
+  void Free_(int id);                            // release the slot of a record
+  void Queue_(int id);                           // append id to ourId
+  void SyncHot_(int id);                         // refresh vHot[id] after vInfo[id] changed
+  void SetGood_(int id, bool fGood);             // add id to or remove it from goodId (and goodGroups)
+  bool Add_(const CAddress &addr, bool force);   // add an address; returns true if it was new
   bool Get_(CServiceResult &ip, int& wait);      // get an IP to test (must call Good_, Bad_, or Skipped_ on result afterwards)
   bool GetMany_(std::vector<CServiceResult> &ips, int max, int& wait);
-  void Good_(const CService &ip, int clientV, std::string clientSV, int blocks, uint64_t services); // mark an IP as good (must have been returned by Get_)
-  void Bad_(const CService &ip, int ban);  // mark an IP as bad (and optionally ban it) (must have been returned by Get_)
+  void Good_(const CService &ip, int clientV, int clientSV, int blocks, uint64_t services, int64 now); // mark an IP as good (must have been returned by Get_)
+  void Bad_(const CService &ip, int ban, int64 now);  // mark an IP as bad (and optionally ban it) (must have been returned by Get_)
   void Skipped_(const CService &ip);       // mark an IP as skipped (must have been returned by Get_)
+  void Remote_(const CServiceResult &res, int64 now); // apply a result of another seeder for an IP outside our shard
+  bool IsOurs_(const CService &ip) const { return nShards <= 1 || GetAddrShard(ip, nShards) == nShard; }
   int Lookup_(const CService &ip);         // look up id of an IP
   void GetIPs_(std::set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool *nets); // get a random set of IPs (shared lock only)
+  void GetGroupIPs_(std::set<int>& ids, uint64_t requestedFlags, int max, const bool *nets); // GetIPs_ for SELECT_NETGROUP
+  void GetWeightedIPs_(std::vector<std::pair<CNetAddr, float> >& ips, uint64_t requestedFlags, int max, const bool *nets); // (shared lock only)
 
 public:
-  std::map<CService, time_t> banned; // nodes that are banned, with their unban time (a)
+  CBanList banned; // nodes that are banned, with their unban time (a)
+
+  CAddrDb() : nOurDead(0), nDirty(0), nShard(0), nShards(1), nSelect(SELECT_RANDOM) {}
+
+  // Only probe addresses in shard n of nShardsIn; the others are left to
+  // other seeders, whose results are applied with RemoteResultMany.
+  void SetShard(int n, int nShardsIn) {
+    CRITICAL_BLOCK(cs) {
+      nShard = n;
+      nShards = nShardsIn;
+    }
+  }
+
+  void SetSelect(int nSelectIn) {
+    CRITICAL_BLOCK(cs)
+      nSelect = nSelectIn;
+  }
+  int GetSelect() const { return nSelect; }
 
   void GetStats(CAddrDbStats &stats) {
     SHARED_CRITICAL_BLOCK(cs) {
       stats.nBanned = banned.size();
-      stats.nAvail = idToInfo.size();
-      stats.nTracked = ourId.size();
+      stats.nAvail = vInfo.size() - vFreeId.size() - nOurDead;
+      stats.nTracked = ourId.size() - nOurDead;
       stats.nGood = goodId.size();
       stats.nNew = unkId.size();
-      stats.nAge = time(NULL) - idToInfo[ourId[0]].ourLastTry;
+      std::deque<int>::const_iterator it = ourId.begin();
+      while (it != ourId.end() && !vHot[*it].fInUse) it++;
+      stats.nAge = it == ourId.end() ? 0 : time(NULL) - vHot[*it].ourLastTry;
     }
   }
 
+  // contention on the database lock, see CCriticalSection
+  uint64_t GetLockContended(bool fShared) const { return cs.GetContended(fShared); }
+  uint64_t GetLockWaitNanos(bool fShared) const { return cs.GetWaitNanos(fShared); }
+
   void ResetIgnores() {
-      for (std::map<int, CAddrInfo>::iterator it = idToInfo.begin(); it != idToInfo.end(); it++) {
-           (*it).second.ignoreTill = 0;
+      for (int id = 0; id < vInfo.size(); id++) {
+           vInfo[id].ignoreTill = 0;
+           vHot[id].ignoreTill = 0;
       }
   }
   
-  std::vector<CAddrReport> GetAll() {
-    std::vector<CAddrReport> ret;
+  // sort keys of all tried nodes that ever succeeded
+  void GetDumpKeys(std::vector<CDumpKey> &keys) {
     SHARED_CRITICAL_BLOCK(cs) {
+      keys.reserve(ourId.size());
       for (std::deque<int>::const_iterator it = ourId.begin(); it != ourId.end(); it++) {
-        const CAddrInfo &info = idToInfo[*it];
-        if (info.success > 0) {
-          ret.push_back(info.GetReport());
+        if (vHot[*it].fSuccess) {
+          keys.push_back(vInfo[*it].GetDumpKey(*it));
         }
       }
     }
-    return ret;
+  }
+  // reports for a range of keys; nodes removed since GetDumpKeys are skipped,
+  // also when their slot went to another address in the meantime
+  void GetReports(const CDumpKey *begin, const CDumpKey *end, std::vector<CAddrReport> &reports) {
+    SHARED_CRITICAL_BLOCK(cs) {
+      for (const CDumpKey *key = begin; key != end; key++) {
+        if (vHot[key->id].fInUse && vHot[key->id].fSuccess && vInfo[key->id].ip == key->ip)
+          reports.push_back(vInfo[key->id].GetReport());
+      }
+    }
   }
   
   // serialization code
@@ -270,31 +550,33 @@ public:
     SHARED_CRITICAL_BLOCK(cs) {
       if (fWrite) {
         CAddrDb *db = const_cast<CAddrDb*>(this);
-        int n = ourId.size() + unkId.size();
+        int n = ourId.size() - nOurDead + unkId.size();
         READWRITE(n);
         for (std::deque<int>::const_iterator it = ourId.begin(); it != ourId.end(); it++) {
-          std::map<int, CAddrInfo>::iterator ci = db->idToInfo.find(*it);
-          READWRITE((*ci).second);
+          if (vHot[*it].fInUse) READWRITE(db->vInfo[*it]);
         }
         for (std::set<int>::const_iterator it = unkId.begin(); it != unkId.end(); it++) {
-          std::map<int, CAddrInfo>::iterator ci = db->idToInfo.find(*it);
-          READWRITE((*ci).second);
+          READWRITE(db->vInfo[*it]);
         }
       } else {
         CAddrDb *db = const_cast<CAddrDb*>(this);
-        db->nId = 0;
+        db->vInfo.clear();
+        db->vHot.clear();
+        db->vFreeId.clear();
+        db->goodGroups.clear();
         int n = 0;
         READWRITE(n);
+        db->vInfo.reserve(n);
+        db->vHot.reserve(n);
         for (int i=0; i<n; i++) {
           CAddrInfo info;
           READWRITE(info);
-          if (!info.GetBanTime()) {
-            int id = db->nId++;
-            db->idToInfo[id] = info;
+          if (!info.GetBanTime() && !db->banned.IsRangeBanned(info.ip)) {
+            int id = db->Alloc_(info);
             db->ipToId[info.ip] = id;
             if (info.ourLastTry) {
-              db->ourId.push_back(id);
-              if (info.IsGood()) db->goodId.insert(id);
+              db->Queue_(id);
+              if (info.IsGood()) db->SetGood_(id, true);
             } else {
               db->unkId.insert(id);
             }
@@ -306,18 +588,26 @@ public:
     }
   });)
 
+  void BanRange(const CSubNet &subnet) {
+    CRITICAL_BLOCK(cs)
+      banned.BanRange(subnet);
+  }
+
   void Add(const CAddress &addr, bool fForce = false) {
     CRITICAL_BLOCK(cs)
       Add_(addr, fForce);
   }
-  void Add(const std::vector<CAddress> &vAddr, bool fForce = false) {
+  // if pvNew is given, the addresses that were not known yet are appended to it
+  void Add(const std::vector<CAddress> &vAddr, bool fForce = false, std::vector<CAddress> *pvNew = NULL) {
     CRITICAL_BLOCK(cs)
       for (int i=0; i<vAddr.size(); i++)
-        Add_(vAddr[i], fForce);
+        if (Add_(vAddr[i], fForce) && pvNew)
+          pvNew->push_back(vAddr[i]);
   }
-  void Good(const CService &addr, int clientVersion, std::string clientSubVersion, int blocks, uint64_t services) {
+  void Good(const CService &addr, int clientVersion, const std::string &clientSubVersion, int blocks, uint64_t services) {
+    int clientSV = subVersionTable.Intern(clientSubVersion);
     CRITICAL_BLOCK(cs)
-      Good_(addr, clientVersion, clientSubVersion, blocks, services);
+      Good_(addr, clientVersion, clientSV, blocks, services, time(NULL));
   }
   void Skipped(const CService &addr) {
     CRITICAL_BLOCK(cs)
@@ -325,7 +615,7 @@ public:
   }
   void Bad(const CService &addr, int ban = 0) {
     CRITICAL_BLOCK(cs)
-      Bad_(addr, ban);
+      Bad_(addr, ban, time(NULL));
   }
   bool Get(CServiceResult &ip, int& wait) {
     CRITICAL_BLOCK(cs)
@@ -344,18 +634,33 @@ public:
     }
   }
   void ResultMany(const std::vector<CServiceResult> &ips) {
+    int64 now = time(NULL);
     CRITICAL_BLOCK(cs) {
       for (int i=0; i<ips.size(); i++) {
         if (ips[i].fGood) {
-          Good_(ips[i].service, ips[i].nClientV, ips[i].strClientV, ips[i].nHeight, ips[i].services);
+          Good_(ips[i].service, ips[i].nClientV, ips[i].nClientSV, ips[i].nHeight, ips[i].services, now);
         } else {
-          Bad_(ips[i].service, ips[i].nBanTime);
+          Bad_(ips[i].service, ips[i].nBanTime, now);
         }
       }
     }
   }
+  void RemoteResultMany(const std::vector<CServiceResult> &ips) {
+    int64 now = time(NULL);
+    CRITICAL_BLOCK(cs) {
+      for (int i=0; i<ips.size(); i++)
+        Remote_(ips[i], now);
+    }
+  }
   void GetIPs(std::set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool *nets) {
     SHARED_CRITICAL_BLOCK(cs)
       GetIPs_(ips, requestedFlags, max, nets);
   }
+  // up to max random good nodes with their weights (for SELECT_WEIGHTED)
+  void GetWeightedIPs(std::vector<std::pair<CNetAddr, float> >& ips, uint64_t requestedFlags, int max, const bool *nets) {
+    SHARED_CRITICAL_BLOCK(cs)
+      GetWeightedIPs_(ips, requestedFlags, max, nets);
+  }
 };
+
+#endif
@@ -33,27 +33,11 @@ union control_data {
   unsigned char data[DSTADDR_DATASIZE];
 };
 
-typedef enum {
-  CLASS_IN = 1,
-  QCLASS_ANY = 255
-} dns_class;
-
-typedef enum {
-  TYPE_A = 1,
-  TYPE_NS = 2,
-  TYPE_CNAME = 5,
-  TYPE_SOA = 6,
-  TYPE_MX = 15,
-  TYPE_AAAA = 28,
-  TYPE_SRV = 33,
-  QTYPE_ANY = 255
-} dns_type;
-
 
 //  0: ok
 // -1: premature end of input, forward reference, component > 63 char, invalid character
 // -2: insufficient space in output
-int static parse_name(const unsigned char **inpos, const unsigned char *inend, const unsigned char *inbuf, char *buf, size_t bufsize) {
+int parse_name(const unsigned char **inpos, const unsigned char *inend, const unsigned char *inbuf, char *buf, size_t bufsize) {
   size_t bufused = 0;
   int init = 1;
   do {
@@ -97,6 +81,87 @@ int static parse_name(const unsigned char **inpos, const unsigned char *inend, c
   } while(1);
 }
 
+int dns_set_zone(dns_opt_t *opt) {
+  const char *p = opt->host;
+  int len = 0, labels = 0;
+  while (*p) {
+    const char *dot = strchr(p, '.');
+    int n = dot ? dot - p : strlen(p);
+    if (n == 0 || n > 63 || len + n + 2 > 255) return -1;
+    opt->zone[len] = n;
+    opt->zonemask[len++] = 0;
+    for (int i = 0; i < n; i++, len++) {
+      unsigned char c = tolower((unsigned char)p[i]);
+      opt->zone[len] = c;
+      opt->zonemask[len] = (c >= 'a' && c <= 'z') ? 0x20 : 0;
+    }
+    labels++;
+    p += n;
+    if (*p) p++;
+  }
+  opt->zone[len] = 0;
+  opt->zonemask[len++] = 0;
+  opt->zonelen = len;
+  opt->zonelabels = labels;
+  return 0;
+}
+
+// compare zonelen bytes at name with the zone, case-insensitively, from
+// the end (where names under the zone first differ), 8 bytes at a time
+static int zone_equal(const dns_opt_t *opt, const unsigned char *name) {
+  int i = opt->zonelen;
+  for (; i >= 8; i -= 8) {
+    uint64_t a, m, z;
+    memcpy(&a, name + i - 8, 8);
+    memcpy(&m, opt->zonemask + i - 8, 8);
+    memcpy(&z, opt->zone + i - 8, 8);
+    if ((a | m) != z) return 0;
+  }
+  while (i--)
+    if ((name[i] | opt->zonemask[i]) != opt->zone[i]) return 0;
+  return 1;
+}
+
+int match_zone(const dns_opt_t *opt, const unsigned char **inpos, const unsigned char *inend, const unsigned char **label, int *labellen) {
+  const unsigned char *start = *inpos, *p = start;
+  const unsigned char *labels[128];
+  int n = 0;
+  do {
+    if (p == inend)
+      return -1;
+    int octet = *p;
+    if (octet == 0)
+      break;
+    if ((octet & 0xC0) == 0xC0)
+      return -3;
+    if (octet > 63 || inend - p - 1 < octet)
+      return -1;
+    if (n == 128 || p + 1 + octet - start >= 255)
+      return -2;
+    labels[n++] = p;
+    p += 1 + octet;
+  } while(1);
+  *inpos = p + 1;
+  // the zone must start at a label boundary: at the zonelabels-th label
+  // from the end. Its labels have no dots if it matches, the others are
+  // checked here.
+  int k = n - opt->zonelabels;
+  bool fMatch = k >= 0 && (k == n ? p : labels[k]) == p + 1 - opt->zonelen && zone_equal(opt, p + 1 - opt->zonelen);
+  for (int i = 0; i < (fMatch ? k : n); i++)
+    if (memchr(labels[i] + 1, '.', labels[i][0]))
+      return -1;
+  if (!fMatch)
+    return 0;
+  if (k == 0) {
+    *label = NULL;
+    *labellen = 0;
+  } else {
+    *label = labels[0] + 1;
+    *labellen = labels[0][0];
+  }
+  return 1;
+}
+
 //  0: k
 // -1: component > 63 characters
 // -2: insufficent space in output
@@ -127,6 +192,23 @@ int static write_name(unsigned char** outpos, const unsigned char *outend, const
   return 0;
 }
 
+int write_query(unsigned char *outbuf, size_t outsize, uint16_t id, const char *name, int typ, int cls) {
+  if (outsize < 12) return -2;
+  unsigned char *outpos = outbuf, *outend = outbuf + outsize;
+  // id, RD, one question
+  *(outpos++) = id >> 8; *(outpos++) = id & 0xFF;
+  *(outpos++) = 0x01; *(outpos++) = 0x00;
+  *(outpos++) = 0; *(outpos++) = 1;
+  memset(outpos, 0, 6);
+  outpos += 6;
+  int ret = write_name(&outpos, outend, name, -1);
+  if (ret) return ret;
+  if (outend - outpos < 4) return -2;
+  *(outpos++) = typ >> 8; *(outpos++) = typ & 0xFF;
+  *(outpos++) = cls >> 8; *(outpos++) = cls & 0xFF;
+  return outpos - outbuf;
+}
+
 int static write_record(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_type typ, dns_class cls, int ttl) {
   unsigned char *oldpos = *outpos;
   int error = 0;
@@ -152,7 +234,7 @@ int static write_record(unsigned char** outpos, const unsigned char *outend, con
 }
 
 
-int static write_record_a(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const addr_t *ip) {
+int write_record_a(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const addr_t *ip) {
   if (ip->v != 4)
      return -6;
   unsigned char *oldpos = *outpos;
@@ -173,7 +255,7 @@ int static write_record_a(unsigned char** outpos, const unsigned char *outend, c
   return error;
 }
 
-int static write_record_aaaa(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const addr_t *ip) {
+int write_record_aaaa(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const addr_t *ip) {
   if (ip->v != 6)
      return -6;
   unsigned char *oldpos = *outpos;
@@ -194,7 +276,7 @@ int static write_record_aaaa(unsigned char** outpos, const unsigned char *outend
   return error;
 }
 
-int static write_record_ns(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const char *ns) {
+int write_record_ns(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const char *ns) {
   unsigned char *oldpos = *outpos;
   int ret = write_record(outpos, outend, name, offset, TYPE_NS, cls, ttl);
   if (ret) return ret;
@@ -217,7 +299,7 @@ int static write_record_ns(unsigned char** outpos, const unsigned char *outend,
   return error;
 }
 
-int static write_record_soa(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const char* mname, const char *rname,
+int write_record_soa(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const char* mname, const char *rname,
                      uint32_t serial, uint32_t refresh, uint32_t retry, uint32_t expire, uint32_t minimum) {
   unsigned char *oldpos = *outpos;
   int ret = write_record(outpos, outend, name, offset, TYPE_SOA, cls, ttl);
@@ -266,8 +348,103 @@ static ssize_t set_error(unsigned char* outbuf, int error) {
   return 12;
 }
 
-ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insize, unsigned char* outbuf) {
+#define EDNS_OPT 41
+#define EDNS_OPTION_ECS 8
+
+// Parse the OPT record of a request (RFC 6891), if it is the first record
+// of the additional section at inpos, and its client subnet option into
+// opt. Returns 0, or the rcode for a malformed or unsupported request.
+static int parse_edns(dns_opt_t *opt, const unsigned char *inpos, const unsigned char *inend) {
+  if (inend - inpos < 11 || inpos[0] != 0 || inpos[1] != (EDNS_OPT >> 8) || inpos[2] != (EDNS_OPT & 0xFF))
+    return 0;
+  opt->fEdns = 1;
+  if (inpos[6] != 0) // version
+    return 16; // BADVERS
+  int rdlen = (inpos[9] << 8) + inpos[10];
+  inpos += 11;
+  if (inend - inpos < rdlen)
+    return 1;
+  inend = inpos + rdlen;
+  while (inend - inpos >= 4) {
+    int code = (inpos[0] << 8) + inpos[1];
+    int len = (inpos[2] << 8) + inpos[3];
+    inpos += 4;
+    if (inend - inpos < len)
+      return 1;
+    if (code == EDNS_OPTION_ECS) {
+      if (len < 4 || opt->ecsFamily)
+        return 1;
+      int family = (inpos[0] << 8) + inpos[1];
+      int source = inpos[2];
+      if (family != 1 && family != 2)
+        return 5;
+      if (source > (family == 1 ? 32 : 128) || inpos[3] != 0 || len - 4 != (source + 7) / 8)
+        return 1;
+      unsigned char *ecs = opt->ecs.s6_addr;
+      memset(ecs, 0, 16);
+      if (family == 1) {
+        ecs[10] = ecs[11] = 0xFF;
+        ecs += 12;
+      }
+      memcpy(ecs, inpos + 4, len - 4);
+      if (source % 8)
+        ecs[source / 8] &= 0xFF << (8 - source % 8);
+      opt->ecsFamily = family;
+      opt->ecsSource = source;
+      ++opt->nEcsRequests;
+    }
+    inpos += len;
+  }
+  return inpos == inend ? 0 : 1;
+}
+
+// size of the OPT record write_opt writes for opt
+static int opt_size(const dns_opt_t *opt) {
+  if (!opt->fEdns)
+    return 0;
+  return 11 + (opt->ecsFamily ? 8 + (opt->ecsSource + 7) / 8 : 0);
+}
+
+// append an OPT record with our payload size (and the request's client
+// subnet, with our scope); 0 on success, negative if it does not fit
+static int write_opt(unsigned char **outpos, const unsigned char *outend, const dns_opt_t *opt, int extrcode) {
+  int size = opt_size(opt);
+  if (outend - *outpos < size)
+    return -5;
+  unsigned char *p = *outpos;
+  int rdlen = size - 11;
+  p[0] = 0;
+  p[1] = EDNS_OPT >> 8; p[2] = EDNS_OPT & 0xFF;
+  p[3] = BUFLEN >> 8;   p[4] = BUFLEN & 0xFF;
+  p[5] = extrcode; p[6] = 0; p[7] = 0; p[8] = 0;
+  p[9] = rdlen >> 8;    p[10] = rdlen & 0xFF;
+  if (opt->ecsFamily) {
+    int addrlen = (opt->ecsSource + 7) / 8;
+    p[11] = EDNS_OPTION_ECS >> 8; p[12] = EDNS_OPTION_ECS & 0xFF;
+    p[13] = (4 + addrlen) >> 8;   p[14] = (4 + addrlen) & 0xFF;
+    p[15] = 0; p[16] = opt->ecsFamily;
+    p[17] = opt->ecsSource;
+    p[18] = opt->ecsScope;
+    memcpy(p + 19, opt->ecs.s6_addr + (opt->ecsFamily == 1 ? 12 : 0), addrlen);
+  }
+  *outpos += size;
+  return 0;
+}
+
+static int64_t dns_time_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+ssize_t dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insize, unsigned char* outbuf) {
   int error = 0;
+  opt->fEdns = 0;
+  opt->ecsFamily = 0;
+  opt->ecsSource = 0;
+  opt->ecsScope = 0;
+  opt->qtype = 0;
+  opt->qflags = 0;
   if (insize < 12) // DNS header
     return -1;
   // copy id
@@ -294,11 +471,22 @@ ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insi
   const unsigned char *inend = inbuf + insize;
   char name[256];
   int offset = inpos - inbuf;
-  int ret = parse_name(&inpos, inend, inbuf, name, 256);
+  const unsigned char *label;
+  int labellen;
+  int ret = match_zone(opt, &inpos, inend, &label, &labellen);
+  if (ret == -3) {
+    // compression in the question, which resolvers don't send: decode it
+    ret = parse_name(&inpos, inend, inbuf, name, 256);
+    if (ret == 0) {
+      int namel = strlen(name), hostl = strlen(opt->host);
+      ret = !strcasecmp(name, opt->host) || (namel>=hostl+2 && name[namel-hostl-1]=='.' && !strcasecmp(name+namel-hostl,opt->host));
+      const char *dot = strchr(name, '.');
+      label = ret && namel != hostl ? (const unsigned char*)name : NULL;
+      labellen = label ? dot - name : 0;
+    }
+  }
   if (ret == -1) return set_error(outbuf, 1);
-  if (ret == -2) return set_error(outbuf, 5);
-  int namel = strlen(name), hostl = strlen(opt->host);
-  if (strcasecmp(name, opt->host) && (namel<hostl+2 || name[namel-hostl-1]!='.' || strcasecmp(name+namel-hostl,opt->host))) return set_error(outbuf, 5);
+  if (ret == -2 || ret == 0) return set_error(outbuf, 5);
   if (inend - inpos < 4) return set_error(outbuf, 1);
   // copy question to output
   memcpy(outbuf+12, inbuf+12, inpos+4 - (inbuf+12));
@@ -312,10 +500,26 @@ ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insi
   
   int typ = (inpos[0] << 8) + inpos[1];
   int cls = (inpos[2] << 8) + inpos[3];
+  opt->qtype = typ;
   inpos += 4;
   
   unsigned char *outpos = outbuf+(inpos-inbuf);
   unsigned char *outend = outbuf + BUFLEN;
+
+  // EDNS, if the additional section comes right after the question
+  if (inbuf[6] == 0 && inbuf[7] == 0 && inbuf[8] == 0 && inbuf[9] == 0 && (inbuf[10] || inbuf[11])) {
+    int rcode = parse_edns(opt, inpos, inend);
+    if (rcode == 16) {
+      write_opt(&outpos, outend, opt, 1);
+      outbuf[11] = 1;
+      outbuf[2] |= 4;
+      return outpos - outbuf;
+    }
+    if (rcode)
+      return set_error(outbuf, rcode);
+  }
+  // keep room for the OPT record of the response
+  outend -= opt_size(opt);
   
 //   printf("DNS: Request host='%s' type=%i class=%i\n", name, typ, cls);
   
@@ -357,7 +561,7 @@ ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insi
   // A/AAAA records
   if ((typ == TYPE_A || typ == TYPE_AAAA || typ == QTYPE_ANY) && (cls == CLASS_IN || cls == QCLASS_ANY)) {
     addr_t addr[32];
-    int naddr = opt->cb((void*)opt, name, addr, 32, typ == TYPE_A || typ == QTYPE_ANY, typ == TYPE_AAAA || typ == QTYPE_ANY);
+    int naddr = opt->cb((void*)opt, label, labellen, addr, 32, typ == TYPE_A || typ == QTYPE_ANY, typ == TYPE_AAAA || typ == QTYPE_ANY);
     int n = 0;
     while (n < naddr) {
       int ret = 1;
@@ -392,12 +596,109 @@ ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insi
     if (!ret2) { outbuf[9]++; }
   }
   
+  // Additional section
+  if (opt->fEdns && !write_opt(&outpos, outend + opt_size(opt), opt, 0))
+    outbuf[11]++;
+
   // set AA
   outbuf[2] |= 4;
   
   return outpos - outbuf;
 }
 
+static uint64_t rrl_key(const struct in6_addr *addr, int kind) {
+  // IPv4 clients are ::ffff:a.b.c.d, so 15 bytes are a /24
+  int n = IN6_IS_ADDR_V4MAPPED(addr) ? 15 : 7;
+  uint64_t h = 14695981039346656037ULL;
+  for (int i = 0; i < n; i++)
+    h = (h ^ addr->s6_addr[i]) * 1099511628211ULL;
+  return (h ^ kind) * 1099511628211ULL;
+}
+
+bool dns_rrl_limit(dns_rrl_t *rrl, const struct in6_addr *addr, int kind, int64_t now) {
+  uint64_t key = rrl_key(addr, kind);
+  std::atomic<uint64_t> &bucket = rrl->buckets[key & (DNS_RRL_BUCKETS - 1)];
+  uint32_t tag = key >> 32;
+  uint16_t t = now;
+  uint64_t old = bucket.load(std::memory_order_relaxed);
+  while (1) {
+    int tokens = rrl->rate;
+    // a second refills the bucket to its capacity, rate, so only a bucket
+    // touched this very second keeps its count
+    if ((uint32_t)(old >> 32) == tag && t == (uint16_t)(old >> 16))
+      tokens = old & 0xFFFF;
+    bool limited = tokens == 0;
+    if (!limited) tokens--;
+    uint64_t val = ((uint64_t)tag << 32) | ((uint64_t)t << 16) | tokens;
+    if (bucket.compare_exchange_weak(old, val, std::memory_order_relaxed))
+      return limited;
+  }
+}
+
+// cut a response down to its header and question, with TC set
+static ssize_t truncate_response(unsigned char *outbuf, ssize_t len) {
+  ssize_t pos = 12;
+  if (outbuf[5] == 1) {
+    while (pos < len) {
+      int octet = outbuf[pos];
+      if (octet == 0) { pos++; break; }
+      if ((octet & 0xC0) == 0xC0) { pos += 2; break; }
+      pos += octet + 1;
+    }
+    pos += 4;
+    if (pos > len) pos = 12;
+  }
+  if (pos == 12) { outbuf[4] = 0; outbuf[5] = 0; }
+  outbuf[2] |= 2;
+  outbuf[6] = 0;  outbuf[7] = 0;
+  outbuf[8] = 0;  outbuf[9] = 0;
+  outbuf[10] = 0; outbuf[11] = 0;
+  return pos;
+}
+
+void dns_qlog_push(dns_qlog_t *qlog, const dns_qrec_t *rec) {
+  uint32_t head = qlog->head.load(std::memory_order_relaxed);
+  if (head - qlog->tail.load(std::memory_order_acquire) == DNS_QLOG_SIZE) {
+    ++qlog->nDropped;
+    return;
+  }
+  qlog->rec[head & (DNS_QLOG_SIZE - 1)] = *rec;
+  qlog->head.store(head + 1, std::memory_order_release);
+}
+
+int dns_qlog_pop(dns_qlog_t *qlog, dns_qrec_t *out, int max) {
+  uint32_t tail = qlog->tail.load(std::memory_order_relaxed);
+  uint32_t n = qlog->head.load(std::memory_order_acquire) - tail;
+  if (n > max) n = max;
+  for (uint32_t i = 0; i < n; i++)
+    out[i] = qlog->rec[(tail + i) & (DNS_QLOG_SIZE - 1)];
+  qlog->tail.store(tail + n, std::memory_order_release);
+  return n;
+}
+
+static void qlog_query(dns_opt_t *opt, const unsigned char *outbuf, ssize_t len, int action) {
+  dns_qrec_t rec;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rec.time = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  rec.flags = opt->qflags;
+  memset(rec.prefix, 0, sizeof(rec.prefix));
+  if (IN6_IS_ADDR_V4MAPPED(&opt->client)) {
+    memcpy(rec.prefix, opt->client.s6_addr + 12, 3);
+    rec.family = 4;
+  } else {
+    memcpy(rec.prefix, opt->client.s6_addr, 7);
+    rec.family = 6;
+  }
+  rec.qtype = opt->qtype;
+  rec.size = len;
+  rec.rcode = outbuf[3] & 15;
+  rec.answers = outbuf[7];
+  rec.action = action;
+  rec.reserved = 0;
+  dns_qlog_push(opt->qlog, &rec);
+}
+
 static int listenSocket = -1;
 
 int dnsserver(dns_opt_t *opt) {
@@ -450,13 +751,36 @@ int dnsserver(dns_opt_t *opt) {
   {
     ssize_t insize = recvmsg(listenSocket, &msg, 0);
 //    unsigned char *addr = (unsigned char*)&si_other.sin_addr.s_addr;
-//    printf("DNS: Request %llu from %i.%i.%i.%i:%i of %i bytes\n", (unsigned long long)(opt->nRequests), addr[0], addr[1], addr[2], addr[3], ntohs(si_other.sin_port), (int)insize);
+//    printf("DNS: Request %llu from %i.%i.%i.%i:%i of %i bytes\n", (unsigned long long)(opt->nRequests.Get()), addr[0], addr[1], addr[2], addr[3], ntohs(si_other.sin_port), (int)insize);
     if (insize <= 0)
       continue;
 
+    int64_t start = dns_time_nanos();
+    opt->client = si_other.sin6_addr;
     ssize_t ret = dnshandle(opt, inbuf, insize, outbuf);
+    opt->histHandle.Add(dns_time_nanos() - start);
     if (ret <= 0)
       continue;
+    int action = QLOG_SENT;
+    if (opt->rrl) {
+      int kind = (outbuf[3] & 15) ? RRL_ERROR : (outbuf[6] || outbuf[7]) ? RRL_ANSWER : RRL_EMPTY;
+      if (dns_rrl_limit(opt->rrl, &si_other.sin6_addr, kind, start / 1000000000)) {
+        if (opt->rrl->slip && ++opt->nLimited % opt->rrl->slip == 0) {
+          ret = truncate_response(outbuf, ret);
+          ++opt->nRateSlipped;
+          action = QLOG_SLIPPED;
+        } else {
+          ++opt->nRateDropped;
+          action = QLOG_DROPPED;
+        }
+      }
+    }
+    if (opt->qlog)
+      qlog_query(opt, outbuf, ret, action);
+    if (action == QLOG_DROPPED)
+      continue;
+    ++opt->nResponses;
+    opt->nResponseBytes += ret;
 
     bool handled = false;
     for (struct cmsghdr*hdr = CMSG_FIRSTHDR(&msg); hdr; hdr = CMSG_NXTHDR(&msg, hdr))
@@ -2,6 +2,28 @@
 #define _DNS_H_ 1
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <atomic>
+
+#include "metrics.h"
+
+typedef enum {
+  CLASS_IN = 1,
+  QCLASS_ANY = 255
+} dns_class;
+
+typedef enum {
+  TYPE_A = 1,
+  TYPE_NS = 2,
+  TYPE_CNAME = 5,
+  TYPE_SOA = 6,
+  TYPE_MX = 15,
+  TYPE_AAAA = 28,
+  TYPE_SRV = 33,
+  QTYPE_ANY = 255
+} dns_type;
 
 struct addr_t {
     int v;
@@ -11,6 +33,82 @@ struct addr_t {
     } data;
 };
 
+#define DNS_RRL_BUCKETS (1 << 16)
+
+// Response rate limiting, as in BIND's RRL: responses to each client prefix
+// (/24 for IPv4, /56 for IPv6) and kind of response (answer, empty, error)
+// are limited to rate per second by a token bucket. Over the limit, every
+// slip-th response is sent truncated and empty, so that real resolvers can
+// still get through, and the others are dropped.
+//
+// The buckets are shared by all DNS threads and updated lock-free: each is
+// a 64-bit word of a 32-bit key tag, the time of the last update (seconds,
+// 16 bits) and the tokens left (16 bits). Keys that collide on a bucket
+// evict each other, which only ever lets more responses through.
+struct dns_rrl_t {
+  int rate;
+  int slip;
+  std::atomic<uint64_t> buckets[DNS_RRL_BUCKETS];
+
+  dns_rrl_t(int rateIn, int slipIn) : rate(rateIn), slip(slipIn) {
+    for (int i = 0; i < DNS_RRL_BUCKETS; i++)
+      buckets[i].store(0, std::memory_order_relaxed);
+  }
+};
+
+enum {
+  RRL_ANSWER = 0,
+  RRL_EMPTY = 1,
+  RRL_ERROR = 2,
+};
+
+// charge a response of the given kind to addr's prefix at time now
+// (seconds); returns true if it is over the limit
+bool dns_rrl_limit(dns_rrl_t *rrl, const struct in6_addr *addr, int kind, int64_t now);
+
+#define DNS_QLOG_SIZE 16384 // records per ring, a power of 2
+
+enum {
+  QLOG_SENT = 0,
+  QLOG_SLIPPED = 1, // over the rate limit, sent truncated
+  QLOG_DROPPED = 2, // over the rate limit, not sent
+};
+
+// A query, for the query log (32 bytes). The client is the /24 (IPv4, in
+// prefix[0..2]) or /56 (IPv6, prefix[0..6]) of its address, as for rate
+// limiting.
+struct dns_qrec_t {
+  int64_t time;     // microseconds since the epoch
+  uint64_t flags;   // service flags requested by an A/AAAA/ANY query, or 0
+  uint8_t prefix[7];
+  uint8_t family;   // 4 or 6
+  uint16_t qtype;   // 0 if the request had no valid question
+  uint16_t size;    // of the response, even if it was dropped
+  uint8_t rcode;
+  uint8_t answers;  // records in the answer section
+  uint8_t action;   // QLOG_*
+  uint8_t reserved;
+};
+
+// Query records from one DNS thread to the query log writer: a
+// single-producer, single-consumer ring. The DNS thread never waits; when
+// the ring is full, its record is dropped (and counted).
+struct dns_qlog_t {
+  std::atomic<uint32_t> head; // next record to write, by the DNS thread
+  char pad1[60];
+  std::atomic<uint32_t> tail; // next record to read, by the writer
+  char pad2[60];
+  CStatCounter nDropped;
+  dns_qrec_t rec[DNS_QLOG_SIZE];
+
+  dns_qlog_t() : head(0), tail(0) {}
+};
+
+// append rec to the ring, or count it as dropped if the ring is full
+void dns_qlog_push(dns_qlog_t *qlog, const dns_qrec_t *rec);
+// take up to max records from the ring into out; returns their number
+int dns_qlog_pop(dns_qlog_t *qlog, dns_qrec_t *out, int max);
+
 struct dns_opt_t {
   int port;
   int datattl;
@@ -19,11 +117,75 @@ struct dns_opt_t {
   const char *addr;
   const char *ns;
   const char *mbox;
-  int (*cb)(void *opt, char *requested_hostname, addr_t *addr, int max, int ipv4, int ipv6);
+  // label is the leftmost label of the requested name (not terminated),
+  // or NULL with labellen 0 for the zone itself
+  int (*cb)(void *opt, const unsigned char *label, int labellen, addr_t *addr, int max, int ipv4, int ipv6);
+  dns_rrl_t *rrl; // NULL for no rate limiting
+  // host in wire format and lower case, with 0x20 at its letters in
+  // zonemask (see dns_set_zone)
+  unsigned char zone[256];
+  unsigned char zonemask[256];
+  int zonelen;
+  int zonelabels;
+  struct in6_addr client; // source address of the request being handled
+  // EDNS of the request being handled: whether it has an OPT record, and
+  // its client subnet option (RFC 7871) if any: family (1 IPv4, 2 IPv6, 0
+  // none), source prefix length and address (IPv4 mapped into IPv6). The
+  // callback sets ecsScope to the prefix length its answer depends on.
+  int fEdns;
+  int ecsFamily;
+  int ecsSource;
+  int ecsScope;
+  struct in6_addr ecs;
+  int qtype; // of the request being handled, 0 if it has no valid question
+  uint64_t qflags; // service flags requested, set by the callback
+  dns_qlog_t *qlog; // NULL for no query log
+  unsigned int nLimited; // responses over the limit, for slip
   // stats
-  uint64_t nRequests;
+  CStatCounter nRequests;
+  CStatCounter nResponses;
+  CStatCounter nResponseBytes;
+  CLatencyHistogram histHandle; // time spent in dnshandle
+  CStatCounter nRateDropped;
+  CStatCounter nRateSlipped;
+  CStatCounter nEcsRequests; // with a client subnet option
 };
 
+// encode opt->host into opt->zone; call once host is set. Returns 0, or
+// -1 if host is not a valid name
+int dns_set_zone(dns_opt_t *opt);
+
 int dnsserver(dns_opt_t *opt);
 
+// The functions below are the building blocks of dnsserver, exposed for
+// benchmarking.
+
+// decode a (possibly compressed) name at *inpos into buf, as a dotted
+// string; 0 on success, negative on malformed input or overflow of buf
+int parse_name(const unsigned char **inpos, const unsigned char *inend, const unsigned char *inbuf, char *buf, size_t bufsize);
+
+// match the uncompressed name at *inpos against opt->zone without decoding
+// it; returns 1 if it is the zone or below it (with its leftmost label, as
+// for cb), 0 if it is not, -1 or -2 as parse_name, and -3 if the name is
+// compressed (*inpos is then unchanged)
+int match_zone(const dns_opt_t *opt, const unsigned char **inpos, const unsigned char *inend, const unsigned char **label, int *labellen);
+
+// append a resource record at *outpos, whose owner name is name followed by
+// a compression pointer to offset (or just name, if offset is -1); 0 on
+// success, negative if the record does not fit (*outpos is then unchanged)
+int write_record_a(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const addr_t *ip);
+int write_record_aaaa(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const addr_t *ip);
+int write_record_ns(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const char *ns);
+int write_record_soa(unsigned char** outpos, const unsigned char *outend, const char *name, int offset, dns_class cls, int ttl, const char* mname, const char *rname,
+                     uint32_t serial, uint32_t refresh, uint32_t retry, uint32_t expire, uint32_t minimum);
+
+// build a query for name with a single question and RD set into outbuf;
+// returns its length, or negative as write_name if name is invalid or the
+// query does not fit
+int write_query(unsigned char *outbuf, size_t outsize, uint16_t id, const char *name, int typ, int cls);
+
+// build the response to the request in inbuf into outbuf (at least 512
+// bytes); returns its length, or -1 if the request is to be ignored
+ssize_t dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insize, unsigned char* outbuf);
+
 #endif
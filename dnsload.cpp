@@ -0,0 +1,356 @@
+// DNS load generator: sends queries for the seed's names to a (local)
+// dnsseed at a fixed rate, in batches with sendmmsg(), and reports the
+// achieved rate, loss and latency percentiles.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+
+#include "dns.h"
+#include "util.h"
+
+using namespace std;
+
+#define MAX_BATCH 256
+#define MAX_SOCKETS 64
+
+// one kind of query in the mix
+struct CQueryType {
+  string name;
+  vector<unsigned char> packet; // id is filled in per query
+  int weight;
+  uint64_t nSent, nReceived, nErrors;
+  CLatencyHistogram hist;
+};
+
+class CDnsLoadOpts {
+public:
+  const char *server;
+  int nPort;
+  const char *host;
+  const char *mix;
+  int nRate;
+  int nDuration;
+  int nBatch;
+  int nSockets;
+  int nTimeout;
+
+  CDnsLoadOpts() : server("127.0.0.1"), nPort(53), host(NULL), mix("A=80,AAAA=15,ANY=5"), nRate(10000), nDuration(10), nBatch(32), nSockets(4), nTimeout(1000) {}
+
+  void ParseCommandLine(int argc, char **argv) {
+    static const char *help = "DNS load generator for dnsseed\n"
+                              "Usage: %s -h <host> [-s <server>] [-p <port>] [-r <rate>] [-d <seconds>]\n"
+                              "\n"
+                              "Options:\n"
+                              "-h <host>       Hostname of the DNS seed to query\n"
+                              "-s <address>    Address of the server (default 127.0.0.1)\n"
+                              "-p <port>       UDP port of the server (default 53)\n"
+                              "-r <qps>        Queries per second to send (default 10000)\n"
+                              "-d <seconds>    Duration of the test (default 10)\n"
+                              "-m <mix>        Query mix, as comma-separated type[/label]=weight entries,\n"
+                              "                where type is A, AAAA, ANY, NS, SOA or a number and the\n"
+                              "                optional label is prepended to the host, e.g.\n"
+                              "                A=60,AAAA=20,A/x9=15,ANY=5 (default A=80,AAAA=15,ANY=5)\n"
+                              "-b <n>          Queries per sendmmsg() batch (default 32)\n"
+                              "-c <n>          Number of client sockets (default 4); each can have up\n"
+                              "                to 65536 queries in flight\n"
+                              "-t <ms>         Time after which a query is counted as lost (default 1000)\n"
+                              "-?, --help      Show this text\n"
+                              "\n";
+    bool showHelp = false;
+
+    while(1) {
+      static struct option long_options[] = {
+        {"host", required_argument, 0, 'h'},
+        {"server", required_argument, 0, 's'},
+        {"port", required_argument, 0, 'p'},
+        {"rate", required_argument, 0, 'r'},
+        {"duration", required_argument, 0, 'd'},
+        {"mix", required_argument, 0, 'm'},
+        {"batch", required_argument, 0, 'b'},
+        {"sockets", required_argument, 0, 'c'},
+        {"timeout", required_argument, 0, 't'},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+      };
+      int option_index = 0;
+      int c = getopt_long(argc, argv, "h:s:p:r:d:m:b:c:t:", long_options, &option_index);
+      if (c == -1) break;
+      switch (c) {
+        case 'h': host = optarg; break;
+        case 's': server = optarg; break;
+        case 'm': mix = optarg; break;
+        case 'p': {
+          int p = strtol(optarg, NULL, 10);
+          if (p > 0 && p < 65536) nPort = p;
+          break;
+        }
+        case 'r': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0) nRate = n;
+          break;
+        }
+        case 'd': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0) nDuration = n;
+          break;
+        }
+        case 'b': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0 && n <= MAX_BATCH) nBatch = n;
+          break;
+        }
+        case 'c': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0 && n <= MAX_SOCKETS) nSockets = n;
+          break;
+        }
+        case 't': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0) nTimeout = n;
+          break;
+        }
+        case '?': {
+          showHelp = true;
+          break;
+        }
+      }
+    }
+    if (host == NULL) {
+      fprintf(stderr, "No host set. Please use -h.\n");
+      showHelp = true;
+    }
+    if (showHelp) {
+      fprintf(stderr, help, argv[0]);
+      exit(0);
+    }
+  }
+};
+
+static bool ParseMix(const char *mix, const char *host, vector<CQueryType*> &types) {
+  string s(mix);
+  size_t pos = 0;
+  while (pos <= s.size()) {
+    size_t end = s.find(',', pos);
+    if (end == string::npos) end = s.size();
+    string entry = s.substr(pos, end - pos);
+    pos = end + 1;
+    if (entry.empty()) continue;
+    size_t eq = entry.find('=');
+    int weight = eq == string::npos ? 1 : atoi(entry.c_str() + eq + 1);
+    string spec = entry.substr(0, eq);
+    string label;
+    size_t slash = spec.find('/');
+    if (slash != string::npos) {
+      label = spec.substr(slash + 1);
+      spec = spec.substr(0, slash);
+    }
+    int typ;
+    if (strcasecmp(spec.c_str(), "A") == 0) typ = TYPE_A;
+    else if (strcasecmp(spec.c_str(), "AAAA") == 0) typ = TYPE_AAAA;
+    else if (strcasecmp(spec.c_str(), "ANY") == 0) typ = QTYPE_ANY;
+    else if (strcasecmp(spec.c_str(), "NS") == 0) typ = TYPE_NS;
+    else if (strcasecmp(spec.c_str(), "SOA") == 0) typ = TYPE_SOA;
+    else typ = atoi(spec.c_str());
+    if (typ <= 0 || typ > 65535 || weight <= 0) {
+      fprintf(stderr, "Invalid query mix entry '%s'\n", entry.c_str());
+      return false;
+    }
+    string name = label.empty() ? string(host) : label + "." + host;
+    unsigned char buf[512];
+    int len = write_query(buf, sizeof(buf), 0, name.c_str(), typ, CLASS_IN);
+    if (len < 0) {
+      fprintf(stderr, "Invalid query name '%s'\n", name.c_str());
+      return false;
+    }
+    CQueryType *t = new CQueryType();
+    t->name = entry.substr(0, eq);
+    t->packet.assign(buf, buf + len);
+    t->weight = weight;
+    t->nSent = t->nReceived = t->nErrors = 0;
+    types.push_back(t);
+  }
+  return !types.empty();
+}
+
+// what is in flight on a socket, indexed by query id
+struct CInFlight {
+  int64_t nSent; // 0 if free
+  int nType;
+};
+
+static void PrintLatency(const char *name, uint64_t nSent, uint64_t nReceived, uint64_t nErrors, const CHistogramSnapshot &snap) {
+  double loss = nSent ? 100.0 * (nSent - nReceived) / nSent : 0;
+  printf("%-16s %10llu %10llu %7.3f%% %8llu %9.1f %9.1f %9.1f %9.1f\n", name, (unsigned long long)nSent, (unsigned long long)nReceived, loss, (unsigned long long)nErrors,
+         snap.GetPercentile(0.5) * 1e-3, snap.GetPercentile(0.9) * 1e-3, snap.GetPercentile(0.99) * 1e-3, snap.GetPercentile(0.999) * 1e-3);
+}
+
+int main(int argc, char **argv) {
+  CDnsLoadOpts opts;
+  opts.ParseCommandLine(argc, argv);
+  vector<CQueryType*> types;
+  if (!ParseMix(opts.mix, opts.host, types))
+    return 1;
+  int nTotalWeight = 0;
+  for (size_t i = 0; i < types.size(); i++)
+    nTotalWeight += types[i]->weight;
+
+  struct sockaddr_in6 si_server;
+  memset(&si_server, 0, sizeof(si_server));
+  si_server.sin6_family = AF_INET6;
+  si_server.sin6_port = htons(opts.nPort);
+  string server(opts.server);
+  if (server.find(':') == string::npos)
+    server = "::ffff:" + server;
+  if (inet_pton(AF_INET6, server.c_str(), &si_server.sin6_addr) != 1) {
+    fprintf(stderr, "Invalid server address '%s'\n", opts.server);
+    return 1;
+  }
+
+  vector<int> socks;
+  vector<vector<CInFlight> > inflight(opts.nSockets, vector<CInFlight>(65536));
+  vector<uint16_t> nextId(opts.nSockets);
+  for (int i = 0; i < opts.nSockets; i++) {
+    int sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == -1 || connect(sock, (struct sockaddr*)&si_server, sizeof(si_server)) == -1) {
+      perror("socket");
+      return 1;
+    }
+    int bufsize = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    socks.push_back(sock);
+    nextId[i] = rand();
+  }
+
+  static unsigned char sendbuf[MAX_BATCH][512], recvbuf[MAX_BATCH][512];
+  struct mmsghdr sendmsgs[MAX_BATCH], recvmsgs[MAX_BATCH];
+  struct iovec sendiov[MAX_BATCH], recviov[MAX_BATCH];
+  memset(sendmsgs, 0, sizeof(sendmsgs));
+  memset(recvmsgs, 0, sizeof(recvmsgs));
+  for (int i = 0; i < MAX_BATCH; i++) {
+    sendiov[i].iov_base = sendbuf[i];
+    sendmsgs[i].msg_hdr.msg_iov = &sendiov[i];
+    sendmsgs[i].msg_hdr.msg_iovlen = 1;
+    recviov[i].iov_base = recvbuf[i];
+    recviov[i].iov_len = sizeof(recvbuf[i]);
+    recvmsgs[i].msg_hdr.msg_iov = &recviov[i];
+    recvmsgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  printf("Sending %i queries/s to %s port %i for %is\n", opts.nRate, opts.server, opts.nPort, opts.nDuration);
+  const int64_t nTimeout = (int64_t)opts.nTimeout * 1000000;
+  const int64_t nStart = GetTimeNanos();
+  const int64_t nEnd = nStart + (int64_t)opts.nDuration * 1000000000;
+  uint64_t nSent = 0, nReceived = 0, nUnmatched = 0, nSendFail = 0;
+  uint64_t nLastSent = 0, nLastReceived = 0;
+  int64_t nNextReport = nStart + 1000000000;
+  int nSock = 0;
+  while (1) {
+    int64_t now = GetTimeNanos();
+    if (now >= nEnd + nTimeout || (now >= nEnd && nReceived == nSent))
+      break;
+
+    // send whatever is due, in batches, rotating over the sockets
+    if (now < nEnd) {
+      uint64_t nDue = (uint64_t)((double)(now - nStart) * opts.nRate / 1e9) - nSent;
+      while (nDue > 0) {
+        int n = nDue < (uint64_t)opts.nBatch ? nDue : opts.nBatch;
+        vector<CInFlight> &slots = inflight[nSock];
+        for (int i = 0; i < n; i++) {
+          int r = rand() % nTotalWeight, t = 0;
+          while (r >= types[t]->weight) r -= types[t++]->weight;
+          const vector<unsigned char> &packet = types[t]->packet;
+          uint16_t id = nextId[nSock]++;
+          memcpy(sendbuf[i], &packet[0], packet.size());
+          sendbuf[i][0] = id >> 8;
+          sendbuf[i][1] = id & 0xFF;
+          sendiov[i].iov_len = packet.size();
+          slots[id].nSent = now;
+          slots[id].nType = t;
+          types[t]->nSent++;
+        }
+        int ret = sendmmsg(socks[nSock], sendmsgs, n, 0);
+        if (ret < n)
+          nSendFail += n - (ret < 0 ? 0 : ret);
+        nSent += n;
+        nDue -= n;
+        nSock = (nSock + 1) % opts.nSockets;
+      }
+    }
+
+    // wait for responses until the next query is due
+    int64_t nNextSend = nStart + (int64_t)((nSent + 1) * 1e9 / opts.nRate);
+    int nWait = now >= nEnd ? 10 : (nNextSend - now) / 1000000;
+    struct pollfd fds[MAX_SOCKETS];
+    for (int i = 0; i < opts.nSockets; i++) {
+      fds[i].fd = socks[i];
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(fds, opts.nSockets, nWait > 0 ? nWait : 0) > 0) {
+      for (int i = 0; i < opts.nSockets; i++) {
+        if (!(fds[i].revents & POLLIN))
+          continue;
+        int ret = recvmmsg(socks[i], recvmsgs, MAX_BATCH, MSG_DONTWAIT, NULL);
+        int64_t nRecv = GetTimeNanos();
+        for (int j = 0; j < ret; j++) {
+          if (recvmsgs[j].msg_len < 12) {
+            nUnmatched++;
+            continue;
+          }
+          uint16_t id = (recvbuf[j][0] << 8) | recvbuf[j][1];
+          CInFlight &slot = inflight[i][id];
+          if (slot.nSent == 0 || nRecv - slot.nSent > nTimeout) {
+            nUnmatched++;
+            continue;
+          }
+          CQueryType *t = types[slot.nType];
+          t->hist.Add(nRecv - slot.nSent);
+          t->nReceived++;
+          if ((recvbuf[j][3] & 0xF) != 0)
+            t->nErrors++;
+          slot.nSent = 0;
+          nReceived++;
+        }
+      }
+    }
+
+    now = GetTimeNanos();
+    if (now >= nNextReport && now < nEnd) {
+      printf("%3is: %llu sent, %llu received\n", (int)((now - nStart) / 1000000000), (unsigned long long)(nSent - nLastSent), (unsigned long long)(nReceived - nLastReceived));
+      fflush(stdout);
+      nLastSent = nSent;
+      nLastReceived = nReceived;
+      nNextReport += 1000000000;
+    }
+  }
+
+  double nSeconds = opts.nDuration;
+  printf("\n%llu queries sent (%.0f/s), %llu answered (%.0f/s), %.3f%% lost", (unsigned long long)nSent, nSent / nSeconds, (unsigned long long)nReceived, nReceived / nSeconds, nSent ? 100.0 * (nSent - nReceived) / nSent : 0.0);
+  if (nSendFail) printf(", %llu send failures", (unsigned long long)nSendFail);
+  if (nUnmatched) printf(", %llu late or unmatched responses", (unsigned long long)nUnmatched);
+  printf("\n\n%-16s %10s %10s %8s %8s %9s %9s %9s %9s\n", "query", "sent", "answered", "lost", "errors", "p50(us)", "p90(us)", "p99(us)", "p999(us)");
+  CHistogramSnapshot total;
+  uint64_t nErrors = 0;
+  for (size_t i = 0; i < types.size(); i++) {
+    CHistogramSnapshot snap;
+    snap.Add(types[i]->hist);
+    total.Add(types[i]->hist);
+    nErrors += types[i]->nErrors;
+    PrintLatency(types[i]->name.c_str(), types[i]->nSent, types[i]->nReceived, types[i]->nErrors, snap);
+  }
+  PrintLatency("total", nSent, nReceived, nErrors, total);
+  return 0;
+}
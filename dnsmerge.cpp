@@ -0,0 +1,432 @@
+// Merge the nodes seen by several seeders into one ranking, and a list of
+// fixed seeds for litecoind (contrib/seeds/nodes_main.txt format).
+//
+// Inputs are dnsseed.dump files in any --dumpformat, or dnsseed.dat files,
+// told apart by their contents. Text and JSON dumps are read a line at a
+// time; the others are read whole. Files are loaded in parallel.
+//
+// As in the old combine.pl, the 30 day uptimes of each seeder are scaled so
+// its best node has 100%, to even out seeders with worse connectivity, and
+// a node's score is 1-((1-a)(1-b)...)^(1/n) over its scaled uptimes a, b...
+// at the n seeders (0 where a seeder does not know the node).
+//
+// Usage: dnsmerge [-o <ranking>] [-s <seeds>] [-n <count>] file...
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "dump.h"
+
+using namespace std;
+
+bool fTestNet = false;
+
+class CDnsMergeOpts {
+public:
+  const char *ranking;
+  const char *seeds;
+  int nSeeds;
+  int nMinScore;
+  int nThreads;
+  vector<string> vFiles;
+
+  CDnsMergeOpts() : ranking(NULL), seeds(NULL), nSeeds(512), nMinScore(50), nThreads(0) {}
+
+  void ParseCommandLine(int argc, char **argv) {
+    static const char *help = "Merge the node lists of several seeders\n"
+                              "Usage: %s [-o <ranking>] [-s <seeds>] [-n <count>] file...\n"
+                              "\n"
+                              "Files are dnsseed.dump (text, json or binary) or dnsseed.dat files.\n"
+                              "\n"
+                              "Options:\n"
+                              "-o <file>       Write the merged ranking here (default: standard output)\n"
+                              "-s <file>       Write fixed seeds for litecoind here, one address per line\n"
+                              "-n <count>      Number of fixed seeds (default 512)\n"
+                              "-m <percent>    Minimum merged score of a fixed seed (default 50)\n"
+                              "-j <threads>    Files to load in parallel (default: number of CPUs)\n"
+                              "-?, --help      Show this text\n"
+                              "\n";
+    bool showHelp = false;
+
+    while(1) {
+      static struct option long_options[] = {
+        {"output", required_argument, 0, 'o'},
+        {"seeds", required_argument, 0, 's'},
+        {"count", required_argument, 0, 'n'},
+        {"minscore", required_argument, 0, 'm'},
+        {"threads", required_argument, 0, 'j'},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+      };
+      int option_index = 0;
+      int c = getopt_long(argc, argv, "o:s:n:m:j:", long_options, &option_index);
+      if (c == -1) break;
+      switch (c) {
+        case 'o': {
+          ranking = optarg;
+          break;
+        }
+        case 's': {
+          seeds = optarg;
+          break;
+        }
+        case 'n': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0) nSeeds = n;
+          break;
+        }
+        case 'm': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 100) nMinScore = n;
+          break;
+        }
+        case 'j': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0 && n < 1000) nThreads = n;
+          break;
+        }
+        case '?': {
+          showHelp = true;
+          break;
+        }
+      }
+    }
+    for (int i = optind; i < argc; i++)
+      vFiles.push_back(argv[i]);
+    if (vFiles.empty()) showHelp = true;
+    if (showHelp) {
+      fprintf(stderr, help, argv[0]);
+      exit(0);
+    }
+  }
+};
+
+// a node as seen by one seeder
+struct CMergeNode {
+  CService ip;
+  float uptime; // 30 day, scaled by the seeder's best
+  int file;
+  bool fGood;
+  int blocks;
+  int clientVersion;
+  uint64 services;
+
+  bool operator<(const CMergeNode &b) const {
+    return ip < b.ip;
+  }
+};
+
+class CMergeFile {
+public:
+  string name;
+  vector<CMergeNode> nodes;
+  string error;
+};
+
+// "1.2.3.4:9333", "[2001:db8::1]:9333" or "xxx.onion:9333"; avoids
+// getaddrinfo for the common numeric cases
+static bool ParseAddr(const char *str, size_t len, CService &addr) {
+  char host[128];
+  const char *colon = (const char*)memrchr(str, ':', len);
+  if (!colon) return false;
+  const char *begin = str, *end = colon;
+  if (begin < end && *begin == '[' && end[-1] == ']') {
+    begin++;
+    end--;
+  }
+  if (end - begin >= (int)sizeof(host)) return false;
+  memcpy(host, begin, end - begin);
+  host[end - begin] = 0;
+  char *endp;
+  long port = strtol(colon + 1, &endp, 10);
+  if (port <= 0 || port > 65535 || endp != str + len) return false;
+  struct in_addr a4;
+  struct in6_addr a6;
+  CNetAddr ip;
+  if (inet_pton(AF_INET, host, &a4) == 1) {
+    ip = CNetAddr(a4);
+  } else if (inet_pton(AF_INET6, host, &a6) == 1) {
+    ip = CNetAddr(a6);
+  } else if (!ip.SetSpecial(host)) {
+    return false;
+  }
+  addr = CService(ip, port);
+  return true;
+}
+
+static void AddReport(CMergeFile &file, const CAddrReport &rep) {
+  CMergeNode node;
+  node.ip = rep.ip;
+  node.uptime = rep.uptime[4];
+  node.fGood = rep.fGood;
+  node.blocks = rep.blocks;
+  node.clientVersion = rep.clientVersion;
+  node.services = rep.services;
+  file.nodes.push_back(node);
+}
+
+// a dnsseed.dump line; see AppendReport in dump.cpp
+static bool ParseTextLine(const char *line, CMergeNode &node) {
+  size_t len = strcspn(line, " \t\n");
+  if (!ParseAddr(line, len, node.ip)) return false;
+  int good;
+  long long lastSuccess;
+  unsigned long long services;
+  float up[5];
+  if (sscanf(line + len, " %d %lld %f%% %f%% %f%% %f%% %f%% %d %llx %d", &good, &lastSuccess, &up[0], &up[1], &up[2], &up[3], &up[4], &node.blocks, &services, &node.clientVersion) != 10)
+    return false;
+  node.fGood = good;
+  node.uptime = up[4] * 0.01;
+  node.services = services;
+  return true;
+}
+
+// a dnsseed.dump.json line; see AppendJsonReport in dump.cpp
+static bool ParseJsonLine(const char *line, CMergeNode &node) {
+  const char *p = strstr(line, "\"addr\":\"");
+  if (!p) return false;
+  p += 8;
+  const char *end = strchr(p, '"');
+  if (!end || !ParseAddr(p, end - p, node.ip)) return false;
+  float up[5];
+  unsigned long long services;
+  if (!(p = strstr(end, "\"good\":"))) return false;
+  node.fGood = strncmp(p + 7, "true", 4) == 0;
+  if (!(p = strstr(end, "\"uptime\":[")) || sscanf(p + 10, "%f,%f,%f,%f,%f", &up[0], &up[1], &up[2], &up[3], &up[4]) != 5) return false;
+  if (!(p = strstr(end, "\"blocks\":")) || sscanf(p + 9, "%d", &node.blocks) != 1) return false;
+  if (!(p = strstr(end, "\"services\":")) || sscanf(p + 11, "%llu", &services) != 1) return false;
+  if (!(p = strstr(end, "\"version\":")) || sscanf(p + 10, "%d", &node.clientVersion) != 1) return false;
+  node.uptime = up[4];
+  node.services = services;
+  return true;
+}
+
+static void LoadLines(FILE *f, CMergeFile &file, bool fJson) {
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#' || line[0] == '\n') continue;
+    CMergeNode node;
+    if (fJson ? ParseJsonLine(line, node) : ParseTextLine(line, node))
+      file.nodes.push_back(node);
+  }
+}
+
+static void LoadColumns(FILE *f, CMergeFile &file) {
+  CDumpColumns cols;
+  {
+    CAutoFile cf(f);
+    cf >> cols;
+  }
+  if (cols.nMagic != DUMP_BINARY_MAGIC || cols.nFormatVersion != DUMP_BINARY_VERSION) {
+    file.error = "unsupported binary dump version";
+    return;
+  }
+  size_t n = cols.addr.size();
+  if (cols.good.size() != n || cols.uptime[4].size() != n || cols.blocks.size() != n || cols.services.size() != n || cols.clientVersion.size() != n) {
+    file.error = "columns differ in length";
+    return;
+  }
+  file.nodes.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    CMergeNode &node = file.nodes[i];
+    node.ip = cols.addr[i];
+    node.uptime = cols.uptime[4][i];
+    node.fGood = cols.good[i];
+    node.blocks = cols.blocks[i];
+    node.clientVersion = cols.clientVersion[i];
+    node.services = cols.services[i];
+  }
+}
+
+static void LoadDat(FILE *f, CMergeFile &file) {
+  CAddrDb *db = new CAddrDb();
+  {
+    CAutoFile cf(f);
+    cf >> *db;
+  }
+  vector<CDumpKey> keys;
+  vector<CAddrReport> reports;
+  db->GetDumpKeys(keys);
+  if (!keys.empty())
+    db->GetReports(&keys[0], &keys[0] + keys.size(), reports);
+  delete db;
+  file.nodes.reserve(reports.size());
+  for (size_t i = 0; i < reports.size(); i++)
+    AddReport(file, reports[i]);
+}
+
+static void LoadFile(CMergeFile &file) {
+  FILE *f = fopen(file.name.c_str(), "r");
+  if (!f) {
+    file.error = strerror(errno);
+    return;
+  }
+  unsigned char head[4];
+  size_t n = fread(head, 1, sizeof(head), f);
+  rewind(f);
+  try {
+    if (n == 4 && (head[0] | head[1] << 8 | head[2] << 16 | (unsigned int)head[3] << 24) == DUMP_BINARY_MAGIC) {
+      LoadColumns(f, file); // closes f
+      f = NULL;
+    } else if (n > 0 && head[0] == '{') {
+      LoadLines(f, file, true);
+    } else if (n > 0 && (head[0] == '#' || isprint(head[0]))) {
+      LoadLines(f, file, false);
+    } else {
+      LoadDat(f, file); // closes f
+      f = NULL;
+    }
+  } catch (std::ios_base::failure &e) {
+    file.error = "truncated or not a dump/dnsseed.dat file";
+  }
+  if (f) fclose(f);
+  if (!file.error.empty()) return;
+  float best = 0;
+  for (size_t i = 0; i < file.nodes.size(); i++)
+    best = max(best, file.nodes[i].uptime);
+  for (size_t i = 0; i < file.nodes.size(); i++)
+    file.nodes[i].uptime = best > 0 ? file.nodes[i].uptime / best : 0;
+}
+
+static vector<CMergeFile> vFiles;
+static atomic<size_t> nNextFile(0);
+
+extern "C" void* ThreadLoad(void*) {
+  size_t i;
+  while ((i = nNextFile++) < vFiles.size())
+    LoadFile(vFiles[i]);
+  return nullptr;
+}
+
+struct CMergedNode {
+  CService ip;
+  double score;
+  int nSeen;
+  int nGood;
+  int blocks;
+  int clientVersion;
+  uint64 services;
+
+  bool operator<(const CMergedNode &b) const {
+    return score > b.score;
+  }
+};
+
+int main(int argc, char **argv) {
+  CDnsMergeOpts opts;
+  opts.ParseCommandLine(argc, argv);
+
+  vFiles.resize(opts.vFiles.size());
+  for (size_t i = 0; i < vFiles.size(); i++)
+    vFiles[i].name = opts.vFiles[i];
+  int nThreads = opts.nThreads;
+  if (!nThreads) {
+    long nProcs = sysconf(_SC_NPROCESSORS_ONLN);
+    nThreads = nProcs > 0 ? nProcs : 1;
+  }
+  nThreads = min(nThreads, (int)vFiles.size());
+  vector<pthread_t> threads(nThreads);
+  for (int i = 0; i < nThreads; i++)
+    pthread_create(&threads[i], NULL, ThreadLoad, NULL);
+  for (int i = 0; i < nThreads; i++)
+    pthread_join(threads[i], NULL);
+
+  // all sightings, grouped by address
+  vector<CMergeNode> all;
+  size_t nTotal = 0;
+  for (size_t i = 0; i < vFiles.size(); i++) {
+    if (!vFiles[i].error.empty()) {
+      fprintf(stderr, "%s: %s\n", vFiles[i].name.c_str(), vFiles[i].error.c_str());
+      return 1;
+    }
+    fprintf(stderr, "%s: %i nodes\n", vFiles[i].name.c_str(), (int)vFiles[i].nodes.size());
+    nTotal += vFiles[i].nodes.size();
+  }
+  all.reserve(nTotal);
+  for (size_t i = 0; i < vFiles.size(); i++) {
+    for (size_t j = 0; j < vFiles[i].nodes.size(); j++) {
+      all.push_back(vFiles[i].nodes[j]);
+      all.back().file = i;
+    }
+    vector<CMergeNode>().swap(vFiles[i].nodes);
+  }
+  sort(all.begin(), all.end());
+
+  vector<CMergedNode> merged;
+  double n = vFiles.size();
+  for (size_t i = 0; i < all.size(); ) {
+    size_t j = i;
+    double miss = 1;
+    CMergedNode node = {all[i].ip, 0, 0, 0, 0, 0, 0};
+    const CMergeNode *best = &all[i];
+    for (; j < all.size() && all[j].ip == all[i].ip; j++) {
+      miss *= 1 - all[j].uptime;
+      node.nSeen++;
+      node.nGood += all[j].fGood;
+      if (all[j].uptime > best->uptime) best = &all[j];
+    }
+    node.score = 1 - pow(miss, 1 / n);
+    node.blocks = best->blocks;
+    node.clientVersion = best->clientVersion;
+    node.services = best->services;
+    merged.push_back(node);
+    i = j;
+  }
+  vector<CMergeNode>().swap(all);
+  stable_sort(merged.begin(), merged.end());
+
+  FILE *out = opts.ranking ? fopen(opts.ranking, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "%s: %s\n", opts.ranking, strerror(errno));
+    return 1;
+  }
+  {
+    CBufferedWriter w(out);
+    w.Printf("# address                                          score  seen  good   blocks      svcs  version\n");
+    for (size_t i = 0; i < merged.size(); i++) {
+      const CMergedNode &node = merged[i];
+      w.Printf("%-47s  %6.2f%%  %4d  %4d  %7i  %08" PRIx64 "  %5i\n", node.ip.ToString().c_str(), 100.0 * node.score, node.nSeen, node.nGood, node.blocks, (uint64_t)node.services, node.clientVersion);
+    }
+    if (!w.Flush()) {
+      fprintf(stderr, "failed to write ranking\n");
+      return 1;
+    }
+  }
+  if (out != stdout) fclose(out);
+
+  if (opts.seeds) {
+    FILE *f = fopen(opts.seeds, "w");
+    if (!f) {
+      fprintf(stderr, "%s: %s\n", opts.seeds, strerror(errno));
+      return 1;
+    }
+    int nSeeds = 0;
+    for (size_t i = 0; i < merged.size() && nSeeds < opts.nSeeds; i++) {
+      const CMergedNode &node = merged[i];
+      if (node.score * 100 < opts.nMinScore) break;
+      if (!node.nGood || !(node.services & NODE_NETWORK) || node.clientVersion < REQUIRE_VERSION)
+        continue;
+      fprintf(f, "%s\n", node.ip.ToString().c_str());
+      nSeeds++;
+    }
+    fclose(f);
+    fprintf(stderr, "%i fixed seeds written to %s\n", nSeeds, opts.seeds);
+  }
+  fprintf(stderr, "%i nodes from %i files merged\n", (int)merged.size(), (int)vFiles.size());
+  return 0;
+}
@@ -0,0 +1,735 @@
+// DNS query replay: replays captured queries (a pcap file, or dnsseed's
+// binary query log) against dnshandle() in-process or against a running
+// dnsseed over UDP, at the original pace or as fast as possible, and
+// reports the throughput, the distribution of responses and, given the
+// responses of another run (e.g. of another build), those that differ.
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "dnsthread.h"
+#include "querylog.h"
+
+using namespace std;
+
+bool fTestNet = false;
+
+CAddrDb db;
+
+#define MAX_BATCH 64
+
+class CDnsReplayOpts {
+public:
+  const char *host;
+  const char *ns;
+  const char *mbox;
+  const char *server;
+  int nPort;
+  const char *dbfile;
+  const char *outfile;
+  const char *comparefile;
+  double dSpeed;
+  int nWindow;
+  int nTimeout;
+  long nLimit;
+  set<uint64_t> filter_whitelist;
+  const char *input;
+
+  CDnsReplayOpts() : host(NULL), ns(NULL), mbox(NULL), server(NULL), nPort(53), dbfile(NULL), outfile(NULL), comparefile(NULL), dSpeed(0), nWindow(64), nTimeout(1000), nLimit(0), input(NULL) {}
+
+  void ParseCommandLine(int argc, char **argv) {
+    static const char *help = "DNS query replay for dnsseed\n"
+                              "Usage: %s -h <host> [options] <capture.pcap | querylog>\n"
+                              "\n"
+                              "Replays the queries of a pcap capture (UDP to port 53) or of a binary query\n"
+                              "log (--querylog), in-process against dnshandle() or with -s against a\n"
+                              "running instance. Query log records are turned back into queries for\n"
+                              "<host> or x<flags>.<host> of their type.\n"
+                              "\n"
+                              "Options:\n"
+                              "-h <host>       Hostname of the DNS seed\n"
+                              "-s <address>    Replay against the server at this address instead of\n"
+                              "                in-process (queries then all come from one client)\n"
+                              "-p <port>       UDP port of the server (default 53)\n"
+                              "-f <file>       In-process: answer from this dnsseed.dat (default: no nodes)\n"
+                              "-n <ns>         In-process: nameserver (default ns.<host>)\n"
+                              "-m <mbox>       In-process: SOA e-mail address (default hostmaster.<host>)\n"
+                              "-w f1,f2,...    In-process: flag filters to allow (default: those queried)\n"
+                              "-x <speed>      Replay at speed times the original pace, e.g. 1 for the\n"
+                              "                original timing (default 0: as fast as possible)\n"
+                              "-W <n>          With -s, as fast as possible: queries in flight (default 64)\n"
+                              "-t <ms>         With -s: time after which a query is counted as lost\n"
+                              "                (default 1000)\n"
+                              "-l <count>      Replay only the first count queries\n"
+                              "-o <file>       Write a summary of every response to file\n"
+                              "-c <file>       Compare the responses with the summaries in file (from -o,\n"
+                              "                e.g. by another build) and report those that differ\n"
+                              "-?, --help      Show this text\n"
+                              "\n";
+    bool showHelp = false;
+
+    while(1) {
+      static struct option long_options[] = {
+        {"host", required_argument, 0, 'h'},
+        {"server", required_argument, 0, 's'},
+        {"port", required_argument, 0, 'p'},
+        {"db", required_argument, 0, 'f'},
+        {"ns", required_argument, 0, 'n'},
+        {"mbox", required_argument, 0, 'm'},
+        {"filter", required_argument, 0, 'w'},
+        {"speed", required_argument, 0, 'x'},
+        {"window", required_argument, 0, 'W'},
+        {"timeout", required_argument, 0, 't'},
+        {"limit", required_argument, 0, 'l'},
+        {"output", required_argument, 0, 'o'},
+        {"compare", required_argument, 0, 'c'},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+      };
+      int option_index = 0;
+      int c = getopt_long(argc, argv, "h:s:p:f:n:m:w:x:W:t:l:o:c:", long_options, &option_index);
+      if (c == -1) break;
+      switch (c) {
+        case 'h': host = optarg; break;
+        case 's': server = optarg; break;
+        case 'f': dbfile = optarg; break;
+        case 'n': ns = optarg; break;
+        case 'm': mbox = optarg; break;
+        case 'o': outfile = optarg; break;
+        case 'c': comparefile = optarg; break;
+        case 'p': {
+          int p = strtol(optarg, NULL, 10);
+          if (p > 0 && p < 65536) nPort = p;
+          break;
+        }
+        case 'w': {
+          char* ptr = optarg;
+          while (*ptr != 0) {
+            unsigned long l = strtoul(ptr, &ptr, 0);
+            if (*ptr == ',') {
+                ptr++;
+            } else if (*ptr != 0) {
+                break;
+            }
+            filter_whitelist.insert(l);
+          }
+          break;
+        }
+        case 'x': {
+          double d = strtod(optarg, NULL);
+          if (d >= 0) dSpeed = d;
+          break;
+        }
+        case 'W': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0 && n < 65536) nWindow = n;
+          break;
+        }
+        case 't': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0) nTimeout = n;
+          break;
+        }
+        case 'l': {
+          long n = strtol(optarg, NULL, 10);
+          if (n > 0) nLimit = n;
+          break;
+        }
+        case '?': {
+          showHelp = true;
+          break;
+        }
+      }
+    }
+    if (optind < argc)
+      input = argv[optind];
+    if (host == NULL || input == NULL) {
+      fprintf(stderr, host ? "No input file given.\n" : "No host set. Please use -h.\n");
+      showHelp = true;
+    }
+    if (showHelp) {
+      fprintf(stderr, help, argv[0]);
+      exit(0);
+    }
+  }
+};
+
+struct CReplayQuery {
+  int64_t nTime; // ns, relative to the first query
+  struct in6_addr client;
+  vector<unsigned char> packet;
+};
+
+static bool CompareTime(const CReplayQuery &a, const CReplayQuery &b) {
+  return a.nTime < b.nTime;
+}
+
+// What is compared between runs: rcode, TC, section counts and the types
+// of the answers (the addresses are random).
+struct CResponse {
+  bool fAnswered;
+  int rcode, tc, an, ns, ar, nA, nAAAA;
+  int size;
+
+  CResponse() : fAnswered(false), rcode(0), tc(0), an(0), ns(0), ar(0), nA(0), nAAAA(0), size(0) {}
+
+  bool operator==(const CResponse &o) const {
+    return fAnswered == o.fAnswered && rcode == o.rcode && tc == o.tc && an == o.an && ns == o.ns && ar == o.ar && nA == o.nA && nAAAA == o.nAAAA;
+  }
+  bool operator!=(const CResponse &o) const { return !(*this == o); }
+
+  string ToString() const {
+    if (!fAnswered) return "-";
+    return strprintf("%i %i %i %i %i %i %i", rcode, tc, an, ns, ar, nA, nAAAA);
+  }
+  bool FromString(const char *str) {
+    *this = CResponse();
+    if (str[0] == '-') return true;
+    fAnswered = sscanf(str, "%i %i %i %i %i %i %i", &rcode, &tc, &an, &ns, &ar, &nA, &nAAAA) == 7;
+    return fAnswered;
+  }
+};
+
+// pos: past a name at pos in buf, if it fits
+static bool SkipName(const unsigned char *buf, int len, int &pos) {
+  while (pos < len) {
+    int octet = buf[pos];
+    if (octet == 0) { pos++; return true; }
+    if ((octet & 0xC0) == 0xC0) { pos += 2; return pos <= len; }
+    if (octet > 63) return false;
+    pos += octet + 1;
+  }
+  return false;
+}
+
+static void Summarize(const unsigned char *buf, int len, CResponse &resp) {
+  resp = CResponse();
+  resp.fAnswered = true;
+  resp.size = len;
+  resp.rcode = buf[3] & 15;
+  resp.tc = (buf[2] >> 1) & 1;
+  resp.an = (buf[6] << 8) | buf[7];
+  resp.ns = (buf[8] << 8) | buf[9];
+  resp.ar = (buf[10] << 8) | buf[11];
+  int pos = 12;
+  if (buf[4] != 0 || buf[5] != 1 || !SkipName(buf, len, pos))
+    return;
+  pos += 4;
+  for (int i = 0; i < resp.an; i++) {
+    if (!SkipName(buf, len, pos) || pos + 10 > len)
+      break;
+    int typ = (buf[pos] << 8) | buf[pos + 1];
+    pos += 10 + ((buf[pos + 8] << 8) | buf[pos + 9]);
+    if (typ == TYPE_A) resp.nA++;
+    if (typ == TYPE_AAAA) resp.nAAAA++;
+  }
+}
+
+// queries and latencies by query type
+enum { GROUP_A, GROUP_AAAA, GROUP_ANY, GROUP_NS, GROUP_SOA, GROUP_OTHER, GROUP_MALFORMED, GROUP_MAX };
+static const char *strGroup[GROUP_MAX] = {"A", "AAAA", "ANY", "NS", "SOA", "other", "malformed"};
+
+static int GetGroup(const vector<unsigned char> &packet) {
+  int pos = 12;
+  if (packet.size() < 12 || !SkipName(&packet[0], packet.size(), pos) || pos + 2 > packet.size())
+    return GROUP_MALFORMED;
+  switch ((packet[pos] << 8) | packet[pos + 1]) {
+    case TYPE_A: return GROUP_A;
+    case TYPE_AAAA: return GROUP_AAAA;
+    case QTYPE_ANY: return GROUP_ANY;
+    case TYPE_NS: return GROUP_NS;
+    case TYPE_SOA: return GROUP_SOA;
+  }
+  return GROUP_OTHER;
+}
+
+static string DescribeQuery(const vector<unsigned char> &packet) {
+  const unsigned char *inpos = &packet[0] + 12;
+  char name[256];
+  if (packet.size() < 12 || parse_name(&inpos, &packet[0] + packet.size(), &packet[0], name, sizeof(name)) != 0)
+    return "(malformed)";
+  return strprintf("%s %s", strGroup[GetGroup(packet)], name);
+}
+
+static uint32_t ReadU32(const unsigned char *p, bool fSwap) {
+  uint32_t n;
+  memcpy(&n, p, 4);
+  return fSwap ? __builtin_bswap32(n) : n;
+}
+
+// the UDP payload to port 53 of a captured IP packet, if it is a query
+static bool ParsePacket(const unsigned char *p, int len, int64_t nTime, vector<CReplayQuery> &vQuery) {
+  struct in6_addr client;
+  int proto, hdr;
+  if (len >= 20 && (p[0] >> 4) == 4) {
+    hdr = (p[0] & 15) * 4;
+    if ((((p[6] << 8) | p[7]) & 0x3FFF) != 0) // fragment
+      return false;
+    proto = p[9];
+    memset(&client, 0, sizeof(client));
+    client.s6_addr[10] = client.s6_addr[11] = 0xFF;
+    memcpy(client.s6_addr + 12, p + 12, 4);
+  } else if (len >= 40 && (p[0] >> 4) == 6) {
+    hdr = 40;
+    proto = p[6];
+    memcpy(client.s6_addr, p + 8, 16);
+  } else {
+    return false;
+  }
+  if (proto != 17 || len < hdr + 8)
+    return false;
+  p += hdr;
+  len -= hdr;
+  int udplen = (p[4] << 8) | p[5];
+  if (((p[2] << 8) | p[3]) != 53 || udplen < 8 + 12)
+    return false;
+  if (udplen < len)
+    len = udplen;
+  if (len < 8 + 12 || (p[8 + 2] & 0x80)) // response
+    return false;
+  CReplayQuery q;
+  q.nTime = nTime;
+  q.client = client;
+  q.packet.assign(p + 8, p + len);
+  vQuery.push_back(q);
+  return true;
+}
+
+static bool LoadPcap(FILE *f, const unsigned char *global, vector<CReplayQuery> &vQuery, string &strError) {
+  uint32_t magic;
+  memcpy(&magic, global, 4);
+  bool fSwap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+  bool fNanos = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+  uint32_t linktype = ReadU32(global + 20, fSwap) & 0xFFFF;
+  if (linktype != 0 && linktype != 1 && linktype != 101 && linktype != 113 && linktype != 276) {
+    strError = strprintf("unsupported link type %u", linktype);
+    return false;
+  }
+  vector<unsigned char> buf;
+  unsigned char rec[16];
+  while (fread(rec, 1, 16, f) == 16) {
+    int64_t nTime = (int64_t)ReadU32(rec, fSwap) * 1000000000 + (int64_t)ReadU32(rec + 4, fSwap) * (fNanos ? 1 : 1000);
+    uint32_t caplen = ReadU32(rec + 8, fSwap);
+    if (caplen > 262144) {
+      strError = "corrupt packet record";
+      return false;
+    }
+    buf.resize(caplen);
+    if (caplen && fread(&buf[0], 1, caplen, f) != caplen)
+      break;
+    const unsigned char *p = caplen ? &buf[0] : NULL;
+    int len = caplen, off;
+    switch (linktype) {
+      case 0: off = 4; break; // BSD loopback: address family
+      case 1: {               // Ethernet, possibly with VLAN tags
+        off = 14;
+        while (len >= off + 4 && p[off - 2] == 0x81 && p[off - 1] == 0x00)
+          off += 4;
+        break;
+      }
+      case 101: off = 0; break;
+      case 113: off = 16; break; // Linux cooked
+      default: off = 20; break;  // Linux cooked v2
+    }
+    if (len > off)
+      ParsePacket(p + off, len - off, nTime, vQuery);
+  }
+  return true;
+}
+
+static bool LoadQueryLog(FILE *f, const unsigned char *header, const char *host, vector<CReplayQuery> &vQuery, string &strError) {
+  CQueryLogHeader hdr;
+  memcpy(&hdr, header, sizeof(hdr));
+  if (hdr.nVersion != QLOG_VERSION || hdr.nRecordSize != sizeof(dns_qrec_t)) {
+    strError = strprintf("unsupported query log version %u", hdr.nVersion);
+    return false;
+  }
+  dns_qrec_t rec;
+  while (fread(&rec, sizeof(rec), 1, f) == 1) {
+    if (rec.qtype == 0) // no valid question, nothing to replay
+      continue;
+    CReplayQuery q;
+    q.nTime = rec.time * 1000;
+    memset(&q.client, 0, sizeof(q.client));
+    if (rec.family == 4) {
+      q.client.s6_addr[10] = q.client.s6_addr[11] = 0xFF;
+      memcpy(q.client.s6_addr + 12, rec.prefix, 3);
+    } else {
+      memcpy(q.client.s6_addr, rec.prefix, 7);
+    }
+    string name = rec.flags ? strprintf("x%" PRIx64 ".%s", rec.flags, host) : string(host);
+    unsigned char buf[512];
+    int len = write_query(buf, sizeof(buf), 0, name.c_str(), rec.qtype, CLASS_IN);
+    if (len < 0) {
+      strError = strprintf("invalid query name %s", name.c_str());
+      return false;
+    }
+    q.packet.assign(buf, buf + len);
+    vQuery.push_back(q);
+  }
+  return true;
+}
+
+static bool LoadInput(const char *path, const char *host, vector<CReplayQuery> &vQuery, string &strError) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    strError = strprintf("cannot open %s", path);
+    return false;
+  }
+  unsigned char header[24];
+  bool fOk = false;
+  if (fread(header, 1, 16, f) != 16) {
+    strError = "file too short";
+  } else {
+    uint32_t magic;
+    memcpy(&magic, header, 4);
+    if (magic == QLOG_MAGIC) {
+      fOk = LoadQueryLog(f, header, host, vQuery, strError);
+    } else if (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1) {
+      if (fread(header + 16, 1, 8, f) != 8)
+        strError = "file too short";
+      else
+        fOk = LoadPcap(f, header, vQuery, strError);
+    } else {
+      strError = "not a pcap file (pcapng is not supported) or query log";
+    }
+  }
+  fclose(f);
+  if (!fOk)
+    return false;
+  // query logs interleave the DNS threads
+  stable_sort(vQuery.begin(), vQuery.end(), CompareTime);
+  for (int64_t i = vQuery.size() - 1; i >= 0; i--)
+    vQuery[i].nTime -= vQuery[0].nTime;
+  return true;
+}
+
+// the service flags that the queries ask for, as the default filters
+static void GetQueriedFlags(const char *host, const vector<CReplayQuery> &vQuery, set<uint64_t> &flags) {
+  dns_opt_t *zone = new dns_opt_t();
+  zone->host = host;
+  dns_set_zone(zone);
+  for (size_t i = 0; i < vQuery.size(); i++) {
+    const vector<unsigned char> &packet = vQuery[i].packet;
+    const unsigned char *inpos = &packet[0] + 12, *label;
+    int labellen;
+    if (match_zone(zone, &inpos, &packet[0] + packet.size(), &label, &labellen) != 1 || !label || labellen < 2 || labellen > 17 || label[0] != 'x')
+      continue;
+    uint64_t n = 0;
+    int j = 1;
+    for (; j < labellen; j++) {
+      char c = label[j] | 0x20;
+      if (c >= '0' && c <= '9') n = (n << 4) | (c - '0');
+      else if (c >= 'a' && c <= 'f') n = (n << 4) | (c - 'a' + 10);
+      else break;
+    }
+    if (j == labellen && n)
+      flags.insert(n);
+  }
+  delete zone;
+}
+
+static void WaitUntil(int64_t t) {
+  int64_t now = GetTimeNanos();
+  if (t > now) {
+    struct timespec ts = {(time_t)((t - now) / 1000000000), (long)((t - now) % 1000000000)};
+    nanosleep(&ts, NULL);
+  }
+}
+
+static void ReplayInProcess(const CDnsReplayOpts &opts, const vector<CReplayQuery> &vQuery, vector<CResponse> &vResp, CLatencyHistogram *hist) {
+  set<uint64_t> whitelist = opts.filter_whitelist;
+  if (whitelist.empty())
+    GetQueriedFlags(opts.host, vQuery, whitelist);
+  string ns = opts.ns ? opts.ns : strprintf("ns.%s", opts.host);
+  string mbox = opts.mbox ? opts.mbox : strprintf("hostmaster.%s", opts.host);
+  CDnsThread *thread = new CDnsThread(opts.host, ns.c_str(), mbox.c_str(), "::", opts.nPort, whitelist, 0);
+  unsigned char outbuf[512];
+  int64_t nStart = GetTimeNanos();
+  for (size_t i = 0; i < vQuery.size(); i++) {
+    const CReplayQuery &q = vQuery[i];
+    if (opts.dSpeed > 0)
+      WaitUntil(nStart + (int64_t)(q.nTime / opts.dSpeed));
+    thread->dns_opt.client = q.client;
+    int64_t t = GetTimeNanos();
+    ssize_t ret = dnshandle(&thread->dns_opt, &q.packet[0], q.packet.size(), outbuf);
+    hist[GetGroup(q.packet)].Add(GetTimeNanos() - t);
+    if (ret >= 12)
+      Summarize(outbuf, ret, vResp[i]);
+  }
+}
+
+// what is in flight, indexed by query id
+struct CInFlight {
+  int64_t nSent; // 0 if free
+  size_t nQuery;
+};
+
+static bool ReplayNetwork(const CDnsReplayOpts &opts, const vector<CReplayQuery> &vQuery, vector<CResponse> &vResp, CLatencyHistogram *hist) {
+  struct sockaddr_in6 si_server;
+  memset(&si_server, 0, sizeof(si_server));
+  si_server.sin6_family = AF_INET6;
+  si_server.sin6_port = htons(opts.nPort);
+  string server(opts.server);
+  if (server.find(':') == string::npos)
+    server = "::ffff:" + server;
+  if (inet_pton(AF_INET6, server.c_str(), &si_server.sin6_addr) != 1) {
+    fprintf(stderr, "Invalid server address '%s'\n", opts.server);
+    return false;
+  }
+  int sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock == -1 || connect(sock, (struct sockaddr*)&si_server, sizeof(si_server)) == -1) {
+    perror("socket");
+    return false;
+  }
+  int bufsize = 4 << 20;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+  static unsigned char sendbuf[MAX_BATCH][512], recvbuf[MAX_BATCH][512];
+  struct mmsghdr sendmsgs[MAX_BATCH], recvmsgs[MAX_BATCH];
+  struct iovec sendiov[MAX_BATCH], recviov[MAX_BATCH];
+  memset(sendmsgs, 0, sizeof(sendmsgs));
+  memset(recvmsgs, 0, sizeof(recvmsgs));
+  for (int i = 0; i < MAX_BATCH; i++) {
+    sendiov[i].iov_base = sendbuf[i];
+    sendmsgs[i].msg_hdr.msg_iov = &sendiov[i];
+    sendmsgs[i].msg_hdr.msg_iovlen = 1;
+    recviov[i].iov_base = recvbuf[i];
+    recviov[i].iov_len = sizeof(recvbuf[i]);
+    recvmsgs[i].msg_hdr.msg_iov = &recviov[i];
+    recvmsgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  vector<CInFlight> slots(65536);
+  vector<int64_t> vSent(vQuery.size(), 0);
+  vector<bool> vDone(vQuery.size(), false);
+  const int64_t nTimeout = (int64_t)opts.nTimeout * 1000000;
+  const int64_t nStart = GetTimeNanos();
+  size_t nNext = 0, nOldest = 0, nDone = 0;
+  while (nDone < vQuery.size()) {
+    int64_t now = GetTimeNanos();
+
+    // send whatever is due, in batches; at full speed, up to the window
+    while (nNext < vQuery.size()) {
+      int n = 0;
+      while (n < MAX_BATCH && nNext < vQuery.size()) {
+        if (opts.dSpeed > 0 ? nStart + (int64_t)(vQuery[nNext].nTime / opts.dSpeed) > now : nNext - nDone >= opts.nWindow)
+          break;
+        const vector<unsigned char> &packet = vQuery[nNext].packet;
+        size_t len = min(packet.size(), sizeof(sendbuf[n]));
+        uint16_t id = nNext & 0xFFFF;
+        CInFlight &slot = slots[id];
+        if (slot.nSent && !vDone[slot.nQuery]) { // 65536 queries ago, and still in flight
+          vDone[slot.nQuery] = true;
+          nDone++;
+        }
+        memcpy(sendbuf[n], &packet[0], len);
+        sendbuf[n][0] = id >> 8;
+        sendbuf[n][1] = id & 0xFF;
+        sendiov[n].iov_len = len;
+        slot.nSent = now;
+        slot.nQuery = nNext;
+        vSent[nNext++] = now;
+        n++;
+      }
+      if (n == 0)
+        break;
+      sendmmsg(sock, sendmsgs, n, 0);
+    }
+
+    // expire what is lost
+    while (nOldest < nNext && (vDone[nOldest] || now - vSent[nOldest] > nTimeout)) {
+      if (!vDone[nOldest]) {
+        vDone[nOldest] = true;
+        nDone++;
+      }
+      nOldest++;
+    }
+
+    // wait for responses until the next query is due
+    int nWait = 10;
+    if (opts.dSpeed > 0 && nNext < vQuery.size()) {
+      int64_t nNextSend = nStart + (int64_t)(vQuery[nNext].nTime / opts.dSpeed);
+      nWait = nNextSend > now ? min((int64_t)10, (nNextSend - now) / 1000000) : 0;
+    } else if (nNext < vQuery.size() && nNext - nDone < opts.nWindow) {
+      nWait = 0;
+    }
+    struct pollfd fd = {sock, POLLIN, 0};
+    if (poll(&fd, 1, nWait) <= 0)
+      continue;
+    int ret = recvmmsg(sock, recvmsgs, MAX_BATCH, MSG_DONTWAIT, NULL);
+    int64_t nRecv = GetTimeNanos();
+    for (int j = 0; j < ret; j++) {
+      if (recvmsgs[j].msg_len < 12)
+        continue;
+      CInFlight &slot = slots[(recvbuf[j][0] << 8) | recvbuf[j][1]];
+      if (slot.nSent == 0 || vDone[slot.nQuery])
+        continue;
+      Summarize(recvbuf[j], recvmsgs[j].msg_len, vResp[slot.nQuery]);
+      hist[GetGroup(vQuery[slot.nQuery].packet)].Add(nRecv - slot.nSent);
+      vDone[slot.nQuery] = true;
+      nDone++;
+    }
+  }
+  close(sock);
+  return true;
+}
+
+static void PrintLatency(const char *name, uint64_t nCount, const CHistogramSnapshot &snap) {
+  printf("%-16s %10llu %9.1f %9.1f %9.1f %9.1f\n", name, (unsigned long long)nCount,
+         snap.GetPercentile(0.5) * 1e-3, snap.GetPercentile(0.9) * 1e-3, snap.GetPercentile(0.99) * 1e-3, snap.GetPercentile(0.999) * 1e-3);
+}
+
+static void PrintReport(const vector<CReplayQuery> &vQuery, const vector<CResponse> &vResp, const CLatencyHistogram *hist, bool fNetwork) {
+  static const char *strRcode[6] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+  uint64_t nRcode[7] = {}, nNone = 0, nEmpty = 0, nTruncated = 0, nAnswers = 0, nBytes = 0;
+  uint64_t nGroup[GROUP_MAX] = {};
+  for (size_t i = 0; i < vResp.size(); i++) {
+    const CResponse &r = vResp[i];
+    nGroup[GetGroup(vQuery[i].packet)]++;
+    if (!r.fAnswered) {
+      nNone++;
+      continue;
+    }
+    nRcode[r.rcode < 6 ? r.rcode : 6]++;
+    if (r.rcode == 0 && r.an == 0) nEmpty++;
+    if (r.tc) nTruncated++;
+    nAnswers += r.an;
+    nBytes += r.size;
+  }
+  uint64_t nAnswered = vResp.size() - nNone;
+  printf("\n%-16s %10s %8s\n", "response", "count", "share");
+  for (int i = 0; i < 7; i++)
+    if (nRcode[i])
+      printf("%-16s %10llu %7.3f%%\n", i < 6 ? strRcode[i] : "other", (unsigned long long)nRcode[i], 100.0 * nRcode[i] / vResp.size());
+  printf("%-16s %10llu %7.3f%%\n", "  (empty)", (unsigned long long)nEmpty, 100.0 * nEmpty / vResp.size());
+  printf("%-16s %10llu %7.3f%%\n", "  (truncated)", (unsigned long long)nTruncated, 100.0 * nTruncated / vResp.size());
+  printf("%-16s %10llu %7.3f%%\n", fNetwork ? "lost" : "ignored", (unsigned long long)nNone, 100.0 * nNone / vResp.size());
+  if (nAnswered)
+    printf("%.2f answers and %.1f bytes per response\n", (double)nAnswers / nAnswered, (double)nBytes / nAnswered);
+
+  printf("\n%-16s %10s %9s %9s %9s %9s   (%s)\n", "query", "count", "p50(us)", "p90(us)", "p99(us)", "p999(us)", fNetwork ? "round trip" : "dnshandle");
+  CHistogramSnapshot total;
+  for (int g = 0; g < GROUP_MAX; g++) {
+    if (!nGroup[g])
+      continue;
+    CHistogramSnapshot snap;
+    snap.Add(hist[g]);
+    total.Add(hist[g]);
+    PrintLatency(strGroup[g], nGroup[g], snap);
+  }
+  PrintLatency("total", vResp.size(), total);
+}
+
+static bool WriteSummaries(const char *path, const vector<CResponse> &vResp) {
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+  for (size_t i = 0; i < vResp.size(); i++)
+    fprintf(f, "%s\n", vResp[i].ToString().c_str());
+  return fclose(f) == 0;
+}
+
+static bool CompareSummaries(const char *path, const vector<CReplayQuery> &vQuery, const vector<CResponse> &vResp) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return false;
+  char line[256];
+  size_t n = 0;
+  uint64_t nDiffer = 0, nOnlyOne = 0;
+  while (n < vResp.size() && fgets(line, sizeof(line), f)) {
+    CResponse other;
+    other.FromString(line);
+    const CResponse &r = vResp[n];
+    if (r != other) {
+      if (r.fAnswered != other.fAnswered) {
+        nOnlyOne++;
+      } else if (nDiffer++ < 10) {
+        printf("  #%llu %s: %s here, %s in %s\n", (unsigned long long)n, DescribeQuery(vQuery[n].packet).c_str(), r.ToString().c_str(), other.ToString().c_str(), path);
+      }
+    }
+    n++;
+  }
+  fclose(f);
+  printf("\nCompared %llu responses with %s (rcode tc an ns ar A AAAA): %llu differ", (unsigned long long)n, path, (unsigned long long)nDiffer);
+  if (nOnlyOne) printf(", %llu answered in only one run", (unsigned long long)nOnlyOne);
+  if (n < vResp.size()) printf(", %llu not in %s", (unsigned long long)(vResp.size() - n), path);
+  printf("\n");
+  return true;
+}
+
+int main(int argc, char **argv) {
+  CDnsReplayOpts opts;
+  opts.ParseCommandLine(argc, argv);
+  vector<CReplayQuery> vQuery;
+  string strError;
+  if (!LoadInput(opts.input, opts.host, vQuery, strError)) {
+    fprintf(stderr, "Unable to load %s: %s\n", opts.input, strError.c_str());
+    return 1;
+  }
+  if (opts.nLimit && vQuery.size() > opts.nLimit)
+    vQuery.resize(opts.nLimit);
+  if (vQuery.empty()) {
+    fprintf(stderr, "No queries in %s\n", opts.input);
+    return 1;
+  }
+  if (!opts.server && opts.dbfile) {
+    FILE *f = fopen(opts.dbfile, "r");
+    if (!f) {
+      fprintf(stderr, "Unable to open %s\n", opts.dbfile);
+      return 1;
+    }
+    CAutoFile cf(f);
+    cf >> db;
+  }
+  CAddrDbStats stats;
+  db.GetStats(stats);
+  double dDuration = vQuery.back().nTime * 1e-9;
+  if (opts.server)
+    printf("Replaying %llu queries (%.1fs of traffic) to %s port %i", (unsigned long long)vQuery.size(), dDuration, opts.server, opts.nPort);
+  else
+    printf("Replaying %llu queries (%.1fs of traffic) in-process with %i good nodes", (unsigned long long)vQuery.size(), dDuration, stats.nGood);
+  if (opts.dSpeed > 0)
+    printf(" at %gx the original pace\n", opts.dSpeed);
+  else
+    printf(" as fast as possible\n");
+
+  vector<CResponse> vResp(vQuery.size());
+  CLatencyHistogram *hist = new CLatencyHistogram[GROUP_MAX];
+  int64_t nStart = GetTimeNanos();
+  if (opts.server) {
+    if (!ReplayNetwork(opts, vQuery, vResp, hist))
+      return 1;
+  } else {
+    ReplayInProcess(opts, vQuery, vResp, hist);
+  }
+  double dElapsed = (GetTimeNanos() - nStart) * 1e-9;
+  printf("\n%llu queries in %.3fs (%.0f/s)\n", (unsigned long long)vQuery.size(), dElapsed, vQuery.size() / dElapsed);
+  PrintReport(vQuery, vResp, hist, opts.server != NULL);
+
+  if (opts.outfile && !WriteSummaries(opts.outfile, vResp)) {
+    fprintf(stderr, "Unable to write %s\n", opts.outfile);
+    return 1;
+  }
+  if (opts.comparefile && !CompareSummaries(opts.comparefile, vQuery, vResp)) {
+    fprintf(stderr, "Unable to read %s\n", opts.comparefile);
+    return 1;
+  }
+  return 0;
+}
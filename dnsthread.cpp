@@ -0,0 +1,390 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+
+#include "dnsthread.h"
+
+using namespace std;
+
+CDnsThread::CDnsThread(const char *host, const char *ns, const char *mbox, const char *addr, int port, const set<uint64_t> &filterWhitelistIn, int idIn) : id(idIn) {
+  vFlags.push_back(0);
+  for (set<uint64_t>::const_iterator it = filterWhitelistIn.begin(); it != filterWhitelistIn.end(); it++)
+    if (*it) vFlags.push_back(*it);
+  perflag.resize(vFlags.size());
+  dns_opt.host = host;
+  dns_set_zone(&dns_opt);
+  dns_opt.ns = ns;
+  dns_opt.mbox = mbox;
+  dns_opt.datattl = 3600;
+  dns_opt.nsttl = 40000;
+  dns_opt.cb = GetIPList;
+  dns_opt.addr = addr;
+  dns_opt.port = port;
+  dns_opt.rrl = NULL;
+  dns_opt.qlog = NULL;
+  dns_opt.nLimited = 0;
+  dns_opt.client = in6addr_any;
+  asnMap = NULL;
+  nAsnCap = 2;
+  nRand = ((uint64_t)rand() << 32) ^ rand() ^ ((uint64_t)idIn << 16) ^ time(NULL);
+  if (!nRand) nRand = 1;
+}
+
+void CAliasTable::Build(const vector<float> &vWeight) {
+  int n = vWeight.size();
+  vProb.assign(n, 0);
+  vAlias.assign(n, 0);
+  double nTotal = 0;
+  for (int i = 0; i < n; i++)
+    nTotal += vWeight[i];
+  if (n == 0 || nTotal <= 0) {
+    for (int i = 0; i < n; i++) {
+      vProb[i] = 1ULL << 32;
+      vAlias[i] = i;
+    }
+    return;
+  }
+  // scaled so that the average column is 1; pair each column below 1 with
+  // one above, which gives its excess to fill it up
+  vector<double> vScaled(n);
+  vector<int> vSmall, vLarge;
+  for (int i = 0; i < n; i++) {
+    vScaled[i] = vWeight[i] * n / nTotal;
+    (vScaled[i] < 1.0 ? vSmall : vLarge).push_back(i);
+  }
+  while (!vSmall.empty() && !vLarge.empty()) {
+    int s = vSmall.back(), l = vLarge.back();
+    vSmall.pop_back();
+    vProb[s] = (uint64_t)(vScaled[s] * 4294967296.0);
+    vAlias[s] = l;
+    vScaled[l] -= 1.0 - vScaled[s];
+    if (vScaled[l] < 1.0) {
+      vLarge.pop_back();
+      vSmall.push_back(l);
+    }
+  }
+  // what is left is 1 up to rounding
+  for (size_t i = 0; i < vSmall.size(); i++) {
+    vProb[vSmall[i]] = 1ULL << 32;
+    vAlias[vSmall[i]] = vSmall[i];
+  }
+  for (size_t i = 0; i < vLarge.size(); i++) {
+    vProb[vLarge[i]] = 1ULL << 32;
+    vAlias[vLarge[i]] = vLarge[i];
+  }
+}
+
+static CNetAddr ToNetAddr(const addr_t &a) {
+  if (a.v == 4) {
+    struct in_addr addr;
+    memcpy(&addr, a.data.v4, 4);
+    return CNetAddr(addr);
+  }
+  struct in6_addr addr6;
+  memcpy(&addr6, a.data.v6, 16);
+  return CNetAddr(addr6);
+}
+
+static void ShuffleRing(vector<addr_t> &ring) {
+  for (int i = (int)ring.size() - 1; i > 0; i--)
+    swap(ring[i], ring[rand() % (i + 1)]);
+}
+
+static bool EarlierRound(const pair<int, int> &a, const pair<int, int> &b) {
+  return a.first < b.first;
+}
+
+// Shuffle ring into rounds in which every netgroup appears at most once, so
+// that the consecutive entries of an answer are from distinct netgroups
+// (as far as the sample has enough of them). groups[i] is the group of ring[i].
+static void SpreadRing(vector<addr_t> &ring, const vector<uint32_t> &groups) {
+  vector<pair<int, int> > order(ring.size()); // (round, index)
+  for (int i = 0; i < order.size(); i++)
+    order[i].second = i;
+  for (int i = (int)order.size() - 1; i > 0; i--)
+    swap(order[i], order[rand() % (i + 1)]);
+  map<uint32_t, int> mapCount;
+  for (int i = 0; i < order.size(); i++)
+    order[i].first = mapCount[groups[order[i].second]]++;
+  stable_sort(order.begin(), order.end(), EarlierRound);
+  vector<addr_t> spread(ring.size());
+  for (int i = 0; i < order.size(); i++)
+    spread[i] = ring[order[i].second];
+  ring.swap(spread);
+}
+
+// most addresses in the pool of a family
+static const unsigned int nPoolTarget[CDnsThread::RING_ANY] = {1000, 1000};
+
+void CDnsThread::RefreshPool(FlagSpecificData &thisflag, uint64_t requestedFlags, int r) {
+  bool nets[NET_MAX] = {};
+  nets[r == RING_IPV4 ? NET_IPV4 : NET_IPV6] = true;
+  bool fSpread = db.GetSelect() == SELECT_NETGROUP;
+  bool fWeighted = db.GetSelect() == SELECT_WEIGHTED;
+  vector<pair<CNetAddr, float> > ips;
+  if (fWeighted) {
+    db.GetWeightedIPs(ips, requestedFlags, nPoolTarget[r], nets);
+  } else {
+    set<CNetAddr> sample;
+    db.GetIPs(sample, requestedFlags, nPoolTarget[r], nets);
+    ips.reserve(sample.size());
+    for (set<CNetAddr>::iterator it = sample.begin(); it != sample.end(); it++)
+      ips.push_back(make_pair(*it, 1.0f));
+  }
+  ++dbQueries;
+  vector<addr_t> &ring = thisflag.ring[r];
+  vector<float> &weight = thisflag.weight[r];
+  vector<uint32_t> groups;
+  ring.clear();
+  weight.clear();
+  for (vector<pair<CNetAddr, float> >::iterator it = ips.begin(); it != ips.end(); it++) {
+    struct in_addr addr;
+    struct in6_addr addr6;
+    addr_t a;
+    memset(&a, 0, sizeof(a));
+    if (r == RING_IPV4 && it->first.GetInAddr(&addr)) {
+      a.v = 4;
+      memcpy(&a.data.v4, &addr, 4);
+    } else if (r == RING_IPV6 && !it->first.IsIPv4() && it->first.GetIn6Addr(&addr6)) {
+      a.v = 6;
+      memcpy(&a.data.v6, &addr6, 16);
+    } else {
+      continue;
+    }
+    ring.push_back(a);
+    if (fSpread)
+      groups.push_back(GetGroupHash(it->first));
+    if (fWeighted)
+      weight.push_back(it->second);
+  }
+  if (fWeighted)
+    thisflag.alias[r].Build(weight);
+  else
+    thisflag.alias[r].clear();
+  if (fSpread)
+    SpreadRing(ring, groups);
+  else if (!fWeighted)
+    ShuffleRing(ring);
+  thisflag.cursor[r] = 0;
+  IndexAsn(thisflag, r);
+}
+
+// The ring for both families: the two family rings interleaved in
+// proportion to their sizes, which keeps the order (and netgroup spread)
+// of each.
+void CDnsThread::MergeRings(FlagSpecificData &thisflag) {
+  const vector<addr_t> &ring4 = thisflag.ring[RING_IPV4], &ring6 = thisflag.ring[RING_IPV6];
+  const vector<float> &weight4 = thisflag.weight[RING_IPV4], &weight6 = thisflag.weight[RING_IPV6];
+  vector<addr_t> &ring = thisflag.ring[RING_ANY];
+  vector<float> &weight = thisflag.weight[RING_ANY];
+  bool fWeighted = !weight4.empty() || !weight6.empty();
+  size_t n4 = ring4.size(), n6 = ring6.size(), i4 = 0, i6 = 0;
+  ring.clear();
+  weight.clear();
+  ring.reserve(n4 + n6);
+  while (i4 < n4 || i6 < n6) {
+    // take the family whose next entry is due first, at (i + 1/2) / n
+    if (i6 == n6 || (i4 < n4 && (2 * i4 + 1) * n6 <= (2 * i6 + 1) * n4)) {
+      if (fWeighted) weight.push_back(weight4[i4]);
+      ring.push_back(ring4[i4++]);
+    } else {
+      if (fWeighted) weight.push_back(weight6[i6]);
+      ring.push_back(ring6[i6++]);
+    }
+  }
+  if (fWeighted)
+    thisflag.alias[RING_ANY].Build(weight);
+  else
+    thisflag.alias[RING_ANY].clear();
+  thisflag.cursor[RING_ANY] = 0;
+  IndexAsn(thisflag, RING_ANY);
+}
+
+void CDnsThread::IndexAsn(FlagSpecificData &thisflag, int r) {
+  thisflag.asn[r].clear();
+  thisflag.region[r].clear();
+  if (!asnMap)
+    return;
+  const vector<addr_t> &ring = thisflag.ring[r];
+  thisflag.asn[r].resize(ring.size());
+  for (unsigned int i = 0; i < ring.size(); i++) {
+    const CAsnEntry *entry = asnMap->Lookup(ToNetAddr(ring[i]));
+    thisflag.asn[r][i] = entry ? entry->asn : 0;
+    if (entry && entry->country)
+      thisflag.region[r][entry->country].idx.push_back(i);
+  }
+}
+
+CDnsThread::FlagSpecificData &CDnsThread::cacheHit(int nFlag, int r, bool force) {
+  time_t now = time(NULL);
+  FlagSpecificData& thisflag = perflag[nFlag];
+  bool fRefreshed = false;
+  for (int f = RING_IPV4; f < RING_ANY; f++) {
+    if (r != f && r != RING_ANY)
+      continue;
+    unsigned int &hits = thisflag.cacheHits[f];
+    unsigned int size = thisflag.ring[f].size();
+    hits++;
+    // a pool short of its target holds all the db has to offer, so more
+    // queries don't call for a refresh; only time does
+    bool fDue = size < nPoolTarget[f] ? now - thisflag.cacheTime[f] > 5 : hits * 400 > (size*size) || (hits*hits * 20 > size && (now - thisflag.cacheTime[f] > 5));
+    if (force || fDue) {
+      int64 start = GetTimeNanos();
+      RefreshPool(thisflag, vFlags[nFlag], f);
+      hits = 0;
+      thisflag.cacheTime[f] = now;
+      fRefreshed = true;
+      histRefresh.Add(GetTimeNanos() - start);
+    }
+  }
+  if (fRefreshed)
+    MergeRings(thisflag);
+  return thisflag;
+}
+
+// add entry i to the n chosen ones, unless it is there already or its AS
+// has nAsnCap entries
+static void AddCapped(unsigned int *chosen, int &n, const vector<uint32_t> &asn, int nAsnCap, unsigned int i) {
+  int nSame = 0;
+  for (int j = 0; j < n; j++) {
+    if (chosen[j] == i)
+      return;
+    nSame += asn[chosen[j]] == asn[i];
+  }
+  if (asn[i] && nSame >= nAsnCap)
+    return;
+  chosen[n++] = i;
+}
+
+// An answer of up to max entries of ring r (max <= ring size), with at
+// most nAsnCap entries per known AS: up to half of it from the client's
+// country, the rest as usual (from the alias table, or the ring).
+static int GetRegionalIPList(CDnsThread *thread, CDnsThread::FlagSpecificData &thisflag, int r, addr_t *addr, int max) {
+  const vector<addr_t> &ring = thisflag.ring[r];
+  const vector<uint32_t> &asn = thisflag.asn[r];
+  unsigned int size = ring.size();
+  unsigned int chosen[64];
+  if (max > 64)
+    max = 64;
+  int n = 0;
+  // the client is the subnet a resolver sent along, or else the resolver;
+  // an empty subnet asks for an answer that does not depend on the client
+  dns_opt_t &opt = thread->dns_opt;
+  const CAsnEntry *client = NULL;
+  if (!opt.ecsFamily) {
+    client = thread->asnMap->Lookup(CNetAddr(opt.client));
+  } else if (opt.ecsSource) {
+    int nBits;
+    client = thread->asnMap->Lookup(CNetAddr(opt.ecs), &nBits);
+    // the answer holds for the whole matched prefix, or if none matched,
+    // for the subnet; in the family's own prefix lengths
+    if (opt.ecsFamily == 1)
+      nBits = nBits > 96 ? nBits - 96 : 0;
+    opt.ecsScope = client && nBits < opt.ecsSource ? nBits : opt.ecsSource;
+  }
+  if (client && client->country) {
+    map<uint16_t, CDnsThread::RegionRing>::iterator it = thisflag.region[r].find(client->country);
+    if (it != thisflag.region[r].end()) {
+      CDnsThread::RegionRing &region = it->second;
+      unsigned int nRegion = region.idx.size();
+      int nWant = max > 1 ? max / 2 : 1;
+      for (unsigned int k = 0; k < nRegion && n < nWant; k++) {
+        AddCapped(chosen, n, asn, thread->nAsnCap, region.idx[region.cursor]);
+        region.cursor = (region.cursor + 1) % nRegion;
+      }
+      if (n)
+        ++thread->nRegional;
+    }
+  }
+  const CAliasTable &alias = thisflag.alias[r];
+  if (!alias.empty()) {
+    for (int tries = 0; n < max && tries < 2 * max + 8; tries++)
+      AddCapped(chosen, n, asn, thread->nAsnCap, alias.Sample(thread->Rand()));
+  } else {
+    unsigned int &cursor = thisflag.cursor[r];
+    for (unsigned int k = 0; k < size && n < max; k++) {
+      AddCapped(chosen, n, asn, thread->nAsnCap, cursor);
+      cursor = cursor + 1 == size ? 0 : cursor + 1;
+    }
+  }
+  for (int j = 0; j < n; j++)
+    addr[j] = ring[chosen[j]];
+  return n;
+}
+
+static inline int HexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+static int GetIPList_(CDnsThread *thread, const unsigned char *label, int labellen, addr_t* addr, int max, int ipv4, int ipv6) {
+  int nFlag = 0;
+  if (label) {
+    // x<hex flags> with at most 16 digits
+    if (labellen < 2 || labellen > 17 || label[0] != 'x' || label[1] == '0')
+      return 0;
+    uint64_t flags = 0;
+    for (int i = 1; i < labellen; i++) {
+      int d = HexDigit(label[i]);
+      if (d < 0)
+        return 0;
+      flags = (flags << 4) | d;
+    }
+    thread->dns_opt.qflags = flags;
+    nFlag = thread->FlagIndex(flags);
+    if (nFlag <= 0)
+      return 0;
+  }
+  if (!ipv4 && !ipv6)
+    return 0;
+  int r = ipv4 && ipv6 ? CDnsThread::RING_ANY : ipv4 ? CDnsThread::RING_IPV4 : CDnsThread::RING_IPV6;
+  CDnsThread::FlagSpecificData &thisflag = thread->cacheHit(nFlag, r);
+  const vector<addr_t> &ring = thisflag.ring[r];
+  unsigned int size = ring.size();
+  if (max > size)
+    max = size;
+  if (max <= 0)
+    return 0;
+  if (thread->asnMap)
+    return GetRegionalIPList(thread, thisflag, r, addr, max);
+  const CAliasTable &alias = thisflag.alias[r];
+  if (!alias.empty()) {
+    // max distinct entries by weight; a few collisions are retried, and
+    // entries that keep colliding are left out of this answer
+    unsigned int chosen[64];
+    if (max > 64)
+      max = 64;
+    int n = 0;
+    for (int tries = 0; n < max && tries < 2 * max + 8; tries++) {
+      uint32_t i = alias.Sample(thread->Rand());
+      int j = 0;
+      while (j < n && chosen[j] != i)
+        j++;
+      if (j == n) {
+        chosen[n] = i;
+        addr[n++] = ring[i];
+      }
+    }
+    return n;
+  }
+  // the next max entries, wrapping around
+  unsigned int &cursor = thisflag.cursor[r];
+  unsigned int n = min((unsigned int)max, size - cursor);
+  memcpy(addr, &ring[cursor], n * sizeof(addr_t));
+  memcpy(addr + n, &ring[0], (max - n) * sizeof(addr_t));
+  cursor = (cursor + max) % size;
+  return max;
+}
+
+extern "C" int GetIPList(void *data, const unsigned char *label, int labellen, addr_t* addr, int max, int ipv4, int ipv6) {
+  CDnsThread *thread = (CDnsThread*)data;
+  int64 start = GetTimeNanos();
+  int ret = GetIPList_(thread, label, labellen, addr, max, ipv4, ipv6);
+  thread->histGetIPList.Add(GetTimeNanos() - start);
+  return ret;
+}
+
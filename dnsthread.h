@@ -0,0 +1,115 @@
+#ifndef _DNSTHREAD_H_
+#define _DNSTHREAD_H_ 1
+
+#include <stdint.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "asnmap.h"
+#include "db.h"
+#include "dns.h"
+#include "metrics.h"
+
+extern CAddrDb db;
+
+extern "C" int GetIPList(void *thread, const unsigned char *label, int labellen, addr_t *addr, int max, int ipv4, int ipv6);
+
+// Walker's alias method: sampling an index with probability proportional
+// to its weight in O(1), from a table built in O(n).
+class CAliasTable {
+private:
+  std::vector<uint64_t> vProb; // chance (of 2^32) to keep column i rather than take its alias
+  std::vector<uint32_t> vAlias;
+
+public:
+  void Build(const std::vector<float> &vWeight);
+  void clear() { vProb.clear(); vAlias.clear(); }
+  bool empty() const { return vProb.empty(); }
+  // r: 64 random bits
+  uint32_t Sample(uint64_t r) const {
+    uint32_t i = ((r & 0xFFFFFFFF) * vProb.size()) >> 32;
+    return (r >> 32) < vProb[i] ? i : vAlias[i];
+  }
+};
+
+// A DNS server thread, answering from its own cache of good addresses
+// from db (one per requested service flags).
+class CDnsThread {
+public:
+  enum { RING_IPV4, RING_IPV6, RING_ANY, RING_MAX };
+
+  // Answers for one set of requested service flags: a pool of good
+  // addresses from db per address family, each refreshed on its own and
+  // shuffled into a ring, plus a ring merging both. A query takes the next
+  // entries of a ring, or with SELECT_WEIGHTED, entries drawn from the
+  // ring's alias table.
+  // With an AS map, the ring entries also have their AS, and each country
+  // a ring of its own (as indexes into the main ring).
+  struct RegionRing {
+      std::vector<unsigned int> idx;
+      unsigned int cursor;
+      RegionRing() : cursor(0) {}
+  };
+  struct FlagSpecificData {
+      std::vector<addr_t> ring[RING_MAX];
+      std::vector<float> weight[RING_MAX]; // of the ring entries, with SELECT_WEIGHTED
+      CAliasTable alias[RING_MAX];
+      std::vector<uint32_t> asn[RING_MAX];
+      std::map<uint16_t, RegionRing> region[RING_MAX];
+      unsigned int cursor[RING_MAX];
+      time_t cacheTime[RING_ANY]; // per family pool
+      unsigned int cacheHits[RING_ANY];
+      FlagSpecificData() : cursor(), cacheTime(), cacheHits() {}
+  };
+
+  dns_opt_t dns_opt; // must be first
+  const int id;
+  // the requested flags by a dense index: 0 for none (the bare host name),
+  // then the whitelisted combinations in ascending order; perflag[i] holds
+  // the answers for vFlags[i]
+  std::vector<uint64_t> vFlags;
+  std::vector<FlagSpecificData> perflag;
+  CStatCounter dbQueries;
+  CLatencyHistogram histGetIPList;
+  CLatencyHistogram histRefresh;
+  uint64_t nRand; // xorshift64 state, for SELECT_WEIGHTED
+  const CAsnMap *asnMap; // NULL, or to cap entries per AS and prefer the client's country
+  int nAsnCap; // most entries of one AS in an answer
+  CStatCounter nRegional; // answers with entries from the client's country
+
+  uint64_t Rand() {
+    nRand ^= nRand << 13;
+    nRand ^= nRand >> 7;
+    nRand ^= nRand << 17;
+    return nRand;
+  }
+
+  // index of flags in vFlags, or -1 if they are not whitelisted
+  int FlagIndex(uint64_t flags) const {
+    if (flags == 0) return 0;
+    std::vector<uint64_t>::const_iterator it = std::lower_bound(vFlags.begin() + 1, vFlags.end(), flags);
+    return it != vFlags.end() && *it == flags ? it - vFlags.begin() : -1;
+  }
+
+  // count a query for ring r (a family, or RING_ANY for both) of the flags
+  // with index nFlag, refreshing the pools it uses when they are due (or
+  // if force)
+  FlagSpecificData &cacheHit(int nFlag, int r, bool force = false);
+
+  CDnsThread(const char *host, const char *ns, const char *mbox, const char *addr, int port, const std::set<uint64_t> &filterWhitelistIn, int idIn);
+
+  void run() {
+    dnsserver(&dns_opt);
+  }
+
+private:
+  void RefreshPool(FlagSpecificData &thisflag, uint64_t requestedFlags, int r);
+  void MergeRings(FlagSpecificData &thisflag);
+  void IndexAsn(FlagSpecificData &thisflag, int r);
+};
+
+#endif
@@ -0,0 +1,219 @@
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "dump.h"
+
+using namespace std;
+
+#define DUMP_CHUNK 4096
+
+void CBufferedWriter::Printf(const char *format, ...) {
+  char tmp[1024];
+  va_list ap;
+  va_start(ap, format);
+  int len = vsnprintf(tmp, sizeof(tmp), format, ap);
+  va_end(ap);
+  if (len < 0)
+    return;
+  if (len < (int)sizeof(tmp)) {
+    Write(tmp, len);
+    return;
+  }
+  va_start(ap, format);
+  string str = vstrprintf(format, ap);
+  va_end(ap);
+  Write(str);
+}
+
+int ParseDumpFormats(const char *str) {
+  int nFormats = 0;
+  while (*str) {
+    size_t len = strcspn(str, ",");
+    string name(str, len);
+    if (name == "text") {
+      nFormats |= DUMP_TEXT;
+    } else if (name == "json") {
+      nFormats |= DUMP_JSON;
+    } else if (name == "binary") {
+      nFormats |= DUMP_BINARY;
+    } else {
+      return 0;
+    }
+    str += len;
+    if (*str == ',') str++;
+  }
+  return nFormats;
+}
+
+void CDumpColumns::Add(const CAddrReport &rep) {
+  addr.push_back(rep.ip);
+  good.push_back(rep.fGood);
+  lastSuccess.push_back(rep.lastSuccess);
+  for (int i = 0; i < 5; i++)
+    uptime[i].push_back(rep.uptime[i]);
+  blocks.push_back(rep.blocks);
+  services.push_back(rep.services);
+  clientVersion.push_back(rep.clientVersion);
+  map<int, int>::iterator it = mapSubver.find(rep.clientSubVersionId);
+  if (it == mapSubver.end()) {
+    it = mapSubver.insert(make_pair(rep.clientSubVersionId, (int)subverTable.size())).first;
+    subverTable.push_back(subVersionTable.Get(rep.clientSubVersionId));
+  }
+  subver.push_back(it->second);
+}
+
+struct CDumpChunk {
+  CAddrDb *db;
+  const CDumpKey *begin, *end;
+  bool fText, fJson;
+  vector<CAddrReport> reports;
+  string text, json;
+  double stat[STAT_MAX];
+};
+
+static void AppendReport(string &out, const CAddrReport &rep) {
+  char line[1024];
+  const string &subVer = subVersionTable.Get(rep.clientSubVersionId);
+  int len = snprintf(line, sizeof(line), "%-47s  %4d  %11" PRId64 "  %6.2f%% %6.2f%% %6.2f%% %6.2f%% %6.2f%%  %6i  %08" PRIx64 "  %5i \"%s\"\n", rep.ip.ToString().c_str(), (int)rep.fGood, rep.lastSuccess, 100.0*rep.uptime[0], 100.0*rep.uptime[1], 100.0*rep.uptime[2], 100.0*rep.uptime[3], 100.0*rep.uptime[4], rep.blocks, rep.services, rep.clientVersion, subVer.c_str());
+  if (len < 0)
+    return;
+  if (len < (int)sizeof(line)) {
+    out.append(line, len);
+  } else {
+    out += strprintf("%-47s  %4d  %11" PRId64 "  %6.2f%% %6.2f%% %6.2f%% %6.2f%% %6.2f%%  %6i  %08" PRIx64 "  %5i \"%s\"\n", rep.ip.ToString().c_str(), (int)rep.fGood, rep.lastSuccess, 100.0*rep.uptime[0], 100.0*rep.uptime[1], 100.0*rep.uptime[2], 100.0*rep.uptime[3], 100.0*rep.uptime[4], rep.blocks, rep.services, rep.clientVersion, subVer.c_str());
+  }
+}
+
+// length of the well-formed UTF-8 sequence at str[i] (RFC 3629: no overlong
+// forms, surrogates or code points above U+10FFFF), or 0 if there is none
+static int Utf8Length(const string &str, size_t i) {
+  unsigned char c = str[i];
+  int len;
+  unsigned char lo = 0x80, hi = 0xbf; // range of the second byte
+  if (c >= 0xc2 && c <= 0xdf) len = 2;
+  else if (c >= 0xe0 && c <= 0xef) {
+    len = 3;
+    if (c == 0xe0) lo = 0xa0;
+    if (c == 0xed) hi = 0x9f;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    len = 4;
+    if (c == 0xf0) lo = 0x90;
+    if (c == 0xf4) hi = 0x8f;
+  } else return 0;
+  if (i + len > str.size())
+    return 0;
+  unsigned char c1 = str[i + 1];
+  if (c1 < lo || c1 > hi)
+    return 0;
+  for (int k = 2; k < len; k++)
+    if (((unsigned char)str[i + k] & 0xc0) != 0x80)
+      return 0;
+  return len;
+}
+
+// subversions come from the network: well-formed UTF-8 passes through, while
+// control characters and stray bytes are escaped (the latter as Latin-1)
+static void AppendJsonString(string &out, const string &str) {
+  out += '"';
+  for (size_t i = 0; i < str.size(); i++) {
+    unsigned char c = str[i];
+    int len;
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c >= 0x80 && (len = Utf8Length(str, i))) {
+      out.append(str, i, len);
+      i += len - 1;
+    } else if (c < 0x20 || c >= 0x7f) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out += esc;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+static void AppendJsonReport(string &out, const CAddrReport &rep) {
+  char line[512];
+  out += "{\"addr\":\"";
+  out += rep.ip.ToString();
+  snprintf(line, sizeof(line), "\",\"good\":%s,\"lastSuccess\":%" PRId64 ",\"uptime\":[%.6f,%.6f,%.6f,%.6f,%.6f],\"blocks\":%i,\"services\":%" PRIu64 ",\"version\":%i,\"subver\":", rep.fGood ? "true" : "false", rep.lastSuccess, rep.uptime[0], rep.uptime[1], rep.uptime[2], rep.uptime[3], rep.uptime[4], rep.blocks, rep.services, rep.clientVersion);
+  out += line;
+  AppendJsonString(out, subVersionTable.Get(rep.clientSubVersionId));
+  out += "}\n";
+}
+
+extern "C" void* ThreadDumpChunk(void* arg) {
+  CDumpChunk *chunk = (CDumpChunk*)arg;
+  vector<CAddrReport> &reports = chunk->reports;
+  reports.clear();
+  reports.reserve(chunk->end - chunk->begin);
+  chunk->db->GetReports(chunk->begin, chunk->end, reports);
+  chunk->text.clear();
+  chunk->json.clear();
+  if (chunk->fText)
+    chunk->text.reserve(reports.size() * 160);
+  if (chunk->fJson)
+    chunk->json.reserve(reports.size() * 200);
+  for (int w = 0; w < STAT_MAX; w++)
+    chunk->stat[w] = 0;
+  for (vector<CAddrReport>::const_iterator it = reports.begin(); it != reports.end(); it++) {
+    if (chunk->fText)
+      AppendReport(chunk->text, *it);
+    if (chunk->fJson)
+      AppendJsonReport(chunk->json, *it);
+    for (int w = 0; w < STAT_MAX; w++)
+      chunk->stat[w] += it->uptime[w];
+  }
+  return nullptr;
+}
+
+void DumpNodes(CAddrDb &db, CBufferedWriter *text, CBufferedWriter *json, CDumpColumns *columns, int nThreads, double stat[STAT_MAX]) {
+  vector<CDumpKey> keys;
+  db.GetDumpKeys(keys);
+  sort(keys.begin(), keys.end());
+
+  if (nThreads < 1) nThreads = 1;
+  vector<CDumpChunk> chunks(nThreads);
+  vector<pthread_t> threads(nThreads);
+  vector<bool> fThread(nThreads);
+  size_t pos = 0;
+  while (pos < keys.size()) {
+    int n = 0;
+    for (; n < nThreads && pos < keys.size(); n++) {
+      CDumpChunk &chunk = chunks[n];
+      chunk.db = &db;
+      chunk.fText = text != NULL;
+      chunk.fJson = json != NULL;
+      chunk.begin = &keys[pos];
+      pos = min(pos + DUMP_CHUNK, keys.size());
+      chunk.end = &keys[0] + pos;
+      // render inline when a thread can't be had (or isn't worth it)
+      fThread[n] = nThreads > 1 && pthread_create(&threads[n], NULL, ThreadDumpChunk, &chunk) == 0;
+      if (!fThread[n])
+        ThreadDumpChunk(&chunk);
+    }
+    for (int i = 0; i < n; i++) {
+      if (fThread[i])
+        pthread_join(threads[i], NULL);
+      if (text)
+        text->Write(chunks[i].text);
+      if (json)
+        json->Write(chunks[i].json);
+      if (columns) {
+        for (vector<CAddrReport>::const_iterator it = chunks[i].reports.begin(); it != chunks[i].reports.end(); it++)
+          columns->Add(*it);
+      }
+      for (int w = 0; w < STAT_MAX; w++)
+        stat[w] += chunks[i].stat[w];
+    }
+  }
+}
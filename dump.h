@@ -0,0 +1,115 @@
+#ifndef _DUMP_H_
+#define _DUMP_H_ 1
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "db.h"
+
+// Output to a FILE through one large buffer, so that the file sees few,
+// big writes.
+class CBufferedWriter {
+private:
+  FILE *file;
+  std::string buf;
+  size_t nCapacity;
+  bool fError;
+
+public:
+  CBufferedWriter(FILE *fileIn, size_t nCapacityIn = 1 << 20) : file(fileIn), nCapacity(nCapacityIn), fError(false) {
+    buf.reserve(nCapacity);
+  }
+  ~CBufferedWriter() { Flush(); }
+
+  void Write(const char *data, size_t len) {
+    if (buf.size() + len > nCapacity)
+      Flush();
+    if (len >= nCapacity) {
+      if (fwrite(data, 1, len, file) != len) fError = true;
+    } else {
+      buf.append(data, len);
+    }
+  }
+  void Write(const std::string &str) { Write(str.data(), str.size()); }
+  void Printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+  // returns false if any write failed
+  bool Flush() {
+    if (!buf.empty()) {
+      if (fwrite(buf.data(), 1, buf.size(), file) != buf.size()) fError = true;
+      buf.clear();
+    }
+    if (fflush(file) != 0) fError = true;
+    return !fError;
+  }
+};
+
+enum {
+  DUMP_TEXT = 1,   // dnsseed.dump: fixed-width table
+  DUMP_JSON = 2,   // dnsseed.dump.json: one JSON object per node and line
+  DUMP_BINARY = 4, // dnsseed.dump.bin: CDumpColumns
+};
+
+// parse a comma-separated list of format names; returns 0 if one is unknown
+int ParseDumpFormats(const char *str);
+
+#define DUMP_BINARY_MAGIC 0x504d5544 // "DUMP"
+#define DUMP_BINARY_VERSION 1
+
+// The binary dump: a header, then one column per field. Each column is a
+// serialized vector (compact size count, then the values, in the same
+// encoding as dnsseed.dat), and row i of every column belongs to the same
+// node. Rows are in dnsseed.dump order. subver holds indexes into
+// subverTable; uptime[] is 2h, 8h, 1d, 7d, 30d.
+class CDumpColumns {
+public:
+  unsigned int nMagic;
+  int nFormatVersion;
+  int64 nTime;
+  std::vector<CService> addr;
+  std::vector<unsigned char> good;
+  std::vector<int64> lastSuccess;
+  std::vector<float> uptime[5];
+  std::vector<int> blocks;
+  std::vector<uint64> services;
+  std::vector<int> clientVersion;
+  std::vector<int> subver;
+  std::vector<std::string> subverTable;
+
+  CDumpColumns() : nMagic(DUMP_BINARY_MAGIC), nFormatVersion(DUMP_BINARY_VERSION), nTime(0) {}
+
+  void Add(const CAddrReport &rep);
+
+  IMPLEMENT_SERIALIZE (
+    READWRITE(nMagic);
+    READWRITE(nFormatVersion);
+    READWRITE(nTime);
+    READWRITE(addr);
+    READWRITE(good);
+    READWRITE(lastSuccess);
+    for (int i = 0; i < 5; i++)
+      READWRITE(uptime[i]);
+    READWRITE(blocks);
+    READWRITE(services);
+    READWRITE(clientVersion);
+    READWRITE(subver);
+    READWRITE(subverTable);
+  )
+
+private:
+  std::map<int, int> mapSubver; // subVersionTable id -> subverTable index
+};
+
+// Write all tried nodes that ever succeeded, most reliable first, to each
+// of the outputs that is not NULL, and add their reliabilities to stat.
+//
+// Only a compact key per node is copied and sorted; the nodes are then
+// processed in rounds of nThreads chunks, which are rendered in parallel
+// (each holding the shared database lock only to copy its chunk's records)
+// and written out in order.
+void DumpNodes(CAddrDb &db, CBufferedWriter *text, CBufferedWriter *json, CDumpColumns *columns, int nThreads, double stat[STAT_MAX]);
+
+#endif
@@ -11,6 +11,9 @@
 
 #include "bitcoin.h"
 #include "db.h"
+#include "dump.h"
+#include "peersync.h"
+#include "querylog.h"
 
 using namespace std;
 
@@ -23,9 +26,21 @@ public:
   int nP2Port;
   int nMinimumHeight;
   int nDnsThreads;
+  int nMetricsPort;
+  int nDumpFormats;
+  int nSyncPort;
+  int nRrlRate;
+  int nRrlSlip;
+  int nShard;
+  int nShards;
+  int nSelect;
+  int nAsnCap;
+  int nQueryLogFormat;
+  int nQueryLogSize;
   int fUseTestNet;
   int fWipeBan;
   int fWipeIgnore;
+  int fBenchmark;
   const char *mbox;
   const char *ns;
   const char *host;
@@ -34,10 +49,14 @@ public:
   const char *ipv4_proxy;
   const char *ipv6_proxy;
   const char *magic;
+  const char *asnfile;
+  const char *querylog;
   std::vector<string> vSeeds;
+  std::vector<string> vBanRanges;
+  std::vector<string> vPeers;
   std::set<uint64_t> filter_whitelist;
 
-  CDnsSeedOpts() : nThreads(96), nDnsThreads(4), ip_addr("::"), nPort(53), nP2Port(0), nMinimumHeight(0), mbox(NULL), ns(NULL), host(NULL), tor(NULL), fUseTestNet(false), fWipeBan(false), fWipeIgnore(false), ipv4_proxy(NULL), ipv6_proxy(NULL), magic(NULL) {}
+  CDnsSeedOpts() : nThreads(96), nDnsThreads(4), ip_addr("::"), nPort(53), nP2Port(0), nMetricsPort(0), nDumpFormats(DUMP_TEXT), nSyncPort(0), nRrlRate(0), nRrlSlip(2), nShard(0), nShards(1), nSelect(SELECT_RANDOM), nAsnCap(2), nQueryLogFormat(QLOG_BINARY), nQueryLogSize(256), nMinimumHeight(0), mbox(NULL), ns(NULL), host(NULL), tor(NULL), fUseTestNet(false), fWipeBan(false), fWipeIgnore(false), fBenchmark(false), ipv4_proxy(NULL), ipv6_proxy(NULL), magic(NULL), asnfile(NULL), querylog(NULL) {}
 
   void ParseCommandLine(int argc, char **argv) {
     static const char *help = "Litecoin-seeder\n"
@@ -59,9 +78,39 @@ public:
                               "--p2port <port> P2P port to connect to\n"
                               "--magic <hex>   Magic string/network prefix\n"
                               "--minheight <n> Minimum height of block chain\n"
+                              "--ban <net>     Ban an address range (e.g. 192.0.2.0/24), may be repeated\n"
+                              "--metrics <port> Serve Prometheus metrics over HTTP on this TCP port\n"
+                              "                (replaces the status line)\n"
+                              "--rrl <n>       Limit responses to n per second per client /24 (IPv4) or\n"
+                              "                /56 (IPv6) and kind of response (default: no limit)\n"
+                              "--rrlslip <n>   Over the limit, send every n-th response truncated instead\n"
+                              "                of dropping it (default 2, 0 to drop all)\n"
+                              "--select <mode> How to pick the nodes to answer with: random, netgroup to\n"
+                              "                spread each answer over distinct /16s (IPv4) and /32s\n"
+                              "                (IPv6), or weighted to favour reliable, synced, recent\n"
+                              "                nodes (default random)\n"
+                              "--asnfile <file> Prefix to AS (and country) table: answers then hold at most\n"
+                              "                --asncap nodes per AS, and up to half of them are from the\n"
+                              "                client's country if it has good nodes (see README)\n"
+                              "--asncap <n>    Most nodes of one AS in an answer (default 2)\n"
+                              "--querylog <file> Log every DNS query (client prefix, type, flags, response)\n"
+                              "                to this file, renamed to <file>.<time>-<n> once full\n"
+                              "--querylogformat <f> Query log format: binary or csv (default binary)\n"
+                              "--querylogsize <MB> Size at which the query log is rotated (default 256)\n"
+                              "--dumpformat <f1,f2,...>\n"
+                              "                Formats to dump nodes in: text (dnsseed.dump), json\n"
+                              "                (dnsseed.dump.json) and binary (dnsseed.dump.bin)\n"
+                              "                (default text)\n"
+                              "--sync <port>   Exchange probe results with other seeders on this UDP port\n"
+                              "--peer <ip:port> Sync port of another seeder of the cluster, may be repeated\n"
+                              "--shard <i>/<n> Only probe shard i (0..n-1) of the address space; the other\n"
+                              "                shards are probed by the peers\n"
                               "--testnet       Use testnet\n"
                               "--wipeban       Wipe list of banned nodes\n"
                               "--wipeignore    Wipe list of ignored nodes\n"
+                              "--benchmark     Crawl a simulated network (see peersim) from scratch: accept\n"
+                              "                unroutable addresses, do not load or save dnsseed.dat, report\n"
+                              "                the crawl rate and exit once the database has converged\n"
                               "-?, --help      Show this text\n"
                               "\n";
     bool showHelp = false;
@@ -83,14 +132,29 @@ public:
         {"p2port", required_argument, 0, 'b'},
         {"magic", required_argument, 0, 'q'},
         {"minheight", required_argument, 0, 'x'},
+        {"ban", required_argument, 0, 'B'},
+        {"metrics", required_argument, 0, 'M'},
+        {"dumpformat", required_argument, 0, 'F'},
+        {"sync", required_argument, 0, 'S'},
+        {"rrl", required_argument, 0, 'R'},
+        {"rrlslip", required_argument, 0, 'L'},
+        {"peer", required_argument, 0, 'P'},
+        {"shard", required_argument, 0, 'D'},
+        {"select", required_argument, 0, 'G'},
+        {"asnfile", required_argument, 0, 'A'},
+        {"asncap", required_argument, 0, 'C'},
+        {"querylog", required_argument, 0, 'Q'},
+        {"querylogformat", required_argument, 0, 'Y'},
+        {"querylogsize", required_argument, 0, 'Z'},
         {"testnet", no_argument, &fUseTestNet, 1},
         {"wipeban", no_argument, &fWipeBan, 1},
         {"wipeignore", no_argument, &fWipeBan, 1},
+        {"benchmark", no_argument, &fBenchmark, 1},
         {"help", no_argument, 0, '?'},
         {0, 0, 0, 0}
       };
       int option_index = 0;
-      int c = getopt_long(argc, argv, "s:h:n:m:t:a:p:d:o:i:k:w:b:q:x:", long_options, &option_index);
+      int c = getopt_long(argc, argv, "s:h:n:m:t:a:p:d:o:i:k:w:b:q:x:B:M:F:S:P:D:R:L:G:A:C:Q:Y:Z:", long_options, &option_index);
       if (c == -1) break;
       switch (c) {
         case 's': {
@@ -198,6 +262,111 @@ public:
           break;
         }
 
+        case 'B': {
+          vBanRanges.emplace_back(optarg);
+          break;
+        }
+
+        case 'M': {
+          int p = strtol(optarg, NULL, 10);
+          if (p > 0 && p < 65536) nMetricsPort = p;
+          break;
+        }
+
+        case 'F': {
+          int n = ParseDumpFormats(optarg);
+          if (n) {
+            nDumpFormats = n;
+          } else {
+            fprintf(stderr, "Unknown dump format in '%s'\n", optarg);
+            showHelp = true;
+          }
+          break;
+        }
+
+        case 'S': {
+          int p = strtol(optarg, NULL, 10);
+          if (p > 0 && p < 65536) nSyncPort = p;
+          break;
+        }
+
+        case 'R': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 0xFFFF) nRrlRate = n;
+          break;
+        }
+
+        case 'L': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 100) nRrlSlip = n;
+          break;
+        }
+
+        case 'P': {
+          vPeers.emplace_back(optarg);
+          break;
+        }
+
+        case 'D': {
+          int i, n;
+          if (sscanf(optarg, "%i/%i", &i, &n) == 2 && n > 0 && n <= 1024 && i >= 0 && i < n) {
+            nShard = i;
+            nShards = n;
+          } else {
+            fprintf(stderr, "Invalid shard '%s'\n", optarg);
+            showHelp = true;
+          }
+          break;
+        }
+
+        case 'G': {
+          if (strcmp(optarg, "random") == 0) {
+            nSelect = SELECT_RANDOM;
+          } else if (strcmp(optarg, "netgroup") == 0) {
+            nSelect = SELECT_NETGROUP;
+          } else if (strcmp(optarg, "weighted") == 0) {
+            nSelect = SELECT_WEIGHTED;
+          } else {
+            fprintf(stderr, "Unknown selection mode '%s'\n", optarg);
+            showHelp = true;
+          }
+          break;
+        }
+
+        case 'A': {
+          asnfile = optarg;
+          break;
+        }
+
+        case 'C': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0 && n <= 64) nAsnCap = n;
+          break;
+        }
+
+        case 'Q': {
+          querylog = optarg;
+          break;
+        }
+
+        case 'Y': {
+          if (strcmp(optarg, "binary") == 0) {
+            nQueryLogFormat = QLOG_BINARY;
+          } else if (strcmp(optarg, "csv") == 0) {
+            nQueryLogFormat = QLOG_CSV;
+          } else {
+            fprintf(stderr, "Unknown query log format '%s'\n", optarg);
+            showHelp = true;
+          }
+          break;
+        }
+
+        case 'Z': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0 && n <= 1 << 20) nQueryLogSize = n;
+          break;
+        }
+
         case '?': {
           showHelp = true;
           break;
@@ -242,12 +411,31 @@ public:
   }
 };
 
-#include "dns.h"
+#include "dnsthread.h"
 
 CAddrDb db;
 
+class CCrawlerThread {
+public:
+  const int nThreads;
+  CStatCounter nProbes;
+  CStatCounter nGood;
+  CStatCounter nAddresses;
+  CLatencyHistogram histConnect;
+  CLatencyHistogram histVersion;
+  CLatencyHistogram histGetAddr;
+
+  CCrawlerThread(int nThreadsIn) : nThreads(nThreadsIn) {}
+};
+
+vector<CCrawlerThread*> crawlerThread;
+
+CPeerSync *peerSync = NULL; // in cluster mode
+CQueryLog *queryLog = NULL; // with --querylog
+
 extern "C" void* ThreadCrawler(void* data) {
-  int *nThreads=(int*)data;
+  CCrawlerThread *thread = (CCrawlerThread*)data;
+  const int *nThreads = &thread->nThreads;
   do {
     std::vector<CServiceResult> ips;
     int wait = 5;
@@ -265,137 +453,72 @@ extern "C" void* ThreadCrawler(void* data) {
       res.nBanTime = 0;
       res.nClientV = 0;
       res.nHeight = 0;
-      res.strClientV = "";
       res.services = 0;
+      std::string strClientV;
       bool getaddr = res.ourLastSuccess + 86400 < now;
-      res.fGood = TestNode(res.service,res.nBanTime,res.nClientV,res.strClientV,res.nHeight,getaddr ? &addr : NULL, res.services);
+      CProbeTiming timing;
+      res.fGood = TestNode(res.service,res.nBanTime,res.nClientV,strClientV,res.nHeight,getaddr ? &addr : NULL, res.services, &timing);
+      res.nClientSV = subVersionTable.Intern(strClientV);
+      if (timing.nConnect) thread->histConnect.Add(timing.nConnect);
+      if (timing.nVersion) thread->histVersion.Add(timing.nVersion);
+      if (timing.nGetAddr) thread->histGetAddr.Add(timing.nGetAddr);
+      ++thread->nProbes;
+      if (res.fGood) ++thread->nGood;
     }
+    thread->nAddresses += addr.size();
     db.ResultMany(ips);
-    db.Add(addr);
+    if (peerSync) {
+      vector<CAddress> addrNew;
+      db.Add(addr, false, &addrNew);
+      peerSync->QueueResults(ips);
+      peerSync->QueueAddrs(addrNew);
+    } else {
+      db.Add(addr);
+    }
   } while(1);
   return nullptr;
 }
 
-extern "C" int GetIPList(void *thread, char *requestedHostname, addr_t *addr, int max, int ipv4, int ipv6);
-
-class CDnsThread {
-public:
-  struct FlagSpecificData {
-      int nIPv4, nIPv6;
-      std::vector<addr_t> cache;
-      time_t cacheTime;
-      unsigned int cacheHits;
-      FlagSpecificData() : nIPv4(0), nIPv6(0), cacheTime(0), cacheHits(0) {}
-  };
+vector<CDnsThread*> dnsThread;
 
-  dns_opt_t dns_opt; // must be first
-  const int id;
-  std::map<uint64_t, FlagSpecificData> perflag;
-  std::atomic<uint64_t> dbQueries;
-  std::set<uint64_t> filterWhitelist;
-
-  void cacheHit(uint64_t requestedFlags, bool force = false) {
-    static bool nets[NET_MAX] = {};
-    if (!nets[NET_IPV4]) {
-        nets[NET_IPV4] = true;
-        nets[NET_IPV6] = true;
-    }
-    time_t now = time(NULL);
-    FlagSpecificData& thisflag = perflag[requestedFlags];
-    thisflag.cacheHits++;
-    if (force || thisflag.cacheHits * 400 > (thisflag.cache.size()*thisflag.cache.size()) || (thisflag.cacheHits*thisflag.cacheHits * 20 > thisflag.cache.size() && (now - thisflag.cacheTime > 5))) {
-      set<CNetAddr> ips;
-      db.GetIPs(ips, requestedFlags, 1000, nets);
-      dbQueries++;
-      thisflag.cache.clear();
-      thisflag.nIPv4 = 0;
-      thisflag.nIPv6 = 0;
-      thisflag.cache.reserve(ips.size());
-      for (set<CNetAddr>::iterator it = ips.begin(); it != ips.end(); it++) {
-        struct in_addr addr;
-        struct in6_addr addr6;
-        if ((*it).GetInAddr(&addr)) {
-          addr_t a;
-          a.v = 4;
-          memcpy(&a.data.v4, &addr, 4);
-          thisflag.cache.push_back(a);
-          thisflag.nIPv4++;
-        } else if ((*it).GetIn6Addr(&addr6)) {
-          addr_t a;
-          a.v = 6;
-          memcpy(&a.data.v6, &addr6, 16);
-          thisflag.cache.push_back(a);
-          thisflag.nIPv6++;
-        }
-      }
-      thisflag.cacheHits = 0;
-      thisflag.cacheTime = now;
-    }
-  }
+// latency distributions, merged over all threads
+struct CLatencySnapshot {
+  CHistogramSnapshot dnsHandle;
+  CHistogramSnapshot dnsGetIPList;
+  CHistogramSnapshot dnsRefresh;
+  CHistogramSnapshot probeConnect;
+  CHistogramSnapshot probeVersion;
+  CHistogramSnapshot probeGetAddr;
+};
 
-  CDnsThread(CDnsSeedOpts* opts, int idIn) : id(idIn) {
-    dns_opt.host = opts->host;
-    dns_opt.ns = opts->ns;
-    dns_opt.mbox = opts->mbox;
-    dns_opt.datattl = 3600;
-    dns_opt.nsttl = 40000;
-    dns_opt.cb = GetIPList;
-    dns_opt.addr = opts->ip_addr;
-    dns_opt.port = opts->nPort;
-    dns_opt.nRequests = 0;
-    dbQueries = 0;
-    perflag.clear();
-    filterWhitelist = opts->filter_whitelist;
+static void GetLatencySnapshot(CLatencySnapshot &snap) {
+  for (unsigned int i=0; i<dnsThread.size(); i++) {
+    snap.dnsHandle.Add(dnsThread[i]->dns_opt.histHandle);
+    snap.dnsGetIPList.Add(dnsThread[i]->histGetIPList);
+    snap.dnsRefresh.Add(dnsThread[i]->histRefresh);
   }
-
-  void run() {
-    dnsserver(&dns_opt);
+  for (unsigned int i=0; i<crawlerThread.size(); i++) {
+    snap.probeConnect.Add(crawlerThread[i]->histConnect);
+    snap.probeVersion.Add(crawlerThread[i]->histVersion);
+    snap.probeGetAddr.Add(crawlerThread[i]->histGetAddr);
   }
-};
+}
 
-extern "C" int GetIPList(void *data, char *requestedHostname, addr_t* addr, int max, int ipv4, int ipv6) {
-  CDnsThread *thread = (CDnsThread*)data;
+extern "C" void* ThreadSyncSend(void*) {
+  peerSync->RunSender();
+  return nullptr;
+}
 
-  uint64_t requestedFlags = 0;
-  int hostlen = strlen(requestedHostname);
-  if (hostlen > 1 && requestedHostname[0] == 'x' && requestedHostname[1] != '0') {
-    char *pEnd;
-    uint64_t flags = (uint64_t)strtoull(requestedHostname+1, &pEnd, 16);
-    if (*pEnd == '.' && pEnd <= requestedHostname+17 && std::find(thread->filterWhitelist.begin(), thread->filterWhitelist.end(), flags) != thread->filterWhitelist.end())
-      requestedFlags = flags;
-    else
-      return 0;
-  }
-  else if (strcasecmp(requestedHostname, thread->dns_opt.host))
-    return 0;
-  thread->cacheHit(requestedFlags);
-  auto& thisflag = thread->perflag[requestedFlags];
-  unsigned int size = thisflag.cache.size();
-  unsigned int maxmax = (ipv4 ? thisflag.nIPv4 : 0) + (ipv6 ? thisflag.nIPv6 : 0);
-  if (max > size)
-    max = size;
-  if (max > maxmax)
-    max = maxmax;
-  int i=0;
-  while (i<max) {
-    int j = i + (rand() % (size - i));
-    do {
-        bool ok = (ipv4 && thisflag.cache[j].v == 4) ||
-                  (ipv6 && thisflag.cache[j].v == 6);
-        if (ok) break;
-        j++;
-        if (j==size)
-            j=i;
-    } while(1);
-    addr[i] = thisflag.cache[j];
-    thisflag.cache[j] = thisflag.cache[i];
-    thisflag.cache[i] = addr[i];
-    i++;
-  }
-  return max;
+extern "C" void* ThreadSyncReceive(void*) {
+  peerSync->RunReceiver();
+  return nullptr;
 }
 
-vector<CDnsThread*> dnsThread;
+extern "C" void* ThreadQueryLog(void* arg) {
+  CQueryLog *queryLog = (CQueryLog*)arg;
+  queryLog->Run();
+  return nullptr;
+}
 
 extern "C" void* ThreadDNS(void* arg) {
   CDnsThread *thread = (CDnsThread*)arg;
@@ -403,27 +526,29 @@ extern "C" void* ThreadDNS(void* arg) {
   return nullptr;
 }
 
-int StatCompare(const CAddrReport& a, const CAddrReport& b) {
-  if (a.uptime[4] == b.uptime[4]) {
-    if (a.uptime[3] == b.uptime[3]) {
-      return a.clientVersion > b.clientVersion;
-    } else {
-      return a.uptime[3] > b.uptime[3];
-    }
-  } else {
-    return a.uptime[4] > b.uptime[4];
-  }
+// flush and close a dump written to name.new, and move it in place if complete
+static void FinishDump(const char *name, FILE *f, CBufferedWriter *w) {
+  bool fOk = w->Flush();
+  delete w;
+  if (fclose(f) != 0) fOk = false;
+  string tmp = string(name) + ".new";
+  if (fOk)
+    rename(tmp.c_str(), name);
+  else
+    printf("Failed to write %s\n", tmp.c_str());
 }
 
-extern "C" void* ThreadDumper(void*) {
+extern "C" void* ThreadDumper(void* arg) {
+  int nDumpFormats = *(int*)arg;
+  // render the dump on a few cores; the DNS threads keep the shared lock too
+  long nProcs = sysconf(_SC_NPROCESSORS_ONLN);
+  int nDumpThreads = nProcs < 1 ? 1 : nProcs > 8 ? 8 : nProcs;
   int count = 0;
   do {
     Sleep(100000 << count); // First 100s, than 200s, 400s, 800s, 1600s, and then 3200s forever
     if (count < 5)
         count++;
     {
-      vector<CAddrReport> v = db.GetAll();
-      sort(v.begin(), v.end(), StatCompare);
       FILE *f = fopen("dnsseed.dat.new","w+");
       if (f) {
         {
@@ -432,19 +557,43 @@ extern "C" void* ThreadDumper(void*) {
         }
         rename("dnsseed.dat.new", "dnsseed.dat");
       }
-      FILE *d = fopen("dnsseed.dump", "w");
-      fprintf(d, "# address                                        good  lastSuccess    %%(2h)   %%(8h)   %%(1d)   %%(7d)  %%(30d)  blocks      svcs  version\n");
       double stat[5]={0,0,0,0,0};
-      for (vector<CAddrReport>::const_iterator it = v.begin(); it < v.end(); it++) {
-        CAddrReport rep = *it;
-        fprintf(d, "%-47s  %4d  %11" PRId64 "  %6.2f%% %6.2f%% %6.2f%% %6.2f%% %6.2f%%  %6i  %08" PRIx64 "  %5i \"%s\"\n", rep.ip.ToString().c_str(), (int)rep.fGood, rep.lastSuccess, 100.0*rep.uptime[0], 100.0*rep.uptime[1], 100.0*rep.uptime[2], 100.0*rep.uptime[3], 100.0*rep.uptime[4], rep.blocks, rep.services, rep.clientVersion, rep.clientSubVersion.c_str());
-        stat[0] += rep.uptime[0];
-        stat[1] += rep.uptime[1];
-        stat[2] += rep.uptime[2];
-        stat[3] += rep.uptime[3];
-        stat[4] += rep.uptime[4];
+      FILE *d = (nDumpFormats & DUMP_TEXT) ? fopen("dnsseed.dump.new", "w") : NULL;
+      FILE *j = (nDumpFormats & DUMP_JSON) ? fopen("dnsseed.dump.json.new", "w") : NULL;
+      CBufferedWriter *wd = d ? new CBufferedWriter(d) : NULL;
+      CBufferedWriter *wj = j ? new CBufferedWriter(j) : NULL;
+      CDumpColumns *cols = (nDumpFormats & DUMP_BINARY) ? new CDumpColumns() : NULL;
+      if (wd)
+        wd->Printf("# address                                        good  lastSuccess    %%(2h)   %%(8h)   %%(1d)   %%(7d)  %%(30d)  blocks      svcs  version\n");
+      DumpNodes(db, wd, wj, cols, nDumpThreads, stat);
+      if (wd) {
+        CLatencySnapshot lat;
+        GetLatencySnapshot(lat);
+        wd->Printf("# latency (us)          count         p50         p90         p99        p999\n");
+        const char *names[6] = {"dns_handle", "dns_getiplist", "dns_cache_refresh", "probe_connect", "probe_version", "probe_getaddr"};
+        const CHistogramSnapshot *hists[6] = {&lat.dnsHandle, &lat.dnsGetIPList, &lat.dnsRefresh, &lat.probeConnect, &lat.probeVersion, &lat.probeGetAddr};
+        for (int i = 0; i < 6; i++)
+          wd->Printf("# %-17s %10llu %11.1f %11.1f %11.1f %11.1f\n", names[i], (unsigned long long)hists[i]->total, hists[i]->GetPercentile(0.5) * 1e-3, hists[i]->GetPercentile(0.9) * 1e-3, hists[i]->GetPercentile(0.99) * 1e-3, hists[i]->GetPercentile(0.999) * 1e-3);
+        FinishDump("dnsseed.dump", d, wd);
+      }
+      if (wj)
+        FinishDump("dnsseed.dump.json", j, wj);
+      if (cols) {
+        cols->nTime = time(NULL);
+        FILE *b = fopen("dnsseed.dump.bin.new", "w");
+        if (b) {
+          bool fOk = true;
+          try {
+            CAutoFile cf(b);
+            cf << *cols;
+          } catch (std::ios_base::failure &e) {
+            fOk = false;
+          }
+          if (fOk)
+            rename("dnsseed.dump.bin.new", "dnsseed.dump.bin");
+        }
+        delete cols;
       }
-      fclose(d);
       FILE *ff = fopen("dnsstats.log", "a");
       fprintf(ff, "%llu %g %g %g %g %g\n", (unsigned long long)(time(NULL)), stat[0], stat[1], stat[2], stat[3], stat[4]);
       fclose(ff);
@@ -453,7 +602,40 @@ extern "C" void* ThreadDumper(void*) {
   return nullptr;
 }
 
+#ifdef DEBUG_LOCKCONTENTION
+#define LOCK_REPORT_LINES 12
+
+// lock call sites, the most waited for first
+static void GetLockSites(vector<CLockSite*> &sites) {
+  for (CLockSite *site = CLockSite::GetFirst(); site; site = site->pnext)
+    sites.push_back(site);
+  sort(sites.begin(), sites.end(), [](const CLockSite *a, const CLockSite *b) {
+    return a->nWaitNanos[0] + a->nWaitNanos[1] > b->nWaitNanos[0] + b->nWaitNanos[1];
+  });
+}
+
+static void PrintLockSites() {
+  vector<CLockSite*> sites;
+  GetLockSites(sites);
+  int lines = 0;
+  for (unsigned int i=0; i<sites.size() && lines < LOCK_REPORT_LINES; i++) {
+    for (int fShared=0; fShared<2 && lines < LOCK_REPORT_LINES; fShared++) {
+      const CLockSite *site = sites[i];
+      if (!site->nAcquired[fShared])
+        continue;
+      printf("\n\x1b[2K  %s:%i %s (%s): %llu acquired, %llu contended, %.3fs waiting, %.3fs held", site->pszFile, site->nLine, site->pszLock, fShared ? "shared" : "exclusive", (unsigned long long)site->nAcquired[fShared], (unsigned long long)site->nContended[fShared], site->nWaitNanos[fShared] * 1e-9, site->nHoldNanos[fShared] * 1e-9);
+      lines++;
+    }
+  }
+}
+#endif
+
 extern "C" void* ThreadStats(void*) {
+#ifdef DEBUG_LOCKCONTENTION
+  const int reserve = 3 + LOCK_REPORT_LINES;
+#else
+  const int reserve = 3;
+#endif
   bool first = true;
   do {
     char c[256];
@@ -465,7 +647,9 @@ extern "C" void* ThreadStats(void*) {
     if (first)
     {
       first = false;
-      printf("\n\n\n\x1b[3A");
+      for (int i=0; i<reserve; i++)
+        printf("\n");
+      printf("\x1b[%iA", reserve);
     }
     else
       printf("\x1b[2K\x1b[u");
@@ -473,15 +657,184 @@ extern "C" void* ThreadStats(void*) {
     uint64_t requests = 0;
     uint64_t queries = 0;
     for (unsigned int i=0; i<dnsThread.size(); i++) {
-      requests += dnsThread[i]->dns_opt.nRequests;
-      queries += dnsThread[i]->dbQueries;
+      requests += dnsThread[i]->dns_opt.nRequests.Get();
+      queries += dnsThread[i]->dbQueries.Get();
     }
-    printf("%s %i/%i available (%i tried in %is, %i new, %i active), %i banned; %llu DNS requests, %llu db queries", c, stats.nGood, stats.nAvail, stats.nTracked, stats.nAge, stats.nNew, stats.nAvail - stats.nTracked - stats.nNew, stats.nBanned, (unsigned long long)requests, (unsigned long long)queries);
+    CLatencySnapshot lat;
+    GetLatencySnapshot(lat);
+    printf("%s %i/%i available (%i tried in %is, %i new, %i active), %i banned; %llu DNS requests, %llu db queries; p99/p999 dns %.0f/%.0fus, version %.0f/%.0fms", c, stats.nGood, stats.nAvail, stats.nTracked, stats.nAge, stats.nNew, stats.nAvail - stats.nTracked - stats.nNew, stats.nBanned, (unsigned long long)requests, (unsigned long long)queries, lat.dnsHandle.GetPercentile(0.99) * 1e-3, lat.dnsHandle.GetPercentile(0.999) * 1e-3, lat.probeVersion.GetPercentile(0.99) * 1e-6, lat.probeVersion.GetPercentile(0.999) * 1e-6);
+#ifdef DEBUG_LOCKCONTENTION
+    PrintLockSites();
+#endif
     Sleep(1000);
   } while(1);
   return nullptr;
 }
 
+// Report the crawl rate and the state of the database every second, and
+// return once it has converged: nothing new to try, and no new addresses
+// learnt for 10 seconds.
+extern "C" void* ThreadBenchmark(void*) {
+  time_t start = time(NULL), lastChange = start;
+  int lastAvail = -1;
+  uint64_t lastProbes = 0;
+  do {
+    Sleep(1000);
+    time_t now = time(NULL);
+    CAddrDbStats stats;
+    db.GetStats(stats);
+    uint64_t probes = 0;
+    for (unsigned int i=0; i<crawlerThread.size(); i++)
+      probes += crawlerThread[i]->nProbes.Get();
+    printf("%4is: %llu probes/s, %i known, %i good, %i new, %i banned\n", (int)(now - start), (unsigned long long)(probes - lastProbes), stats.nAvail, stats.nGood, stats.nNew, stats.nBanned);
+    lastProbes = probes;
+    if (stats.nNew > 0 || stats.nAvail != lastAvail) {
+      lastAvail = stats.nAvail;
+      lastChange = now;
+    } else if (now - lastChange >= 10) {
+      CLatencySnapshot lat;
+      GetLatencySnapshot(lat);
+      printf("Converged after %is: %i known, %i good, %i banned; %llu probes (%.0f/s); version p50/p99 %.0f/%.0fms\n", (int)(lastChange - start), stats.nAvail, stats.nGood, stats.nBanned, (unsigned long long)probes, (double)probes / (now - start), lat.probeVersion.GetPercentile(0.5) * 1e-6, lat.probeVersion.GetPercentile(0.99) * 1e-6);
+      return nullptr;
+    }
+  } while(1);
+}
+
+static void AddMetric(string &out, const char *name, const char *type, const char *help) {
+  out += strprintf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void AddSummary(string &out, const char *name, const char *labels, const CHistogramSnapshot &hist) {
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  const char *sep = labels[0] ? "," : "";
+  for (int i = 0; i < 4; i++)
+    out += strprintf("%s{%s%squantile=\"%g\"} %.9f\n", name, labels, sep, quantiles[i], hist.GetPercentile(quantiles[i]) * 1e-9);
+  string suffix = labels[0] ? strprintf("{%s}", labels) : string();
+  out += strprintf("%s_sum%s %.9f\n", name, suffix.c_str(), hist.sum * 1e-9);
+  out += strprintf("%s_count%s %llu\n", name, suffix.c_str(), (unsigned long long)hist.total);
+}
+
+static string RenderMetrics() {
+  string out;
+  AddMetric(out, "dnsseed_dns_requests_total", "counter", "DNS requests received, per DNS thread.");
+  for (unsigned int i=0; i<dnsThread.size(); i++)
+    out += strprintf("dnsseed_dns_requests_total{thread=\"%i\"} %llu\n", i, (unsigned long long)dnsThread[i]->dns_opt.nRequests.Get());
+  AddMetric(out, "dnsseed_dns_responses_total", "counter", "DNS responses sent, per DNS thread.");
+  for (unsigned int i=0; i<dnsThread.size(); i++)
+    out += strprintf("dnsseed_dns_responses_total{thread=\"%i\"} %llu\n", i, (unsigned long long)dnsThread[i]->dns_opt.nResponses.Get());
+  AddMetric(out, "dnsseed_dns_response_bytes_total", "counter", "Bytes of DNS responses sent, per DNS thread.");
+  for (unsigned int i=0; i<dnsThread.size(); i++)
+    out += strprintf("dnsseed_dns_response_bytes_total{thread=\"%i\"} %llu\n", i, (unsigned long long)dnsThread[i]->dns_opt.nResponseBytes.Get());
+  AddMetric(out, "dnsseed_dns_rate_limited_total", "counter", "Responses over the rate limit (--rrl), per DNS thread, by what was sent instead.");
+  for (unsigned int i=0; i<dnsThread.size(); i++) {
+    out += strprintf("dnsseed_dns_rate_limited_total{thread=\"%i\",action=\"dropped\"} %llu\n", i, (unsigned long long)dnsThread[i]->dns_opt.nRateDropped.Get());
+    out += strprintf("dnsseed_dns_rate_limited_total{thread=\"%i\",action=\"slipped\"} %llu\n", i, (unsigned long long)dnsThread[i]->dns_opt.nRateSlipped.Get());
+  }
+  AddMetric(out, "dnsseed_dns_ecs_requests_total", "counter", "DNS requests with an EDNS client subnet, per DNS thread.");
+  for (unsigned int i=0; i<dnsThread.size(); i++)
+    out += strprintf("dnsseed_dns_ecs_requests_total{thread=\"%i\"} %llu\n", i, (unsigned long long)dnsThread[i]->dns_opt.nEcsRequests.Get());
+  AddMetric(out, "dnsseed_dns_regional_answers_total", "counter", "Answers with nodes from the client's country (--asnfile), per DNS thread.");
+  for (unsigned int i=0; i<dnsThread.size(); i++)
+    out += strprintf("dnsseed_dns_regional_answers_total{thread=\"%i\"} %llu\n", i, (unsigned long long)dnsThread[i]->nRegional.Get());
+  AddMetric(out, "dnsseed_dns_cache_refreshes_total", "counter", "Answer cache refreshes from the node database, per DNS thread.");
+  for (unsigned int i=0; i<dnsThread.size(); i++)
+    out += strprintf("dnsseed_dns_cache_refreshes_total{thread=\"%i\"} %llu\n", i, (unsigned long long)dnsThread[i]->dbQueries.Get());
+
+  uint64_t probes = 0, good = 0, addresses = 0;
+  for (unsigned int i=0; i<crawlerThread.size(); i++) {
+    probes += crawlerThread[i]->nProbes.Get();
+    good += crawlerThread[i]->nGood.Get();
+    addresses += crawlerThread[i]->nAddresses.Get();
+  }
+  AddMetric(out, "dnsseed_crawler_probes_total", "counter", "Nodes probed by the crawler threads, by result.");
+  out += strprintf("dnsseed_crawler_probes_total{result=\"good\"} %llu\n", (unsigned long long)good);
+  out += strprintf("dnsseed_crawler_probes_total{result=\"bad\"} %llu\n", (unsigned long long)(probes - good));
+  AddMetric(out, "dnsseed_crawler_addresses_total", "counter", "Addresses received from probed nodes.");
+  out += strprintf("dnsseed_crawler_addresses_total %llu\n", (unsigned long long)addresses);
+
+  if (peerSync) {
+    AddMetric(out, "dnsseed_sync_results_total", "counter", "Probe results exchanged with the other seeders of the cluster.");
+    out += strprintf("dnsseed_sync_results_total{direction=\"sent\"} %llu\n", (unsigned long long)peerSync->nSentResults.Get());
+    out += strprintf("dnsseed_sync_results_total{direction=\"received\"} %llu\n", (unsigned long long)peerSync->nRecvResults.Get());
+    AddMetric(out, "dnsseed_sync_addresses_total", "counter", "New addresses exchanged with the other seeders of the cluster.");
+    out += strprintf("dnsseed_sync_addresses_total{direction=\"sent\"} %llu\n", (unsigned long long)peerSync->nSentAddrs.Get());
+    out += strprintf("dnsseed_sync_addresses_total{direction=\"received\"} %llu\n", (unsigned long long)peerSync->nRecvAddrs.Get());
+    AddMetric(out, "dnsseed_sync_packets_total", "counter", "Sync datagrams, by direction; dropped ones came from unknown senders or were malformed.");
+    out += strprintf("dnsseed_sync_packets_total{direction=\"sent\"} %llu\n", (unsigned long long)peerSync->nSentPackets.Get());
+    out += strprintf("dnsseed_sync_packets_total{direction=\"received\"} %llu\n", (unsigned long long)peerSync->nRecvPackets.Get());
+    out += strprintf("dnsseed_sync_packets_total{direction=\"dropped\"} %llu\n", (unsigned long long)peerSync->nRecvDropped.Get());
+  }
+  if (queryLog) {
+    AddMetric(out, "dnsseed_querylog_records_total", "counter", "Queries for the query log, by whether they were written or dropped because a ring was full.");
+    out += strprintf("dnsseed_querylog_records_total{result=\"written\"} %llu\n", (unsigned long long)queryLog->nWritten.Get());
+    out += strprintf("dnsseed_querylog_records_total{result=\"dropped\"} %llu\n", (unsigned long long)queryLog->GetDropped());
+  }
+
+  CAddrDbStats stats;
+  db.GetStats(stats);
+  AddMetric(out, "dnsseed_db_nodes", "gauge", "Nodes in the database, by state.");
+  out += strprintf("dnsseed_db_nodes{state=\"good\"} %i\n", stats.nGood);
+  out += strprintf("dnsseed_db_nodes{state=\"available\"} %i\n", stats.nAvail);
+  out += strprintf("dnsseed_db_nodes{state=\"tracked\"} %i\n", stats.nTracked);
+  out += strprintf("dnsseed_db_nodes{state=\"new\"} %i\n", stats.nNew);
+  out += strprintf("dnsseed_db_nodes{state=\"active\"} %i\n", stats.nAvail - stats.nTracked - stats.nNew);
+  out += strprintf("dnsseed_db_nodes{state=\"banned\"} %i\n", stats.nBanned);
+  AddMetric(out, "dnsseed_db_oldest_try_age_seconds", "gauge", "Time since the least recently tried node was tried.");
+  out += strprintf("dnsseed_db_oldest_try_age_seconds %i\n", stats.nAge);
+
+  AddMetric(out, "dnsseed_lock_contended_total", "counter", "Acquisitions of the database lock that had to wait.");
+  out += strprintf("dnsseed_lock_contended_total{lock=\"db\",mode=\"exclusive\"} %llu\n", (unsigned long long)db.GetLockContended(false));
+  out += strprintf("dnsseed_lock_contended_total{lock=\"db\",mode=\"shared\"} %llu\n", (unsigned long long)db.GetLockContended(true));
+  AddMetric(out, "dnsseed_lock_wait_seconds_total", "counter", "Time spent waiting for the database lock.");
+  out += strprintf("dnsseed_lock_wait_seconds_total{lock=\"db\",mode=\"exclusive\"} %.9f\n", db.GetLockWaitNanos(false) * 1e-9);
+  out += strprintf("dnsseed_lock_wait_seconds_total{lock=\"db\",mode=\"shared\"} %.9f\n", db.GetLockWaitNanos(true) * 1e-9);
+
+#ifdef DEBUG_LOCKCONTENTION
+  vector<CLockSite*> sites;
+  GetLockSites(sites);
+  const char *families[4][2] = {
+    {"dnsseed_lock_site_acquisitions_total", "Lock acquisitions, per call site."},
+    {"dnsseed_lock_site_contended_total", "Lock acquisitions that had to wait, per call site."},
+    {"dnsseed_lock_site_wait_seconds_total", "Time spent waiting for locks, per call site."},
+    {"dnsseed_lock_site_hold_seconds_total", "Time locks were held, per call site."},
+  };
+  for (int f=0; f<4; f++) {
+    AddMetric(out, families[f][0], "counter", families[f][1]);
+    for (unsigned int i=0; i<sites.size(); i++) {
+      for (int fShared=0; fShared<2; fShared++) {
+        const CLockSite *site = sites[i];
+        string labels = strprintf("site=\"%s:%i\",lock=\"%s\",mode=\"%s\"", site->pszFile, site->nLine, site->pszLock, fShared ? "shared" : "exclusive");
+        if (f < 2)
+          out += strprintf("%s{%s} %llu\n", families[f][0], labels.c_str(), (unsigned long long)(f == 0 ? site->nAcquired[fShared] : site->nContended[fShared]));
+        else
+          out += strprintf("%s{%s} %.9f\n", families[f][0], labels.c_str(), (f == 2 ? site->nWaitNanos[fShared] : site->nHoldNanos[fShared]) * 1e-9);
+      }
+    }
+  }
+#endif
+
+  CLatencySnapshot lat;
+  GetLatencySnapshot(lat);
+  AddMetric(out, "dnsseed_dns_handle_seconds", "summary", "Time to parse a DNS request and build its response.");
+  AddSummary(out, "dnsseed_dns_handle_seconds", "", lat.dnsHandle);
+  AddMetric(out, "dnsseed_dns_getiplist_seconds", "summary", "Time to select the addresses for a DNS response.");
+  AddSummary(out, "dnsseed_dns_getiplist_seconds", "", lat.dnsGetIPList);
+  AddMetric(out, "dnsseed_dns_cache_refresh_seconds", "summary", "Time to refresh an answer cache from the node database.");
+  AddSummary(out, "dnsseed_dns_cache_refresh_seconds", "", lat.dnsRefresh);
+  AddMetric(out, "dnsseed_crawler_probe_seconds", "summary", "Duration of the phases of a crawler probe.");
+  AddSummary(out, "dnsseed_crawler_probe_seconds", "phase=\"connect\"", lat.probeConnect);
+  AddSummary(out, "dnsseed_crawler_probe_seconds", "phase=\"version\"", lat.probeVersion);
+  AddSummary(out, "dnsseed_crawler_probe_seconds", "phase=\"getaddr\"", lat.probeGetAddr);
+  return out;
+}
+
+extern "C" void* ThreadMetrics(void* arg) {
+  metrics_opt_t *opt = (metrics_opt_t*)arg;
+  int ret = metricsserver(opt);
+  fprintf(stderr, "Metrics server on port %i failed (%i)\n", opt->port, ret);
+  return nullptr;
+}
+
 static const string mainnet_seeds[] = {"dnsseed.litecoinpool.org", "seed-a.litecoin.loshan.co.uk", "dnsseed.thrasher.io", ""};
 static const string testnet_seeds[] = {"seed-b.litecoin.loshan.co.uk", "dnsseed-testnet.thrasher.io", ""};
 static const string *seeds = mainnet_seeds;
@@ -586,11 +939,32 @@ int main(int argc, char **argv) {
     fprintf(stderr, "No hostname set. Please use -h.\n");
     exit(1);
   }
+  if (fDNS) {
+    dns_opt_t zone;
+    zone.host = opts.host;
+    if (dns_set_zone(&zone)) {
+      fprintf(stderr, "Invalid hostname %s.\n", opts.host);
+      exit(1);
+    }
+  }
   if (fDNS && !opts.mbox) {
     fprintf(stderr, "No e-mail address set. Please use -m.\n");
     exit(1);
   }
-  FILE *f = fopen("dnsseed.dat","r");
+  for (const string& range: opts.vBanRanges) {
+    CSubNet subnet(range);
+    if (!subnet.IsValid()) {
+      fprintf(stderr, "Invalid address range to ban: %s\n", range.c_str());
+      exit(1);
+    }
+    printf("Banning %s\n", subnet.ToString().c_str());
+    db.BanRange(subnet);
+  }
+  if (opts.fBenchmark) {
+    printf("Benchmark mode: accepting unroutable addresses, not using dnsseed.dat\n");
+    fAllowUnroutable = true;
+  }
+  FILE *f = opts.fBenchmark ? NULL : fopen("dnsseed.dat","r");
   if (f) {
     printf("Loading dnsseed.dat...");
     CAutoFile cf(f);
@@ -601,17 +975,71 @@ int main(int argc, char **argv) {
         db.ResetIgnores();
     printf("done\n");
   }
-  pthread_t threadDns, threadSeed, threadDump, threadStats;
+  pthread_t threadDns, threadSeed, threadDump, threadStats, threadMetrics, threadBenchmark, threadSync;
+  db.SetSelect(opts.nSelect);
+  if (opts.nShards > 1) {
+    printf("Probing shard %i of %i\n", opts.nShard, opts.nShards);
+    db.SetShard(opts.nShard, opts.nShards);
+  }
+  if (opts.nSyncPort) {
+    vector<CService> vPeers;
+    for (const string& peer: opts.vPeers) {
+      CService service(peer, opts.nSyncPort);
+      if (!service.IsValid()) {
+        fprintf(stderr, "Invalid peer: %s\n", peer.c_str());
+        exit(1);
+      }
+      vPeers.push_back(service);
+    }
+    peerSync = new CPeerSync(db, vPeers);
+    if (!peerSync->Bind(opts.ip_addr, opts.nSyncPort)) {
+      fprintf(stderr, "Unable to bind sync port %i\n", opts.nSyncPort);
+      exit(1);
+    }
+    printf("Syncing with %i peers on port %i\n", (int)vPeers.size(), opts.nSyncPort);
+    pthread_create(&threadSync, NULL, ThreadSyncSend, NULL);
+    pthread_create(&threadSync, NULL, ThreadSyncReceive, NULL);
+  } else if (opts.nShards > 1) {
+    fprintf(stderr, "--shard needs --sync, or the other shards are never probed\n");
+    exit(1);
+  }
+  CAsnMap *asnMap = NULL;
+  if (opts.asnfile) {
+    asnMap = new CAsnMap();
+    string strError;
+    if (!asnMap->Load(opts.asnfile, strError)) {
+      fprintf(stderr, "Unable to load AS map: %s\n", strError.c_str());
+      exit(1);
+    }
+    printf("Loaded %i prefixes from %s\n", asnMap->GetPrefixCount(), opts.asnfile);
+  }
   if (fDNS) {
     printf("Starting %i DNS threads for %s on %s (port %i)...", opts.nDnsThreads, opts.host, opts.ns, opts.nPort);
     dnsThread.clear();
+    dns_rrl_t *rrl = opts.nRrlRate ? new dns_rrl_t(opts.nRrlRate, opts.nRrlSlip) : NULL;
+    if (opts.querylog) {
+      queryLog = new CQueryLog(opts.querylog, opts.nQueryLogFormat, (int64)opts.nQueryLogSize << 20);
+      if (!queryLog->Open()) {
+        fprintf(stderr, "Unable to open query log %s\n", opts.querylog);
+        exit(1);
+      }
+    }
     for (int i=0; i<opts.nDnsThreads; i++) {
-      dnsThread.push_back(new CDnsThread(&opts, i));
+      dnsThread.push_back(new CDnsThread(opts.host, opts.ns, opts.mbox, opts.ip_addr, opts.nPort, opts.filter_whitelist, i));
+      dnsThread[i]->dns_opt.rrl = rrl;
+      if (queryLog)
+        dnsThread[i]->dns_opt.qlog = queryLog->AddRing();
+      dnsThread[i]->asnMap = asnMap;
+      dnsThread[i]->nAsnCap = opts.nAsnCap;
       pthread_create(&threadDns, NULL, ThreadDNS, dnsThread[i]);
       printf(".");
       Sleep(20);
     }
     printf("done\n");
+    if (queryLog) {
+      pthread_t threadQueryLog;
+      pthread_create(&threadQueryLog, NULL, ThreadQueryLog, queryLog);
+    }
   }
   printf("Starting seeder...");
   pthread_create(&threadSeed, NULL, ThreadSeeder, NULL);
@@ -622,13 +1050,28 @@ int main(int argc, char **argv) {
   pthread_attr_setstacksize(&attr_crawler, 0x20000);
   for (int i=0; i<opts.nThreads; i++) {
     pthread_t thread;
-    pthread_create(&thread, &attr_crawler, ThreadCrawler, &opts.nThreads);
+    crawlerThread.push_back(new CCrawlerThread(opts.nThreads));
+    pthread_create(&thread, &attr_crawler, ThreadCrawler, crawlerThread[i]);
   }
   pthread_attr_destroy(&attr_crawler);
   printf("done\n");
-  pthread_create(&threadStats, NULL, ThreadStats, NULL);
-  pthread_create(&threadDump, NULL, ThreadDumper, NULL);
+  metrics_opt_t metrics_opt;
+  if (opts.nMetricsPort) {
+    printf("Serving metrics on port %i\n", opts.nMetricsPort);
+    metrics_opt.port = opts.nMetricsPort;
+    metrics_opt.addr = opts.ip_addr;
+    metrics_opt.render = RenderMetrics;
+    pthread_create(&threadMetrics, NULL, ThreadMetrics, &metrics_opt);
+  } else if (!opts.fBenchmark) {
+    pthread_create(&threadStats, NULL, ThreadStats, NULL);
+  }
   void* res;
+  if (opts.fBenchmark) {
+    pthread_create(&threadBenchmark, NULL, ThreadBenchmark, NULL);
+    pthread_join(threadBenchmark, &res);
+    return 0;
+  }
+  pthread_create(&threadDump, NULL, ThreadDumper, &opts.nDumpFormats);
   pthread_join(threadDump, &res);
   return 0;
 }
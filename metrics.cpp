@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+
+#define MAX_CONNECTIONS 16
+#define MAX_REQUEST 8192
+#define CONN_TIMEOUT 10
+
+// A single-threaded HTTP/1.0 server: every socket is non-blocking and
+// multiplexed with poll(), so a slow or stuck client cannot hold up the
+// others, and at most MAX_CONNECTIONS are served at a time.
+
+struct metrics_conn_t {
+  int fd;
+  time_t start;
+  std::string in;
+  std::string out;
+  size_t sent;
+};
+
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static std::string http_response(const char *status, const char *type, const std::string &body) {
+  char header[256];
+  snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", status, type, (unsigned int)body.size());
+  return header + body;
+}
+
+// returns true once a complete request was read and a response was queued
+static bool handle_request(metrics_opt_t *opt, metrics_conn_t &conn) {
+  size_t end = conn.in.find("\r\n\r\n");
+  if (end == std::string::npos)
+    end = conn.in.find("\n\n");
+  if (end == std::string::npos)
+    return false;
+  if (conn.in.compare(0, 13, "GET /metrics ") == 0 || conn.in.compare(0, 6, "GET / ") == 0) {
+    conn.out = http_response("200 OK", "text/plain; version=0.0.4", opt->render());
+  } else if (conn.in.compare(0, 4, "GET ") == 0) {
+    conn.out = http_response("404 Not Found", "text/plain", "not found\n");
+  } else {
+    conn.out = http_response("405 Method Not Allowed", "text/plain", "method not allowed\n");
+  }
+  return true;
+}
+
+CHistogramSnapshot::CHistogramSnapshot() : total(0), sum(0) {
+  memset(count, 0, sizeof(count));
+}
+
+void CHistogramSnapshot::Add(const CLatencyHistogram &hist) {
+  for (int b = 0; b < CLatencyHistogram::BUCKETS; b++) {
+    uint64_t n = hist.count[b].load(std::memory_order_relaxed);
+    count[b] += n;
+    total += n;
+  }
+  sum += hist.sum.Get();
+}
+
+double CHistogramSnapshot::GetPercentile(double q) const {
+  if (total == 0)
+    return 0;
+  double rank = q * total;
+  uint64_t seen = 0;
+  for (int b = 0; b < CLatencyHistogram::BUCKETS; b++) {
+    if (count[b] == 0)
+      continue;
+    if (seen + count[b] >= rank) {
+      // interpolate linearly within the bucket
+      double start = CLatencyHistogram::GetBucketStart(b);
+      double width = CLatencyHistogram::GetBucketStart(b + 1) - start;
+      return start + width * (rank - seen) / count[b];
+    }
+    seen += count[b];
+  }
+  return CLatencyHistogram::GetBucketStart(CLatencyHistogram::BUCKETS);
+}
+
+int metricsserver(metrics_opt_t *opt) {
+  int listenSocket = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+  if (listenSocket == -1)
+    return -1;
+  int sockopt = 1;
+  setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof sockopt);
+  struct sockaddr_in6 si_me;
+  memset((char *) &si_me, 0, sizeof(si_me));
+  si_me.sin6_family = AF_INET6;
+  si_me.sin6_port = htons(opt->port);
+  inet_pton(AF_INET6, opt->addr, &si_me.sin6_addr);
+  if (bind(listenSocket, (struct sockaddr*)&si_me, sizeof(si_me))==-1 || listen(listenSocket, MAX_CONNECTIONS)==-1) {
+    close(listenSocket);
+    return -2;
+  }
+  set_nonblocking(listenSocket);
+
+  std::vector<metrics_conn_t> conns;
+  std::vector<struct pollfd> fds;
+  while (1) {
+    fds.clear();
+    struct pollfd pfd;
+    pfd.fd = listenSocket;
+    pfd.events = conns.size() < MAX_CONNECTIONS ? POLLIN : 0;
+    pfd.revents = 0;
+    fds.push_back(pfd);
+    for (size_t i = 0; i < conns.size(); i++) {
+      pfd.fd = conns[i].fd;
+      pfd.events = conns[i].out.empty() ? POLLIN : POLLOUT;
+      fds.push_back(pfd);
+    }
+    if (poll(&fds[0], fds.size(), 1000) < 0)
+      continue;
+
+    time_t now = time(NULL);
+    std::vector<metrics_conn_t> keep;
+    for (size_t i = 0; i < conns.size(); i++) {
+      metrics_conn_t &conn = conns[i];
+      short revents = fds[i + 1].revents;
+      bool done = now - conn.start > CONN_TIMEOUT || (revents & (POLLERR | POLLHUP | POLLNVAL));
+      if (!done && (revents & POLLIN)) {
+        char buf[4096];
+        ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+          done = true;
+        } else {
+          conn.in.append(buf, n);
+          if (!handle_request(opt, conn) && conn.in.size() > MAX_REQUEST)
+            done = true;
+        }
+      }
+      if (!done && (revents & POLLOUT)) {
+        ssize_t n = send(conn.fd, conn.out.data() + conn.sent, conn.out.size() - conn.sent, MSG_NOSIGNAL);
+        if (n < 0) {
+          done = true;
+        } else {
+          conn.sent += n;
+          done = conn.sent == conn.out.size();
+        }
+      }
+      if (done)
+        close(conn.fd);
+      else
+        keep.push_back(conn);
+    }
+    conns.swap(keep);
+
+    if (fds[0].revents & POLLIN) {
+      while (conns.size() < MAX_CONNECTIONS) {
+        int fd = accept(listenSocket, NULL, NULL);
+        if (fd == -1)
+          break;
+        set_nonblocking(fd);
+        metrics_conn_t conn;
+        conn.fd = fd;
+        conn.start = now;
+        conn.sent = 0;
+        conns.push_back(conn);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_ 1
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+// Event counter that is written by a single thread, and can be read from
+// any other thread (e.g. the metrics server) without locking.
+class CStatCounter {
+private:
+  std::atomic<uint64_t> n;
+public:
+  CStatCounter() : n(0) {}
+  void operator+=(uint64_t d) { n.store(n.load(std::memory_order_relaxed) + d, std::memory_order_relaxed); }
+  void operator++() { *this += 1; }
+  uint64_t Get() const { return n.load(std::memory_order_relaxed); }
+};
+
+// Log-linear latency histogram in nanoseconds (HDR-style: 16 linear
+// sub-buckets per power of two, so bucket bounds are within ~6% of the
+// recorded value). Like CStatCounter, it has a single writing thread and
+// lock-free readers; per-thread histograms are merged into a
+// CHistogramSnapshot on demand.
+class CLatencyHistogram {
+public:
+  enum { SUB_BITS = 4, SUB_BUCKETS = 1 << SUB_BITS, MAX_EXP = 40, BUCKETS = (MAX_EXP - SUB_BITS + 1) * SUB_BUCKETS };
+
+  static int GetBucket(int64_t ns) {
+    if (ns < SUB_BUCKETS) return ns < 0 ? 0 : ns;
+    int e = 63 - __builtin_clzll(ns);
+    if (e >= MAX_EXP) return BUCKETS - 1;
+    return (e - SUB_BITS + 1) * SUB_BUCKETS + ((ns >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+  }
+  // lower bound of a bucket; bucket b covers [GetBucketStart(b), GetBucketStart(b+1))
+  static int64_t GetBucketStart(int b) {
+    if (b < SUB_BUCKETS) return b;
+    int e = b / SUB_BUCKETS + SUB_BITS - 1;
+    return (int64_t)(SUB_BUCKETS + b % SUB_BUCKETS) << (e - SUB_BITS);
+  }
+
+  void Add(int64_t ns) {
+    std::atomic<uint64_t> &c = count[GetBucket(ns)];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum += ns;
+  }
+
+  CLatencyHistogram() {
+    for (int b = 0; b < BUCKETS; b++)
+      count[b] = 0;
+  }
+
+  friend class CHistogramSnapshot;
+
+private:
+  std::atomic<uint64_t> count[BUCKETS];
+  CStatCounter sum;
+};
+
+class CHistogramSnapshot {
+public:
+  uint64_t count[CLatencyHistogram::BUCKETS];
+  uint64_t total;
+  double sum; // in nanoseconds
+
+  CHistogramSnapshot();
+  void Add(const CLatencyHistogram &hist);
+  // value (in nanoseconds) below which a fraction q of the samples lie
+  double GetPercentile(double q) const;
+};
+
+struct metrics_opt_t {
+  int port;
+  const char *addr;
+  std::string (*render)(); // produces the body for GET /metrics
+};
+
+// serve the Prometheus text exposition format over HTTP; does not return
+int metricsserver(metrics_opt_t *opt);
+
+#endif
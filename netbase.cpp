@@ -1138,3 +1138,52 @@ void CService::SetPort(unsigned short portIn)
 {
     port = portIn;
 }
+
+CSubNet::CSubNet() : nBits(0), valid(false)
+{
+}
+
+CSubNet::CSubNet(const CNetAddr &addr, int nBitsIn) : nBits(nBitsIn), valid(nBitsIn >= 0 && nBitsIn <= 128)
+{
+    struct in6_addr addr6;
+    addr.GetIn6Addr(&addr6);
+    for (int i = 0; i < 16; i++)
+    {
+        int nKeep = std::max(0, std::min(8, nBits - i * 8));
+        addr6.s6_addr[i] &= (unsigned char)(0xFF00 >> nKeep);
+    }
+    network = CNetAddr(addr6);
+}
+
+CSubNet::CSubNet(const std::string &strSubnet) : nBits(128), valid(false)
+{
+    size_t slash = strSubnet.find_last_of('/');
+    std::vector<CNetAddr> vIP;
+    if (!LookupHostNumeric(strSubnet.substr(0, slash).c_str(), vIP, 1))
+        return;
+    int nPrefix = vIP[0].IsIPv4() ? 32 : 128;
+    if (slash != std::string::npos)
+    {
+        char *pEnd;
+        long n = strtol(strSubnet.c_str() + slash + 1, &pEnd, 10);
+        if (*pEnd != 0 || pEnd == strSubnet.c_str() + slash + 1 || n < 0 || n > nPrefix)
+            return;
+        nPrefix = n;
+    }
+    *this = CSubNet(vIP[0], vIP[0].IsIPv4() ? nPrefix + 96 : nPrefix);
+}
+
+bool CSubNet::Match(const CNetAddr &addr) const
+{
+    return valid && CSubNet(addr, nBits).network == network;
+}
+
+bool CSubNet::IsValid() const
+{
+    return valid;
+}
+
+std::string CSubNet::ToString() const
+{
+    return strprintf("%s/%i", network.ToStringIP().c_str(), network.IsIPv4() ? nBits - 96 : nBits);
+}
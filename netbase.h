@@ -130,6 +130,25 @@ class CService : public CNetAddr
             )
 };
 
+/** An IP network: an address with a prefix length over its 128-bit (IPv6) form */
+class CSubNet
+{
+    protected:
+        CNetAddr network; // host bits cleared
+        int nBits;        // 0..128; IPv4 prefixes are offset by 96
+        bool valid;
+
+    public:
+        CSubNet();
+        CSubNet(const CNetAddr &addr, int nBitsIn);
+        explicit CSubNet(const std::string &strSubnet); // "1.2.3.0/24", "2001:db8::/32" or a single address
+        bool Match(const CNetAddr &addr) const;
+        bool IsValid() const;
+        const CNetAddr &GetNetwork() const { return network; }
+        int GetBits() const { return nBits; }
+        std::string ToString() const;
+};
+
 enum Network ParseNetwork(std::string net);
 void SplitHostPort(std::string in, int &portOut, std::string &hostOut);
 bool SetProxy(enum Network net, CService addrProxy, int nSocksVersion = 5);
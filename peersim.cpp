@@ -0,0 +1,464 @@
+// Simulated Litecoin P2P network, to exercise the crawler offline.
+//
+// Peer i of the network is 127.1.0.0+i on the P2P port: a single listening
+// socket accepts connections for all of them and tells them apart by the
+// local address connected to. Peers answer version with version/verack and
+// getaddr with addresses of other simulated peers, after a per-peer latency;
+// some are offline, and some connections fail or get malformed messages.
+//
+// Point dnsseed at it with: dnsseed --benchmark -s 127.1.0.0 ...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+#include "serialize.h"
+#include "util.h"
+
+using namespace std;
+
+bool fTestNet = false;
+
+#define SIM_BASE_ADDR 0x7F010000 // 127.1.0.0
+#define SIM_MAX_PEERS (1 << 20)
+#define SIM_VERSION 70016
+
+class CPeerSimOpts {
+public:
+  int nPeers;
+  int nPort;
+  int nLatency;
+  int nOffline;
+  int nFail;
+  int nMalformed;
+  int nFanout;
+  unsigned int nSeed;
+  int fUseTestNet;
+  const char *magic;
+
+  CPeerSimOpts() : nPeers(1000), nPort(0), nLatency(50), nOffline(10), nFail(2), nMalformed(1), nFanout(100), nSeed(1), fUseTestNet(false), magic(NULL) {}
+
+  void ParseCommandLine(int argc, char **argv) {
+    static const char *help = "Simulated Litecoin P2P network for dnsseed benchmarks\n"
+                              "Usage: %s [-n <peers>] [-l <ms>] [-f <percent>] [-F <addresses>]\n"
+                              "\n"
+                              "Options:\n"
+                              "-n <peers>      Number of simulated peers (default 1000), at 127.1.0.0 and up\n"
+                              "-p <port>       P2P port to listen on (default: the network's)\n"
+                              "-l <ms>         Mean response latency (default 50); per peer it is\n"
+                              "                between half and 1.5 times this\n"
+                              "-o <percent>    Peers that are offline (default 10)\n"
+                              "-f <percent>    Connections that fail right away (default 2)\n"
+                              "-x <percent>    Connections that get a malformed message (default 1)\n"
+                              "-F <addresses>  Addresses in a reply to getaddr (default 100)\n"
+                              "-r <seed>       Random seed (default 1); the same seed gives the same network\n"
+                              "--magic <hex>   Magic string/network prefix\n"
+                              "--testnet       Use testnet\n"
+                              "-?, --help      Show this text\n"
+                              "\n";
+    bool showHelp = false;
+
+    while(1) {
+      static struct option long_options[] = {
+        {"peers", required_argument, 0, 'n'},
+        {"port", required_argument, 0, 'p'},
+        {"latency", required_argument, 0, 'l'},
+        {"offline", required_argument, 0, 'o'},
+        {"fail", required_argument, 0, 'f'},
+        {"malformed", required_argument, 0, 'x'},
+        {"fanout", required_argument, 0, 'F'},
+        {"seed", required_argument, 0, 'r'},
+        {"magic", required_argument, 0, 'q'},
+        {"testnet", no_argument, &fUseTestNet, 1},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+      };
+      int option_index = 0;
+      int c = getopt_long(argc, argv, "n:p:l:o:f:x:F:r:", long_options, &option_index);
+      if (c == -1) break;
+      switch (c) {
+        case 'n': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0 && n <= SIM_MAX_PEERS) nPeers = n;
+          break;
+        }
+        case 'p': {
+          int p = strtol(optarg, NULL, 10);
+          if (p > 0 && p < 65536) nPort = p;
+          break;
+        }
+        case 'l': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0) nLatency = n;
+          break;
+        }
+        case 'o': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 100) nOffline = n;
+          break;
+        }
+        case 'f': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 100) nFail = n;
+          break;
+        }
+        case 'x': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 100) nMalformed = n;
+          break;
+        }
+        case 'F': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 1000) nFanout = n;
+          break;
+        }
+        case 'r': {
+          nSeed = strtoul(optarg, NULL, 10);
+          break;
+        }
+        case 'q': {
+          long int n;
+          if ((n = strtol(optarg, NULL, 16)) != 0) {
+            magic = optarg;
+          }
+          break;
+        }
+        case '?': {
+          showHelp = true;
+          break;
+        }
+      }
+    }
+    if (showHelp) {
+      fprintf(stderr, help, argv[0]);
+      exit(0);
+    }
+  }
+};
+
+static CPeerSimOpts opts;
+
+static uint64_t Mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+static uint64_t nRandState;
+static uint64_t Rand() {
+  return Mix(nRandState++);
+}
+
+// properties of a simulated peer, derived from the seed and its number
+struct CSimPeer {
+  bool fOffline;
+  uint64 nServices;
+  int nHeight;
+  int nLatency; // ms
+
+  CSimPeer(int id) {
+    uint64_t h = Mix(((uint64_t)opts.nSeed << 32) | id);
+    fOffline = (h % 100) < opts.nOffline;
+    h = Mix(h);
+    nServices = (h % 10) ? (NODE_NETWORK | NODE_WITNESS) : (NODE_NETWORK_LIMITED | NODE_WITNESS);
+    h = Mix(h);
+    nHeight = GetRequireHeight() + h % 1000;
+    h = Mix(h);
+    nLatency = opts.nLatency / 2 + (opts.nLatency ? h % (opts.nLatency + 1) : 0);
+  }
+
+  static int GetRequireHeight() { return fTestNet ? 3220000 : 2660000; }
+};
+
+static CService PeerAddress(int id) {
+  struct in_addr addr;
+  addr.s_addr = htonl(SIM_BASE_ADDR + id);
+  return CService(CNetAddr(addr), opts.nPort);
+}
+
+struct CSimConn {
+  int fd;
+  int peer;
+  bool fMalformed;
+  string in;
+  string out;
+  multimap<int64, string> pending; // messages to send, by time due (ms)
+};
+
+static map<int, CSimConn> mapConn;
+// (time due, fd), earliest first
+static priority_queue<pair<int64, int>, vector<pair<int64, int> >, greater<pair<int64, int> > > queueDue;
+static int epfd;
+static uint64_t nConnections = 0, nRefused = 0, nMalformed = 0, nVersions = 0, nAddrs = 0;
+
+static void Message(string &out, const char *command, const CDataStream &payload) {
+  CMessageHeader hdr(command, payload.size());
+  uint256 hash = Hash(payload.begin(), payload.end());
+  memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+  CDataStream msg(SER_NETWORK, PROTOCOL_VERSION);
+  msg << hdr;
+  out.append(&msg[0], msg.size());
+  if (payload.size())
+    out.append(&payload[0], payload.size());
+}
+
+static void Queue(CSimConn &conn, int64 due, const string &data) {
+  conn.pending.insert(make_pair(due, data));
+  queueDue.push(make_pair(due, conn.fd));
+}
+
+static void Close(int fd) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  mapConn.erase(fd);
+}
+
+static bool Flush(CSimConn &conn) {
+  while (!conn.out.empty()) {
+    ssize_t n = send(conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+      break;
+    }
+    conn.out.erase(0, n);
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (conn.out.empty() ? 0 : EPOLLOUT);
+  ev.data.fd = conn.fd;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+  return true;
+}
+
+static void ProcessMessage(CSimConn &conn, const string &strCommand, int64 now) {
+  CSimPeer peer(conn.peer);
+  int64 due = now + peer.nLatency;
+  string out;
+  if (strCommand == "version") {
+    nVersions++;
+    if (conn.fMalformed) {
+      // alternately an invalid command and an oversized message
+      CMessageHeader hdr("version", 0);
+      if (Rand() % 2) {
+        memset(hdr.pchCommand, 0x01, sizeof(hdr.pchCommand));
+      } else {
+        hdr.nMessageSize = MAX_SIZE + 1;
+      }
+      CDataStream msg(SER_NETWORK, PROTOCOL_VERSION);
+      msg << hdr;
+      out.append(&msg[0], msg.size());
+      nMalformed++;
+    } else {
+      CDataStream payload(SER_NETWORK, 209);
+      int64 nTime = time(NULL);
+      uint64 nNonce = Rand();
+      string ver = "/peersim:0.1/";
+      uint8_t fRelayTxs = 0;
+      int nVersion = SIM_VERSION;
+      CAddress you(CService("0.0.0.0"), 0), me(PeerAddress(conn.peer), peer.nServices);
+      payload << nVersion << peer.nServices << nTime << you << me << nNonce << ver << peer.nHeight << fRelayTxs;
+      Message(out, "version", payload);
+      Message(out, "verack", CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    }
+  } else if (strCommand == "getaddr") {
+    nAddrs++;
+    vector<CAddress> vAddr;
+    unsigned int now = time(NULL);
+    for (int i = 0; i < opts.nFanout; i++) {
+      int id = Rand() % opts.nPeers;
+      CAddress addr(PeerAddress(id), CSimPeer(id).nServices);
+      addr.nTime = now - Rand() % 86400;
+      vAddr.push_back(addr);
+    }
+    CDataStream payload(SER_NETWORK, PROTOCOL_VERSION);
+    payload << vAddr;
+    Message(out, "addr", payload);
+  }
+  if (!out.empty())
+    Queue(conn, due, out);
+}
+
+// returns false if the connection is to be closed
+static bool Receive(CSimConn &conn, int64 now) {
+  char buf[65536];
+  ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    return false;
+  if (n > 0)
+    conn.in.append(buf, n);
+  const size_t nHeaderSize = 24;
+  while (conn.in.size() >= nHeaderSize) {
+    if (memcmp(conn.in.data(), pchMessageStart, sizeof(pchMessageStart)) != 0)
+      return false;
+    char command[CMessageHeader::COMMAND_SIZE + 1] = {};
+    memcpy(command, conn.in.data() + 4, CMessageHeader::COMMAND_SIZE);
+    unsigned int nSize;
+    memcpy(&nSize, conn.in.data() + 16, sizeof(nSize));
+    if (nSize > MAX_SIZE)
+      return false;
+    if (conn.in.size() < nHeaderSize + nSize)
+      break;
+    conn.in.erase(0, nHeaderSize + nSize);
+    ProcessMessage(conn, command, now);
+  }
+  return true;
+}
+
+static void Accept(int listenSocket) {
+  while (1) {
+    int fd = accept(listenSocket, NULL, NULL);
+    if (fd == -1)
+      return;
+    struct sockaddr_in6 local;
+    socklen_t len = sizeof(local);
+    int peer = -1;
+    if (getsockname(fd, (struct sockaddr*)&local, &len) == 0) {
+      CService addr;
+      if (addr.SetSockAddr((struct sockaddr*)&local)) {
+        struct in_addr a4;
+        if (addr.GetInAddr(&a4))
+          peer = (int)(ntohl(a4.s_addr) - SIM_BASE_ADDR);
+      }
+    }
+    nConnections++;
+    if (peer < 0 || peer >= opts.nPeers || CSimPeer(peer).fOffline || Rand() % 100 < (uint64_t)opts.nFail) {
+      nRefused++;
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    CSimConn &conn = mapConn[fd];
+    conn.fd = fd;
+    conn.peer = peer;
+    conn.fMalformed = Rand() % 100 < (uint64_t)opts.nMalformed;
+    conn.in.clear();
+    conn.out.clear();
+    conn.pending.clear();
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+static int64 GetTimeMs() {
+  return GetTimeNanos() / 1000000;
+}
+
+int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+  setbuf(stdout, NULL);
+  opts.ParseCommandLine(argc, argv);
+  if (opts.fUseTestNet) {
+    pchMessageStart[0] = 0xfd;
+    pchMessageStart[1] = 0xd2;
+    pchMessageStart[2] = 0xc8;
+    pchMessageStart[3] = 0xf1;
+    fTestNet = true;
+  }
+  if (opts.magic) {
+    for (int n=0; n<4; ++n) {
+      unsigned int c = 0;
+      sscanf(&opts.magic[n*2], "%2x", &c);
+      pchMessageStart[n] = (unsigned char) (c & 0xff);
+    }
+  }
+  if (!opts.nPort)
+    opts.nPort = GetDefaultPort();
+  nRandState = Mix(opts.nSeed);
+
+  // every connection is a file descriptor
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  int listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  int sockopt = 1;
+  setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof sockopt);
+  struct sockaddr_in si_me;
+  memset(&si_me, 0, sizeof(si_me));
+  si_me.sin_family = AF_INET;
+  si_me.sin_port = htons(opts.nPort);
+  si_me.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(listenSocket, (struct sockaddr*)&si_me, sizeof(si_me)) == -1 || listen(listenSocket, 4096) == -1) {
+    perror("bind");
+    return 1;
+  }
+  fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL, 0) | O_NONBLOCK);
+  epfd = epoll_create1(0);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = listenSocket;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listenSocket, &ev);
+
+  struct in_addr last;
+  last.s_addr = htonl(SIM_BASE_ADDR + opts.nPeers - 1);
+  printf("Simulating %i peers at 127.1.0.0-%s port %i\n", opts.nPeers, inet_ntoa(last), opts.nPort);
+
+  int64 nNextReport = GetTimeMs() + 10000;
+  struct epoll_event events[256];
+  while (1) {
+    int64 now = GetTimeMs();
+    int timeout = 1000;
+    if (!queueDue.empty())
+      timeout = queueDue.top().first > now ? queueDue.top().first - now : 0;
+    int n = epoll_wait(epfd, events, 256, timeout);
+    now = GetTimeMs();
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == listenSocket) {
+        Accept(listenSocket);
+        continue;
+      }
+      map<int, CSimConn>::iterator it = mapConn.find(fd);
+      if (it == mapConn.end())
+        continue;
+      bool fKeep = !(events[i].events & (EPOLLERR | EPOLLHUP));
+      if (fKeep && (events[i].events & EPOLLIN))
+        fKeep = Receive(it->second, now);
+      if (fKeep && (events[i].events & EPOLLOUT))
+        fKeep = Flush(it->second);
+      if (!fKeep)
+        Close(fd);
+    }
+    // release delayed messages
+    while (!queueDue.empty() && queueDue.top().first <= now) {
+      int fd = queueDue.top().second;
+      queueDue.pop();
+      map<int, CSimConn>::iterator it = mapConn.find(fd);
+      if (it == mapConn.end())
+        continue;
+      CSimConn &conn = it->second;
+      while (!conn.pending.empty() && conn.pending.begin()->first <= now) {
+        conn.out += conn.pending.begin()->second;
+        conn.pending.erase(conn.pending.begin());
+      }
+      if (!Flush(conn))
+        Close(fd);
+    }
+    if (now >= nNextReport) {
+      printf("%llu connections (%llu refused), %llu versions (%llu malformed), %llu getaddrs, %i open\n", (unsigned long long)nConnections, (unsigned long long)nRefused, (unsigned long long)nVersions, (unsigned long long)nMalformed, (unsigned long long)nAddrs, (int)mapConn.size());
+      nNextReport += 10000;
+    }
+  }
+  return 0;
+}
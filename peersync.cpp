@@ -0,0 +1,177 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+
+#include "peersync.h"
+
+using namespace std;
+
+#define SYNC_MAX_PACKET 1400  // bytes of payload per datagram, below common MTUs
+#define SYNC_MAX_QUEUE 65536  // queued items per type before new ones are dropped
+#define SYNC_INTERVAL 200     // ms between sends
+
+enum {
+  SYNC_RESULTS = 1,
+  SYNC_ADDRS = 2,
+};
+
+bool CPeerSync::Bind(const char *addr, int port) {
+  sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock == -1)
+    return false;
+  struct sockaddr_in6 si_me;
+  memset(&si_me, 0, sizeof(si_me));
+  si_me.sin6_family = AF_INET6;
+  si_me.sin6_port = htons(port);
+  inet_pton(AF_INET6, addr, &si_me.sin6_addr);
+  if (bind(sock, (struct sockaddr*)&si_me, sizeof(si_me)) == -1) {
+    close(sock);
+    sock = -1;
+    return false;
+  }
+  return true;
+}
+
+void CPeerSync::QueueResults(const vector<CServiceResult> &ips) {
+  vector<CSyncResult> vResult(ips.size());
+  for (int i = 0; i < ips.size(); i++) {
+    CSyncResult &res = vResult[i];
+    res.service = ips[i].service;
+    res.services = ips[i].services;
+    res.fGood = ips[i].fGood;
+    res.nBanTime = ips[i].nBanTime;
+    res.nHeight = ips[i].nHeight;
+    res.nClientV = ips[i].nClientV;
+    res.clientSubVersion = subVersionTable.Get(ips[i].nClientSV);
+  }
+  CRITICAL_BLOCK(cs) {
+    if (vResultQueue.size() < SYNC_MAX_QUEUE)
+      vResultQueue.insert(vResultQueue.end(), vResult.begin(), vResult.end());
+  }
+}
+
+void CPeerSync::QueueAddrs(const vector<CAddress> &vAddr) {
+  if (vAddr.empty())
+    return;
+  CRITICAL_BLOCK(cs) {
+    if (vAddrQueue.size() < SYNC_MAX_QUEUE)
+      vAddrQueue.insert(vAddrQueue.end(), vAddr.begin(), vAddr.end());
+  }
+}
+
+// split v into datagrams of at most SYNC_MAX_PACKET bytes
+template<typename T>
+static void MakePackets(unsigned char nType, const vector<T> &v, vector<string> &packets) {
+  size_t i = 0;
+  while (i < v.size()) {
+    vector<T> batch;
+    unsigned int nSize = sizeof(pchMessageStart) + 1 + 3; // magic, type, count
+    while (i < v.size()) {
+      unsigned int n = ::GetSerializeSize(v[i], SER_NETWORK, PROTOCOL_VERSION);
+      if (!batch.empty() && nSize + n > SYNC_MAX_PACKET)
+        break;
+      batch.push_back(v[i++]);
+      nSize += n;
+    }
+    CDataStream s(SER_NETWORK, PROTOCOL_VERSION);
+    s << FLATDATA(pchMessageStart) << nType << batch;
+    packets.push_back(string(s.begin(), s.end()));
+  }
+}
+
+void CPeerSync::Send(const string &packet) {
+  for (int i = 0; i < vPeers.size(); i++) {
+    struct sockaddr_in6 si_peer;
+    memset(&si_peer, 0, sizeof(si_peer));
+    si_peer.sin6_family = AF_INET6;
+    si_peer.sin6_port = htons(vPeers[i].GetPort());
+    vPeers[i].GetIn6Addr(&si_peer.sin6_addr);
+    if (sendto(sock, packet.data(), packet.size(), 0, (struct sockaddr*)&si_peer, sizeof(si_peer)) > 0)
+      ++nSentPackets;
+  }
+}
+
+void CPeerSync::SendBatches() {
+  vector<CSyncResult> vResult;
+  vector<CAddress> vAddr;
+  CRITICAL_BLOCK(cs) {
+    vResult.swap(vResultQueue);
+    vAddr.swap(vAddrQueue);
+  }
+  vector<string> packets;
+  MakePackets(SYNC_RESULTS, vResult, packets);
+  MakePackets(SYNC_ADDRS, vAddr, packets);
+  for (int i = 0; i < packets.size(); i++)
+    Send(packets[i]);
+  nSentResults += vResult.size();
+  nSentAddrs += vAddr.size();
+}
+
+void CPeerSync::Receive(const unsigned char *data, int len) {
+  CDataStream s((const char*)data, (const char*)data + len, SER_NETWORK, PROTOCOL_VERSION);
+  try {
+    unsigned char magic[sizeof(pchMessageStart)];
+    unsigned char nType;
+    s >> FLATDATA(magic) >> nType;
+    if (memcmp(magic, pchMessageStart, sizeof(magic)) != 0) {
+      ++nRecvDropped;
+      return;
+    }
+    if (nType == SYNC_RESULTS) {
+      vector<CSyncResult> vResult;
+      s >> vResult;
+      vector<CServiceResult> ips(vResult.size());
+      for (int i = 0; i < vResult.size(); i++) {
+        CServiceResult &ip = ips[i];
+        ip.service = vResult[i].service;
+        ip.services = vResult[i].services;
+        ip.fGood = vResult[i].fGood;
+        ip.nBanTime = vResult[i].nBanTime;
+        ip.nHeight = vResult[i].nHeight;
+        ip.nClientV = vResult[i].nClientV;
+        ip.nClientSV = subVersionTable.Intern(vResult[i].clientSubVersion);
+        ip.ourLastSuccess = 0;
+      }
+      db.RemoteResultMany(ips);
+      nRecvResults += ips.size();
+    } else if (nType == SYNC_ADDRS) {
+      vector<CAddress> vAddr;
+      s >> vAddr;
+      db.Add(vAddr);
+      nRecvAddrs += vAddr.size();
+    } else {
+      ++nRecvDropped;
+      return;
+    }
+    ++nRecvPackets;
+  } catch (std::ios_base::failure &e) {
+    ++nRecvDropped;
+  }
+}
+
+void CPeerSync::RunSender() {
+  do {
+    Sleep(SYNC_INTERVAL);
+    SendBatches();
+  } while(1);
+}
+
+void CPeerSync::RunReceiver() {
+  unsigned char buf[65536];
+  do {
+    struct sockaddr_in6 si_other;
+    socklen_t len = sizeof(si_other);
+    int n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*)&si_other, &len);
+    if (n <= 0)
+      continue;
+    if (find(vPeers.begin(), vPeers.end(), CService(si_other)) == vPeers.end()) {
+      ++nRecvDropped;
+      continue;
+    }
+    Receive(buf, n);
+  } while(1);
+}
@@ -0,0 +1,77 @@
+#ifndef _PEERSYNC_H_
+#define _PEERSYNC_H_ 1
+
+#include <string>
+#include <vector>
+
+#include "db.h"
+#include "metrics.h"
+
+// A probe result as sent to other seeders (CServiceResult with the
+// subversion itself instead of its local id).
+class CSyncResult {
+public:
+  CService service;
+  uint64 services;
+  bool fGood;
+  int nBanTime;
+  int nHeight;
+  int nClientV;
+  std::string clientSubVersion;
+
+  IMPLEMENT_SERIALIZE (
+    READWRITE(service);
+    READWRITE(services);
+    READWRITE(fGood);
+    READWRITE(nBanTime);
+    READWRITE(nHeight);
+    READWRITE(nClientV);
+    READWRITE(clientSubVersion);
+  )
+};
+
+// Cluster mode: exchange probe results and newly learned addresses with
+// the other seeders of a cluster over UDP, so that each seeder only has to
+// probe its shard of the address space (see CAddrDb::SetShard) while all
+// of them answer DNS from the full node list.
+//
+// A datagram is the network magic, a message type, and a vector of
+// CSyncResult or CAddress, batched up to SYNC_MAX_PACKET bytes. Only
+// datagrams from the configured peers are accepted; the protocol has no
+// authentication beyond that, so keep it on a private network.
+class CPeerSync {
+private:
+  CAddrDb &db;
+  std::vector<CService> vPeers;
+  int sock;
+
+  CCriticalSection cs;
+  std::vector<CSyncResult> vResultQueue;
+  std::vector<CAddress> vAddrQueue;
+
+  void SendBatches();
+  void Send(const std::string &packet);
+  void Receive(const unsigned char *data, int len);
+
+public:
+  CStatCounter nSentResults;
+  CStatCounter nSentAddrs;
+  CStatCounter nSentPackets;
+  CStatCounter nRecvResults;
+  CStatCounter nRecvAddrs;
+  CStatCounter nRecvPackets;
+  CStatCounter nRecvDropped; // from unknown senders, or malformed
+
+  CPeerSync(CAddrDb &dbIn, const std::vector<CService> &vPeersIn) : db(dbIn), vPeers(vPeersIn), sock(-1) {}
+
+  // bind the UDP socket; returns false on failure
+  bool Bind(const char *addr, int port);
+
+  void QueueResults(const std::vector<CServiceResult> &ips);
+  void QueueAddrs(const std::vector<CAddress> &vAddr);
+
+  void RunSender();
+  void RunReceiver();
+};
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef _PREFIXTRIE_H_
+#define _PREFIXTRIE_H_ 1
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "netbase.h"
+
+// Longest-prefix-match table over the 128-bit form of CNetAddr, as a
+// path-compressed binary (radix) trie. Nodes live in a flat vector and
+// refer to each other by index; a lookup visits at most one node per
+// distinct prefix length on the path, doing two masked 64-bit compares
+// per node.
+template<typename T>
+class CPrefixTrie
+{
+private:
+    struct Node {
+        uint64_t hi, lo;  // prefix, bits past len are zero
+        int child[2];
+        int value;        // index into vValue, or -1
+        int len;
+    };
+
+    std::vector<Node> vNode;
+    std::vector<T> vValue;
+
+    static void Key(const CNetAddr &addr, uint64_t &hi, uint64_t &lo) {
+        struct in6_addr addr6;
+        addr.GetIn6Addr(&addr6);
+        hi = lo = 0;
+        for (int i = 0; i < 8; i++) {
+            hi = (hi << 8) | addr6.s6_addr[i];
+            lo = (lo << 8) | addr6.s6_addr[i + 8];
+        }
+    }
+    static int Bit(uint64_t hi, uint64_t lo, int n) {
+        return n < 64 ? (hi >> (63 - n)) & 1 : (lo >> (127 - n)) & 1;
+    }
+    static uint64_t MaskHi(int len) { return len <= 0 ? 0 : len >= 64 ? ~(uint64_t)0 : ~(~(uint64_t)0 >> len); }
+    static uint64_t MaskLo(int len) { return MaskHi(len - 64); }
+    static bool Matches(const Node &node, uint64_t hi, uint64_t lo) {
+        return ((node.hi ^ hi) & MaskHi(node.len)) == 0 && ((node.lo ^ lo) & MaskLo(node.len)) == 0;
+    }
+    static int CommonBits(uint64_t ahi, uint64_t alo, uint64_t bhi, uint64_t blo) {
+        if (ahi != bhi) return __builtin_clzll(ahi ^ bhi);
+        if (alo != blo) return 64 + __builtin_clzll(alo ^ blo);
+        return 128;
+    }
+    int NewNode(uint64_t hi, uint64_t lo, int len) {
+        Node node;
+        node.hi = hi & MaskHi(len);
+        node.lo = lo & MaskLo(len);
+        node.child[0] = node.child[1] = -1;
+        node.value = -1;
+        node.len = len;
+        vNode.push_back(node);
+        return vNode.size() - 1;
+    }
+    void SetValue(int n, const T &value) {
+        if (vNode[n].value == -1) {
+            vNode[n].value = vValue.size();
+            vValue.push_back(value);
+        } else {
+            vValue[vNode[n].value] = value;
+        }
+    }
+
+public:
+    CPrefixTrie() { clear(); }
+
+    void clear() {
+        vNode.clear();
+        vValue.clear();
+        NewNode(0, 0, 0);
+    }
+
+    // number of stored prefixes
+    int size() const { return vValue.size(); }
+
+    // add or replace the value for addr/nBits (nBits over the 128-bit form)
+    void Insert(const CNetAddr &addr, int nBits, const T &value) {
+        uint64_t hi, lo;
+        Key(addr, hi, lo);
+        hi &= MaskHi(nBits);
+        lo &= MaskLo(nBits);
+        int n = 0;
+        while (vNode[n].len < nBits) {
+            int b = Bit(hi, lo, vNode[n].len);
+            int c = vNode[n].child[b];
+            if (c == -1) {
+                int leaf = NewNode(hi, lo, nBits);
+                vNode[n].child[b] = leaf;
+                SetValue(leaf, value);
+                return;
+            }
+            int l = CommonBits(hi, lo, vNode[c].hi, vNode[c].lo);
+            if (l > nBits) l = nBits;
+            if (l >= vNode[c].len) {
+                n = c;
+                continue;
+            }
+            // split the edge to c at bit l
+            int m = NewNode(hi, lo, l);
+            vNode[m].child[Bit(vNode[c].hi, vNode[c].lo, l)] = c;
+            vNode[n].child[b] = m;
+            if (l == nBits) {
+                SetValue(m, value);
+            } else {
+                int leaf = NewNode(hi, lo, nBits);
+                vNode[m].child[Bit(hi, lo, l)] = leaf;
+                SetValue(leaf, value);
+            }
+            return;
+        }
+        SetValue(n, value);
+    }
+
+    // value of the longest stored prefix containing addr, or NULL; if
+    // pnBits is given, it is set to the length of that prefix
+    const T *Lookup(const CNetAddr &addr, int *pnBits = NULL) const {
+        uint64_t hi, lo;
+        Key(addr, hi, lo);
+        const Node *node = &vNode[0];
+        int best = node->value, bestLen = 0;
+        while (node->len < 128) {
+            int c = node->child[Bit(hi, lo, node->len)];
+            if (c == -1 || !Matches(vNode[c], hi, lo))
+                break;
+            node = &vNode[c];
+            if (node->value != -1) {
+                best = node->value;
+                bestLen = node->len;
+            }
+        }
+        if (pnBits)
+            *pnBits = bestLen;
+        return best == -1 ? NULL : &vValue[best];
+    }
+};
+
+#endif
@@ -0,0 +1,108 @@
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "querylog.h"
+
+using namespace std;
+
+#define QLOG_INTERVAL 50 // ms between drains of the rings
+#define QLOG_BATCH 1024
+
+static const char *strAction[] = {"sent", "slipped", "dropped"};
+
+dns_qlog_t *CQueryLog::AddRing() {
+  dns_qlog_t *qlog = new dns_qlog_t();
+  vRing.push_back(qlog);
+  return qlog;
+}
+
+uint64_t CQueryLog::GetDropped() const {
+  uint64_t n = 0;
+  for (int i = 0; i < vRing.size(); i++)
+    n += vRing[i]->nDropped.Get();
+  return n;
+}
+
+bool CQueryLog::Open() {
+  // don't append to a previous log, which may be in another format
+  if (access(strPath.c_str(), F_OK) == 0)
+    rename(strPath.c_str(), strprintf("%s.%lld-%i", strPath.c_str(), (long long)time(NULL), nRotations++).c_str());
+  file = fopen(strPath.c_str(), "wb");
+  if (!file)
+    return false;
+  writer = new CBufferedWriter(file);
+  if (nFormat == QLOG_BINARY) {
+    CQueryLogHeader header = {QLOG_MAGIC, QLOG_VERSION, sizeof(dns_qrec_t), 0};
+    writer->Write((const char*)&header, sizeof(header));
+    nFileSize = sizeof(header);
+  } else {
+    string line = "time,client,qtype,flags,rcode,answers,size,action\n";
+    writer->Write(line);
+    nFileSize = line.size();
+  }
+  return true;
+}
+
+void CQueryLog::Close() {
+  bool fOk = writer->Flush();
+  delete writer;
+  writer = NULL;
+  if (fclose(file) != 0) fOk = false;
+  file = NULL;
+  if (!fOk)
+    printf("Failed to write %s\n", strPath.c_str());
+}
+
+void CQueryLog::Rotate() {
+  Close();
+  rename(strPath.c_str(), strprintf("%s.%lld-%i", strPath.c_str(), (long long)time(NULL), nRotations++).c_str());
+  if (!Open())
+    printf("Unable to open %s, query log stopped\n", strPath.c_str());
+}
+
+void CQueryLog::Write(const dns_qrec_t *rec, int n) {
+  if (nFormat == QLOG_BINARY) {
+    writer->Write((const char*)rec, n * sizeof(dns_qrec_t));
+    nFileSize += n * sizeof(dns_qrec_t);
+  } else {
+    for (int i = 0; i < n; i++) {
+      const dns_qrec_t &r = rec[i];
+      char client[INET6_ADDRSTRLEN];
+      unsigned char addr[16] = {};
+      if (r.family == 4) {
+        memcpy(addr, r.prefix, 3);
+        inet_ntop(AF_INET, addr, client, sizeof(client));
+      } else {
+        memcpy(addr, r.prefix, 7);
+        inet_ntop(AF_INET6, addr, client, sizeof(client));
+      }
+      char line[160];
+      int len = snprintf(line, sizeof(line), "%" PRId64 ".%06i,%s/%i,%i,%" PRIx64 ",%i,%i,%i,%s\n",
+                         r.time / 1000000, (int)(r.time % 1000000), client, r.family == 4 ? 24 : 56,
+                         r.qtype, r.flags, r.rcode, r.answers, r.size, r.action < 3 ? strAction[r.action] : "?");
+      writer->Write(line, len);
+      nFileSize += len;
+    }
+  }
+  nWritten += n;
+}
+
+void CQueryLog::Run() {
+  dns_qrec_t batch[QLOG_BATCH];
+  do {
+    Sleep(QLOG_INTERVAL);
+    if (!file)
+      continue;
+    for (int i = 0; i < vRing.size(); i++) {
+      int n;
+      while ((n = dns_qlog_pop(vRing[i], batch, QLOG_BATCH)) > 0)
+        Write(batch, n);
+    }
+    writer->Flush();
+    if (nFileSize >= nRotateSize)
+      Rotate();
+  } while(1);
+}
@@ -0,0 +1,61 @@
+#ifndef _QUERYLOG_H_
+#define _QUERYLOG_H_ 1
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "dns.h"
+#include "dump.h"
+
+enum {
+  QLOG_BINARY = 0, // header, then the dns_qrec_t as they are (host byte order)
+  QLOG_CSV = 1,    // header line, then one line per query
+};
+
+#define QLOG_MAGIC 0x474f4c51 // "QLOG"
+#define QLOG_VERSION 1
+
+struct CQueryLogHeader {
+  uint32_t nMagic;
+  uint32_t nVersion;
+  uint32_t nRecordSize; // sizeof(dns_qrec_t)
+  uint32_t nReserved;
+};
+
+// The query log: a writer thread drains the rings of the DNS threads
+// (dns_opt_t::qlog) into strPath. Once the file reaches nRotateSize bytes,
+// it is renamed to strPath.<time>-<n> and a new one is started. Records
+// of different DNS threads are not in time order.
+class CQueryLog {
+private:
+  std::vector<dns_qlog_t*> vRing;
+  std::string strPath;
+  int nFormat;
+  int64 nRotateSize;
+  FILE *file;
+  CBufferedWriter *writer;
+  int64 nFileSize;
+  int nRotations;
+
+  void Write(const dns_qrec_t *rec, int n);
+  void Close();
+  void Rotate();
+
+public:
+  CStatCounter nWritten;
+
+  CQueryLog(const std::string &strPathIn, int nFormatIn, int64 nRotateSizeIn) : strPath(strPathIn), nFormat(nFormatIn), nRotateSize(nRotateSizeIn), file(NULL), writer(NULL), nFileSize(0), nRotations(0) {}
+
+  // a new ring for a DNS thread; call before Run
+  dns_qlog_t *AddRing();
+  // records dropped because a ring was full
+  uint64_t GetDropped() const;
+
+  // start the file; returns false if it can't be created
+  bool Open();
+  void Run();
+};
+
+#endif
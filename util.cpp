@@ -30,6 +30,63 @@ string vstrprintf(const std::string &format, va_list ap)
     return str;
 }
 
+static std::atomic<CLockSite*> pfirstLockSite(NULL);
+
+CLockSite::CLockSite(const char *pszLockIn, const char *pszFileIn, int nLineIn) : pszLock(pszLockIn), pszFile(pszFileIn), nLine(nLineIn)
+{
+    for (int i = 0; i < 2; i++) {
+        nAcquired[i] = 0;
+        nContended[i] = 0;
+        nWaitNanos[i] = 0;
+        nHoldNanos[i] = 0;
+    }
+    pnext = pfirstLockSite.load();
+    while (!pfirstLockSite.compare_exchange_weak(pnext, this)) {}
+}
+
+CLockSite *CLockSite::GetFirst()
+{
+    return pfirstLockSite.load();
+}
+
+int CStringTable::Intern(const std::string &str)
+{
+    SHARED_CRITICAL_BLOCK(cs) {
+        std::map<std::string, int>::const_iterator it = mapId.find(str);
+        if (it != mapId.end())
+            return it->second;
+    }
+    CRITICAL_BLOCK(cs) {
+        std::map<std::string, int>::const_iterator it = mapId.find(str);
+        if (it != mapId.end())
+            return it->second;
+        if (vStr.size() >= nMaxSize)
+            return 0;
+        int id = vStr.size();
+        vStr.push_back(str);
+        mapId[str] = id;
+        return id;
+    }
+    return 0;
+}
+
+const std::string &CStringTable::Get(int id) const
+{
+    static const std::string strEmpty;
+    SHARED_CRITICAL_BLOCK(cs) {
+        if (id > 0 && id < vStr.size())
+            return vStr[id];
+    }
+    return strEmpty;
+}
+
+int CStringTable::size() const
+{
+    SHARED_CRITICAL_BLOCK(cs)
+        return vStr.size();
+    return 0;
+}
+
 string EncodeBase32(const unsigned char* pch, size_t len)
 {
     static const char *pbase32 = "abcdefghijklmnopqrstuvwxyz234567";
@@ -5,6 +5,11 @@
 #include <errno.h>
 #include <openssl/sha.h>
 #include <stdarg.h>
+#include <time.h>
+
+#include <atomic>
+#include <map>
+#include <deque>
 
 #include "uint256.h"
 
@@ -27,22 +32,76 @@
 #define INVALID_SOCKET      (SOCKET)(~0)
 #define SOCKET_ERROR        -1
 
+int64 static inline GetTimeNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Statistics of one CRITICAL_BLOCK/SHARED_CRITICAL_BLOCK call site, kept
+// when building with -DDEBUG_LOCKCONTENTION. Sites register themselves on
+// first use in a global list that is only ever prepended to, so it can be
+// walked without locking.
+class CLockSite
+{
+public:
+    const char *pszLock;
+    const char *pszFile;
+    int nLine;
+    // indexed by fShared
+    std::atomic<uint64_t> nAcquired[2];
+    std::atomic<uint64_t> nContended[2];
+    std::atomic<uint64_t> nWaitNanos[2];
+    std::atomic<uint64_t> nHoldNanos[2];
+    CLockSite *pnext;
+
+    CLockSite(const char *pszLockIn, const char *pszFileIn, int nLineIn);
+    static CLockSite *GetFirst();
+};
+
 // Wrapper to automatically initialize mutex
+// Acquisitions that have to wait are counted, together with the time spent
+// waiting; uncontended acquisitions only pay for a trylock.
 class CCriticalSection
 {
 protected:
     pthread_rwlock_t mutex;
+    std::atomic<uint64_t> nContended[2]; // indexed by fShared
+    std::atomic<uint64_t> nWaitNanos[2];
 public:
-    explicit CCriticalSection() { pthread_rwlock_init(&mutex, NULL); }
+    explicit CCriticalSection() {
+      pthread_rwlock_init(&mutex, NULL);
+      for (int i = 0; i < 2; i++) {
+        nContended[i] = 0;
+        nWaitNanos[i] = 0;
+      }
+    }
     ~CCriticalSection() { pthread_rwlock_destroy(&mutex); }
-    void Enter(bool fShared = false) { 
+    void Enter(bool fShared = false, CLockSite *psite = NULL) { 
+      if (psite)
+        psite->nAcquired[fShared].fetch_add(1, std::memory_order_relaxed);
+      if (fShared) {
+        if (pthread_rwlock_tryrdlock(&mutex) == 0) return;
+      } else {
+        if (pthread_rwlock_trywrlock(&mutex) == 0) return;
+      }
+      int64 nStart = GetTimeNanos();
       if (fShared) {
         pthread_rwlock_rdlock(&mutex);
       } else {
         pthread_rwlock_wrlock(&mutex);
       }
+      int64 nWait = GetTimeNanos() - nStart;
+      nContended[fShared].fetch_add(1, std::memory_order_relaxed);
+      nWaitNanos[fShared].fetch_add(nWait, std::memory_order_relaxed);
+      if (psite) {
+        psite->nContended[fShared].fetch_add(1, std::memory_order_relaxed);
+        psite->nWaitNanos[fShared].fetch_add(nWait, std::memory_order_relaxed);
+      }
     }
     void Leave() { pthread_rwlock_unlock(&mutex); }
+    uint64_t GetContended(bool fShared) const { return nContended[fShared].load(std::memory_order_relaxed); }
+    uint64_t GetWaitNanos(bool fShared) const { return nWaitNanos[fShared].load(std::memory_order_relaxed); }
 };
 
 // Automatically leave critical section when leaving block, needed for exception safety
@@ -50,17 +109,51 @@ class CCriticalBlock
 {
 protected:
     CCriticalSection* pcs;
+    CLockSite* psite;
+    bool fShared;
+    int64 nAcquired;
 public:
-    CCriticalBlock(CCriticalSection& cs, bool fShared = false) : pcs(&cs) { pcs->Enter(fShared); }
+    CCriticalBlock(CCriticalSection& cs, bool fSharedIn = false, CLockSite *psiteIn = NULL) : pcs(&cs), psite(psiteIn), fShared(fSharedIn) {
+      pcs->Enter(fShared, psite);
+      if (psite) nAcquired = GetTimeNanos();
+    }
     operator bool() const { return true; }
-    ~CCriticalBlock() { pcs->Leave(); }
+    ~CCriticalBlock() {
+      if (psite) psite->nHoldNanos[fShared].fetch_add(GetTimeNanos() - nAcquired, std::memory_order_relaxed);
+      pcs->Leave();
+    }
 };
 
+#ifdef DEBUG_LOCKCONTENTION
+// every expansion has its own lambda, and so its own static site
+#define LOCK_SITE(cs) ([]() { static CLockSite site(#cs, __FILE__, __LINE__); return &site; }())
+#else
+#define LOCK_SITE(cs) ((CLockSite*)NULL)
+#endif
+
 #define CRITICAL_BLOCK(cs)     \
-    if (CCriticalBlock criticalblock = CCriticalBlock(cs))
+    if (CCriticalBlock criticalblock = CCriticalBlock(cs, false, LOCK_SITE(cs)))
 
 #define SHARED_CRITICAL_BLOCK(cs)     \
-    if (CCriticalBlock criticalblock = CCriticalBlock(cs, true))
+    if (CCriticalBlock criticalblock = CCriticalBlock(cs, true, LOCK_SITE(cs)))
+
+// Thread-safe interning table for strings that repeat across many records
+// (e.g. client subversions). Ids are small and stable; entries are never
+// removed, so references returned by Get() stay valid. Id 0 is the empty
+// string, which is also returned once the table is full.
+class CStringTable
+{
+protected:
+    mutable CCriticalSection cs;
+    std::map<std::string, int> mapId;
+    std::deque<std::string> vStr;
+    int nMaxSize;
+public:
+    explicit CStringTable(int nMaxSizeIn = 65536) : nMaxSize(nMaxSizeIn) { vStr.push_back(""); mapId[""] = 0; }
+    int Intern(const std::string &str);
+    const std::string &Get(int id) const;
+    int size() const;
+};
 
 template<typename T1> inline uint256 Hash(const T1 pbegin, const T1 pend)
 {